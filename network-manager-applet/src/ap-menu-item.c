@@ -17,10 +17,14 @@
 #include "ap-menu-item.h"
 #include "nm-access-point.h"
 #include "mobile-helpers.h"
+#include "applet-trace.h"
+#include "utils.h"
 
 /* Only to get the NMU_SEC_SAE compat constant. */
 #include "wireless-security.h"
 
+extern guint strength_hysteresis;
+
 G_DEFINE_TYPE (NMNetworkMenuItem, nm_network_menu_item, GTK_TYPE_MENU_ITEM);
 
 #define NM_NETWORK_MENU_ITEM_GET_PRIVATE(o) (G_TYPE_INSTANCE_GET_PRIVATE ((o), NM_TYPE_NETWORK_MENU_ITEM, NMNetworkMenuItemPrivate))
@@ -32,11 +36,14 @@ typedef struct {
 
 	char *      ssid_string;
 	guint32     int_strength;
-	gchar *     hash;
+	int         bucket;
+	const char *icon_name;
+	guint64     hash;
 	GSList *    dupes;
 	gboolean    has_connections;
 	gboolean    is_adhoc;
 	gboolean    is_encrypted;
+	gboolean    is_active;
 } NMNetworkMenuItemPrivate;
 
 /******************************************************************/
@@ -80,19 +87,86 @@ update_atk_desc (NMNetworkMenuItem *item)
 	g_string_free (desc, TRUE);
 }
 
+/* The finished strength icons are shared by all menu items through
+ * caches on the applet, so that a strength change normally is just a
+ * lookup.  nma_icons_reload() empties them on theme or size changes;
+ * the scale factor is part of the key.
+ */
+static GdkPixbuf *
+get_strength_pixbuf (NMApplet *applet, const char *icon_name, gboolean encrypted, int icon_size)
+{
+	gs_free char *key = NULL;
+	gs_unref_object GdkPixbuf *icon_free = NULL;
+	GdkPixbuf *icon;
+
+	key = g_strdup_printf ("%s|%d|%d", icon_name, encrypted, icon_size);
+	icon = g_hash_table_lookup (applet->ap_icon_cache, key);
+	if (icon)
+		return icon;
+
+	icon = nma_icon_check_and_load (icon_name, applet);
+	if (!icon)
+		return NULL;
+
+	if (encrypted) {
+		GdkPixbuf *lock = nma_icon_check_and_load ("nm-secure-lock", applet);
+
+		if (lock) {
+			icon = icon_free = gdk_pixbuf_copy (icon);
+
+			gdk_pixbuf_composite (lock, icon, 0, 0,
+			                      gdk_pixbuf_get_width (lock),
+			                      gdk_pixbuf_get_height (lock),
+			                      0, 0, 1.0, 1.0,
+			                      GDK_INTERP_NEAREST, 255);
+		}
+	}
+
+	/* Scale to menu size if larger so the menu doesn't look awful */
+	if (gdk_pixbuf_get_height (icon) > icon_size || gdk_pixbuf_get_width (icon) > icon_size) {
+		icon = gdk_pixbuf_scale_simple (icon, icon_size, icon_size, GDK_INTERP_BILINEAR);
+		g_clear_object (&icon_free);
+		icon_free = icon;
+	} else if (!icon_free)
+		icon_free = g_object_ref (icon);
+
+	g_hash_table_insert (applet->ap_icon_cache, g_steal_pointer (&key), g_steal_pointer (&icon_free));
+	return icon;
+}
+
+static cairo_surface_t *
+get_strength_surface (NMApplet *applet, const char *icon_name, gboolean encrypted, int icon_size, int scale)
+{
+	gs_free char *key = NULL;
+	cairo_surface_t *surface;
+	GdkPixbuf *icon;
+
+	key = g_strdup_printf ("%s|%d|%d|%d", icon_name, encrypted, icon_size, scale);
+	surface = g_hash_table_lookup (applet->ap_surface_cache, key);
+	if (surface)
+		return surface;
+
+	icon = get_strength_pixbuf (applet, icon_name, encrypted, icon_size);
+	if (!icon)
+		return NULL;
+
+	surface = gdk_cairo_surface_create_from_pixbuf (icon, scale, NULL);
+	g_hash_table_insert (applet->ap_surface_cache, g_steal_pointer (&key), surface);
+	return surface;
+}
+
 static void
 update_icon (NMNetworkMenuItem *item, NMApplet *applet)
 {
 	NMNetworkMenuItemPrivate *priv = NM_NETWORK_MENU_ITEM_GET_PRIVATE (item);
-	gs_unref_object GdkPixbuf *icon_free = NULL, *icon_free2 = NULL;
-	GdkPixbuf *icon;
 	int icon_size, scale;
 	const char *icon_name = NULL;
 
 	if (priv->is_adhoc)
 		icon_name = "nm-adhoc";
 	else
-		icon_name = mobile_helper_get_quality_icon_name (priv->int_strength);
+		icon_name = mobile_helper_get_quality_bucket_icon_name (priv->bucket);
+	priv->icon_name = icon_name;
 
 	scale = gtk_widget_get_scale_factor (GTK_WIDGET (item));
 	icon_size = 24;
@@ -101,36 +175,14 @@ update_icon (NMNetworkMenuItem *item, NMApplet *applet)
 	} else
 		icon_size *= scale;
 
-	icon = nma_icon_check_and_load (icon_name, applet);
-	if (icon) {
-		if (priv->is_encrypted) {
-			GdkPixbuf *encrypted = nma_icon_check_and_load ("nm-secure-lock", applet);
-
-			if (encrypted) {
-				icon = icon_free = gdk_pixbuf_copy (icon);
-
-				gdk_pixbuf_composite (encrypted, icon, 0, 0,
-				                      gdk_pixbuf_get_width (encrypted),
-				                      gdk_pixbuf_get_height (encrypted),
-				                      0, 0, 1.0, 1.0,
-				                      GDK_INTERP_NEAREST, 255);
-			}
-		}
-
-		/* Scale to menu size if larger so the menu doesn't look awful */
-		if (gdk_pixbuf_get_height (icon) > icon_size || gdk_pixbuf_get_width (icon) > icon_size)
-			icon = icon_free2 = gdk_pixbuf_scale_simple (icon, icon_size, icon_size, GDK_INTERP_BILINEAR);
-	}
 
 	if (INDICATOR_ENABLED (applet)) {
 		/* app_indicator only uses GdkPixbuf */
-		gtk_image_set_from_pixbuf (GTK_IMAGE (priv->strength), icon);
+		gtk_image_set_from_pixbuf (GTK_IMAGE (priv->strength),
+		                           get_strength_pixbuf (applet, icon_name, priv->is_encrypted, icon_size));
 	} else {
-		cairo_surface_t *surface;
-
-		surface = gdk_cairo_surface_create_from_pixbuf (icon, scale, NULL);
-		gtk_image_set_from_surface (GTK_IMAGE (priv->strength), surface);
-		cairo_surface_destroy (surface);
+		gtk_image_set_from_surface (GTK_IMAGE (priv->strength),
+		                            get_strength_surface (applet, icon_name, priv->is_encrypted, icon_size, scale));
 	}
 }
 
@@ -140,23 +192,68 @@ nm_network_menu_item_set_strength (NMNetworkMenuItem *item,
                                    NMApplet *applet)
 {
 	NMNetworkMenuItemPrivate *priv;
+	int bucket;
 
 	g_return_if_fail (NM_IS_NETWORK_MENU_ITEM (item));
 
 	priv = NM_NETWORK_MENU_ITEM_GET_PRIVATE (item);
 
 	strength = MIN (strength, 100);
-	if (strength > priv->int_strength) {
-		priv->int_strength = strength;
+	if (strength <= priv->int_strength)
+		return;
+	priv->int_strength = strength;
+	update_atk_desc (item);
+
+	/* The icon only shows the bucket */
+	bucket = utils_strength_bucket (strength, priv->bucket, strength_hysteresis);
+	if (bucket == priv->bucket) {
+		nma_trace_count (NMA_TRACE_STRENGTH_SUPPRESSED);
+		return;
+	}
+
+	nma_trace_count (NMA_TRACE_STRENGTH_CHANGED);
+	priv->bucket = bucket;
+	update_icon (item, applet);
+}
+
+int
+nm_network_menu_item_get_strength_bucket (NMNetworkMenuItem *item)
+{
+	g_return_val_if_fail (NM_IS_NETWORK_MENU_ITEM (item), 0);
+
+	return NM_NETWORK_MENU_ITEM_GET_PRIVATE (item)->bucket;
+}
+
+/*
+ * nm_network_menu_item_set_previous_bucket
+ *
+ * Re-quantizes the item's strength with hysteresis against @previous, the
+ * bucket shown for the same network before the menu was rebuilt, so that
+ * a rebuild doesn't flip icons that would otherwise have stayed.
+ */
+void
+nm_network_menu_item_set_previous_bucket (NMNetworkMenuItem *item,
+                                          int previous,
+                                          NMApplet *applet)
+{
+	NMNetworkMenuItemPrivate *priv;
+	int bucket;
+
+	g_return_if_fail (NM_IS_NETWORK_MENU_ITEM (item));
+
+	priv = NM_NETWORK_MENU_ITEM_GET_PRIVATE (item);
+
+	bucket = utils_strength_bucket (priv->int_strength, previous, strength_hysteresis);
+	if (bucket != priv->bucket) {
+		priv->bucket = bucket;
 		update_icon (item, applet);
-		update_atk_desc (item);
 	}
 }
 
-const char *
+guint64
 nm_network_menu_item_get_hash (NMNetworkMenuItem *item)
 {
-	g_return_val_if_fail (NM_IS_NETWORK_MENU_ITEM (item), NULL);
+	g_return_val_if_fail (NM_IS_NETWORK_MENU_ITEM (item), 0);
 
 	return NM_NETWORK_MENU_ITEM_GET_PRIVATE (item)->hash;
 }
@@ -202,6 +299,7 @@ nm_network_menu_item_set_active (NMNetworkMenuItem *item, gboolean active)
 {
 	g_return_if_fail (NM_IS_NETWORK_MENU_ITEM (item));
 
+	NM_NETWORK_MENU_ITEM_GET_PRIVATE (item)->is_active = active;
 	update_label (item, active);
 }
 
@@ -243,12 +341,72 @@ nm_network_menu_item_get_is_encrypted (NMNetworkMenuItem *item)
 	return NM_NETWORK_MENU_ITEM_GET_PRIVATE (item)->is_encrypted;
 }
 
+/*
+ * nm_network_menu_item_equal
+ *
+ * Whether two items for the same network look and behave the same, so
+ * that the menu can keep the one it already shows instead of swapping
+ * in a freshly built one.  Strength is compared by icon, since that is
+ * all the user sees of it.
+ */
+gboolean
+nm_network_menu_item_equal (NMNetworkMenuItem *a, NMNetworkMenuItem *b)
+{
+	NMNetworkMenuItemPrivate *priv_a, *priv_b;
+	GSList *first_a, *first_b;
+
+	g_return_val_if_fail (NM_IS_NETWORK_MENU_ITEM (a), FALSE);
+	g_return_val_if_fail (NM_IS_NETWORK_MENU_ITEM (b), FALSE);
+
+	priv_a = NM_NETWORK_MENU_ITEM_GET_PRIVATE (a);
+	priv_b = NM_NETWORK_MENU_ITEM_GET_PRIVATE (b);
+
+	if (   priv_a->hash != priv_b->hash
+	    || priv_a->is_active != priv_b->is_active
+	    || priv_a->has_connections != priv_b->has_connections
+	    || priv_a->is_adhoc != priv_b->is_adhoc
+	    || priv_a->is_encrypted != priv_b->is_encrypted)
+		return FALSE;
+
+	if (   g_strcmp0 (priv_a->ssid_string, priv_b->ssid_string)
+	    || g_strcmp0 (priv_a->icon_name, priv_b->icon_name))
+		return FALSE;
+
+	/* The item activates the AP it was created for, which is the
+	 * first one added to the dupes list.
+	 */
+	first_a = g_slist_last (priv_a->dupes);
+	first_b = g_slist_last (priv_b->dupes);
+	if (!first_a || !first_b)
+		return first_a == first_b;
+	return !strcmp (first_a->data, first_b->data);
+}
+
 /******************************************************************/
 
+/* Forgets the AP a pooled item was showing before */
+static void
+reset (NMNetworkMenuItem *item)
+{
+	NMNetworkMenuItemPrivate *priv = NM_NETWORK_MENU_ITEM_GET_PRIVATE (item);
+
+	g_clear_pointer (&priv->ssid_string, g_free);
+	g_slist_free_full (priv->dupes, g_free);
+	priv->dupes = NULL;
+	priv->int_strength = 0;
+	priv->bucket = 0;
+	priv->icon_name = NULL;
+	priv->hash = 0;
+	priv->has_connections = FALSE;
+	priv->is_adhoc = FALSE;
+	priv->is_encrypted = FALSE;
+	priv->is_active = FALSE;
+}
+
 GtkWidget *
 nm_network_menu_item_new (NMAccessPoint *ap,
                           guint32 dev_caps,
-                          const char *hash,
+                          guint64 hash,
                           gboolean has_connections,
                           NMApplet *applet)
 {
@@ -257,7 +415,11 @@ nm_network_menu_item_new (NMAccessPoint *ap,
 	guint32 ap_flags, ap_wpa, ap_rsn;
 	GBytes *ssid;
 
-	item = g_object_new (NM_TYPE_NETWORK_MENU_ITEM, NULL);
+	item = (NMNetworkMenuItem *) applet_menu_item_pool_take (applet, NM_TYPE_NETWORK_MENU_ITEM);
+	if (item)
+		reset (item);
+	else
+		item = g_object_new (NM_TYPE_NETWORK_MENU_ITEM, NULL);
 	g_assert (item);
 
 	priv = NM_NETWORK_MENU_ITEM_GET_PRIVATE (item);
@@ -273,8 +435,9 @@ nm_network_menu_item_new (NMAccessPoint *ap,
 		priv->ssid_string = g_strdup ("<unknown>");
 
 	priv->has_connections = has_connections;
-	priv->hash = g_strdup (hash);
-	priv->int_strength = nm_access_point_get_strength (ap);
+	priv->hash = hash;
+	priv->int_strength = MIN (nm_access_point_get_strength (ap), 100);
+	priv->bucket = utils_strength_bucket (priv->int_strength, -1, strength_hysteresis);
 
 	if (nm_access_point_get_mode (ap) == NM_802_11_MODE_ADHOC)
 		priv->is_adhoc = TRUE;
@@ -333,7 +496,6 @@ finalize (GObject *object)
 {
 	NMNetworkMenuItemPrivate *priv = NM_NETWORK_MENU_ITEM_GET_PRIVATE (object);
 
-	g_free (priv->hash);
 	g_free (priv->ssid_string);
 
 	g_slist_free_full (priv->dupes, g_free);
@@ -37,7 +37,7 @@ struct _NMNetworkMenuItemClass {
 GType	   nm_network_menu_item_get_type (void) G_GNUC_CONST;
 GtkWidget* nm_network_menu_item_new (NMAccessPoint *ap,
                                      guint32 dev_caps,
-                                     const char *hash,
+                                     guint64 hash,
                                      gboolean has_connections,
                                      NMApplet *applet);
 
@@ -50,7 +50,11 @@ guint32    nm_network_menu_item_get_strength (NMNetworkMenuItem *item);
 void       nm_network_menu_item_set_strength (NMNetworkMenuItem *item,
                                               guint8 strength,
                                               NMApplet *applet);
-const char *nm_network_menu_item_get_hash (NMNetworkMenuItem * item);
+int        nm_network_menu_item_get_strength_bucket (NMNetworkMenuItem *item);
+void       nm_network_menu_item_set_previous_bucket (NMNetworkMenuItem *item,
+                                                     int previous,
+                                                     NMApplet *applet);
+guint64    nm_network_menu_item_get_hash (NMNetworkMenuItem * item);
 
 gboolean   nm_network_menu_item_find_dupe (NMNetworkMenuItem *item,
                                            NMAccessPoint *ap);
@@ -63,5 +67,8 @@ void       nm_network_menu_item_set_active (NMNetworkMenuItem * item,
 
 gboolean   nm_network_menu_item_get_has_connections (NMNetworkMenuItem *item);
 
+gboolean   nm_network_menu_item_equal (NMNetworkMenuItem *a,
+                                       NMNetworkMenuItem *b);
+
 #endif /* __AP_MENU_ITEM_H__ */
 
@@ -12,6 +12,7 @@
 #include <libsecret/secret.h>
 
 #include "applet-agent.h"
+#include "applet-trace.h"
 #include "utils.h"
 
 #define KEYRING_UUID_TAG "connection-uuid"
@@ -37,6 +38,12 @@ typedef struct {
 	GHashTable *requests;
 	gboolean vpn_only;
 
+	GHashTable *cache;
+	guint cache_ttl;
+	GHashTable *prefetches;
+	GDBusConnection *session_bus;
+	guint lock_signal_ids[2];
+
 	gboolean disposed;
 } AppletAgentPrivate;
 
@@ -47,6 +54,8 @@ enum {
 };
 static guint signals[LAST_SIGNAL] = { 0 };
 
+static void watch_screen_lock (AppletAgent *agent);
+
 
 /*******************************************************/
 
@@ -66,8 +75,29 @@ typedef struct {
 
 	GCancellable *cancellable;
 	gint keyring_calls;
+
+	/* SaveItems not handed to the keyring yet */
+	GQueue save_queue;
 } Request;
 
+/* Keyring writes of one SaveSecrets request that may be in flight at once */
+#define SAVE_MAX_IN_FLIGHT 4
+
+typedef struct {
+	GHashTable *attrs;
+	char *label;
+	SecretValue *value;
+} SaveItem;
+
+static void
+save_item_free (SaveItem *item)
+{
+	g_hash_table_unref (item->attrs);
+	g_free (item->label);
+	secret_value_unref (item->value);
+	g_slice_free (SaveItem, item);
+}
+
 static Request *
 request_new (NMSecretAgentOld *agent,
              NMConnection *connection,
@@ -114,6 +144,8 @@ request_free (Request *r)
 	g_free (r->setting_name);
 	g_strfreev (r->hints);
 	g_object_unref (r->cancellable);
+	g_queue_foreach (&r->save_queue, (GFunc) save_item_free, NULL);
+	g_queue_clear (&r->save_queue);
 	memset (r, 0, sizeof (*r));
 	g_slice_free (Request, r);
 }
@@ -254,96 +286,204 @@ is_connection_always_ask (NMConnection *connection)
 	return FALSE;
 }
 
+/*******************************************************/
+
+/* Reconnecting 802.1X and similar connections asks for the same secrets
+ * over and over, and every time that is a keyring round-trip that may
+ * well have to wake up the keyring daemon first.  If enabled, the secrets
+ * found in the keyring are kept around for a short while.  They stay in
+ * the SecretValues libsecret returned them in, which live in locked memory
+ * that gets wiped when freed.
+ */
+
+typedef struct {
+	char *key;
+	SecretValue *value;
+} CachedSecret;
+
+typedef struct {
+	AppletAgentPrivate *priv;
+	char *cache_key;
+	GPtrArray *secrets;
+	guint timeout_id;
+	gboolean prefetched;
+} CacheEntry;
+
 static void
-keyring_find_secrets_cb (GObject *source,
-                         GAsyncResult *result,
-                         gpointer user_data)
+cached_secret_free (CachedSecret *secret)
 {
-	Request *r = user_data;
-	GError *error = NULL;
-	GError *search_error = NULL;
-	const char *connection_id = NULL;
-	GVariantBuilder builder_setting, builder_connection;
-	GVariant *settings = NULL;
-	GList *list = NULL;
-	GList *iter;
-	gboolean hint_found = FALSE, ask = FALSE;
+	g_free (secret->key);
+	secret_value_unref (secret->value);
+	g_slice_free (CachedSecret, secret);
+}
 
-	r->keyring_calls--;
-	if (g_cancellable_is_cancelled (r->cancellable)) {
-		/* Callback already called by NM or dispose */
-		request_free (r);
+static void
+cache_entry_free (CacheEntry *entry)
+{
+	nm_clear_g_source (&entry->timeout_id);
+	g_ptr_array_unref (entry->secrets);
+	g_free (entry->cache_key);
+	g_slice_free (CacheEntry, entry);
+}
+
+static gboolean
+cache_entry_expire_cb (gpointer user_data)
+{
+	CacheEntry *entry = user_data;
+
+	entry->timeout_id = 0;
+	g_hash_table_remove (entry->priv->cache, entry->cache_key);
+	return G_SOURCE_REMOVE;
+}
+
+/* Prefetched secrets are used once, and only if asked for within this
+ * many seconds.
+ */
+#define PREFETCH_TTL 30
+
+static void
+cache_insert (AppletAgentPrivate *priv,
+              const char *uuid,
+              const char *setting_name,
+              GPtrArray *secrets,
+              gboolean prefetched)
+{
+	CacheEntry *entry;
+	guint ttl;
+
+	ttl = prefetched ? PREFETCH_TTL : priv->cache_ttl;
+	if (!ttl || !secrets->len)
 		return;
+
+	if (!priv->cache) {
+		priv->cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+		                                     NULL, (GDestroyNotify) cache_entry_free);
 	}
 
-	list = secret_service_search_finish (NULL, result, &search_error);
-	connection_id = nm_connection_get_id (r->connection);
+	entry = g_slice_new0 (CacheEntry);
+	entry->priv = priv;
+	entry->cache_key = g_strdup_printf ("%s|%s", uuid, setting_name);
+	entry->secrets = g_ptr_array_ref (secrets);
+	entry->timeout_id = g_timeout_add_seconds (ttl, cache_entry_expire_cb, entry);
+	entry->prefetched = prefetched;
+	g_hash_table_replace (priv->cache, entry->cache_key, entry);
+}
 
-	if (g_error_matches (search_error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
-		error = g_error_new_literal (NM_SECRET_AGENT_ERROR,
-		                             NM_SECRET_AGENT_ERROR_USER_CANCELED,
-		                             "The secrets request was canceled by the user");
-		g_error_free (search_error);
-		goto done;
-	} else if (   (r->flags & NM_SECRET_AGENT_GET_SECRETS_FLAG_ALLOW_INTERACTION)
-	           && g_error_matches (search_error, G_DBUS_ERROR, G_DBUS_ERROR_SERVICE_UNKNOWN)) {
-		/* If the connection always asks for secrets, tolerate
-		 * keyring service not being present. */
-		g_clear_error (&search_error);
-	} else if (search_error) {
-		error = g_error_new (NM_SECRET_AGENT_ERROR,
-		                     NM_SECRET_AGENT_ERROR_FAILED,
-		                     "%s.%d - failed to read secrets from keyring (%s)",
-		                     __FILE__, __LINE__, search_error->message);
-		g_error_free (search_error);
-		goto done;
+static GPtrArray *
+cache_lookup (AppletAgentPrivate *priv,
+              const char *uuid,
+              const char *setting_name)
+{
+	gs_free char *cache_key = NULL;
+	CacheEntry *entry;
+	GPtrArray *secrets;
+
+	if (!priv->cache)
+		return NULL;
+
+	cache_key = g_strdup_printf ("%s|%s", uuid, setting_name);
+	entry = g_hash_table_lookup (priv->cache, cache_key);
+	if (!entry) {
+		if (priv->cache_ttl)
+			nma_trace_count (NMA_TRACE_SECRETS_CACHE_MISS);
+		return NULL;
 	}
 
-	/* Only ask if we're allowed to, so that eg a connection editor which
-	 * requests secrets for its UI, for a connection which doesn't have any
-	 * secrets yet, doesn't trigger the applet secrets dialog.
-	 */
-	if (   (r->flags & NM_SECRET_AGENT_GET_SECRETS_FLAG_ALLOW_INTERACTION)
-	    && g_list_length (list) == 0) {
-		g_message ("No keyring secrets found for %s/%s; asking user.", connection_id, r->setting_name);
-		ask_for_secrets (r);
+	secrets = g_ptr_array_ref (entry->secrets);
+	if (entry->prefetched) {
+		nma_trace_count (NMA_TRACE_SECRETS_PREFETCH_HIT);
+		g_hash_table_remove (priv->cache, cache_key);
+	} else
+		nma_trace_count (NMA_TRACE_SECRETS_CACHE_HIT);
+	return secrets;
+}
+
+static void
+cache_invalidate (AppletAgentPrivate *priv, const char *uuid)
+{
+	GHashTableIter iter;
+	CacheEntry *entry;
+	gsize len;
+
+	if (!priv->cache || !uuid)
 		return;
+
+	len = strlen (uuid);
+	g_hash_table_iter_init (&iter, priv->cache);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer) &entry)) {
+		if (   !strncmp (entry->cache_key, uuid, len)
+		    && entry->cache_key[len] == '|')
+			g_hash_table_iter_remove (&iter);
 	}
+}
 
-	g_variant_builder_init (&builder_setting, NM_VARIANT_TYPE_SETTING);
+/*******************************************************/
+
+static GPtrArray *
+secrets_from_items (GList *list)
+{
+	GPtrArray *secrets;
+	GList *iter;
+
+	secrets = g_ptr_array_new_with_free_func ((GDestroyNotify) cached_secret_free);
 
 	/* Extract the secrets from the list of matching keyring items */
 	for (iter = list; iter != NULL; iter = g_list_next (iter)) {
 		SecretItem *item = iter->data;
-		SecretValue *secret;
+		SecretValue *value;
+		CachedSecret *secret;
 		const char *key_name;
 		GHashTable *attributes;
 
-		secret = secret_item_get_secret (item);
-		if (secret) {
+		value = secret_item_get_secret (item);
+		if (value) {
 			attributes = secret_item_get_attributes (item);
 			key_name = g_hash_table_lookup (attributes, KEYRING_SK_TAG);
 			if (!key_name) {
 				g_hash_table_unref (attributes);
-				secret_value_unref (secret);
+				secret_value_unref (value);
 				continue;
 			}
 
-			g_variant_builder_add (&builder_setting, "{sv}", key_name,
-			                       g_variant_new_string (secret_value_get (secret, NULL)));
-
-			/* See if this property matches a given hint */
-			if (r->hints && r->hints[0]) {
-				if (!g_strcmp0 (r->hints[0], key_name) || !g_strcmp0 (r->hints[1], key_name))
-					hint_found = TRUE;
-			}
+			secret = g_slice_new (CachedSecret);
+			secret->key = g_strdup (key_name);
+			secret->value = value;
+			g_ptr_array_add (secrets, secret);
 
 			g_hash_table_unref (attributes);
-			secret_value_unref (secret);
 			break;
 		}
 	}
 
+	return secrets;
+}
+
+static void
+request_return_secrets (Request *r, GPtrArray *secrets)
+{
+	const char *connection_id;
+	GVariantBuilder builder_setting, builder_connection;
+	GVariant *settings;
+	gboolean hint_found = FALSE, ask = FALSE;
+	guint i;
+
+	connection_id = nm_connection_get_id (r->connection);
+
+	g_variant_builder_init (&builder_setting, NM_VARIANT_TYPE_SETTING);
+
+	for (i = 0; i < secrets->len; i++) {
+		CachedSecret *secret = secrets->pdata[i];
+
+		g_variant_builder_add (&builder_setting, "{sv}", secret->key,
+		                       g_variant_new_string (secret_value_get (secret->value, NULL)));
+
+		/* See if this property matches a given hint */
+		if (r->hints && r->hints[0]) {
+			if (!g_strcmp0 (r->hints[0], secret->key) || !g_strcmp0 (r->hints[1], secret->key))
+				hint_found = TRUE;
+		}
+	}
+
 	/* If there were hints, and none of the hints were returned by the keyring,
 	 * get some new secrets.
 	 */
@@ -363,10 +503,8 @@ keyring_find_secrets_cb (GObject *source,
 	 */
 	g_variant_builder_init (&builder_connection, NM_VARIANT_TYPE_CONNECTION);
 	g_variant_builder_add (&builder_connection, "{sa{sv}}", r->setting_name, &builder_setting);
-	settings = g_variant_builder_end (&builder_connection);
+	settings = g_variant_ref_sink (g_variant_builder_end (&builder_connection));
 
-done:
-	g_list_free_full (list, g_object_unref);
 	if (ask) {
 		GVariantIter dict_iter;
 		const char *setting_name;
@@ -385,15 +523,283 @@ done:
 		ask_for_secrets (r);
 	} else {
 		/* Otherwise send the secrets back to NetworkManager */
-		r->get_callback (NM_SECRET_AGENT_OLD (r->agent), r->connection, error ? NULL : settings, error, r->callback_data);
+		r->get_callback (NM_SECRET_AGENT_OLD (r->agent), r->connection, settings, NULL, r->callback_data);
+		request_free (r);
+	}
+
+	g_variant_unref (settings);
+}
+
+static void
+keyring_find_secrets_cb (GObject *source,
+                         GAsyncResult *result,
+                         gpointer user_data)
+{
+	Request *r = user_data;
+	GError *error = NULL;
+	GError *search_error = NULL;
+	const char *connection_id = NULL;
+	GPtrArray *secrets;
+	GList *list = NULL;
+
+	r->keyring_calls--;
+	if (g_cancellable_is_cancelled (r->cancellable)) {
+		/* Callback already called by NM or dispose */
 		request_free (r);
+		return;
+	}
+
+	list = secret_service_search_finish (NULL, result, &search_error);
+	connection_id = nm_connection_get_id (r->connection);
+
+	if (g_error_matches (search_error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+		error = g_error_new_literal (NM_SECRET_AGENT_ERROR,
+		                             NM_SECRET_AGENT_ERROR_USER_CANCELED,
+		                             "The secrets request was canceled by the user");
+		g_error_free (search_error);
+		goto error;
+	} else if (   (r->flags & NM_SECRET_AGENT_GET_SECRETS_FLAG_ALLOW_INTERACTION)
+	           && g_error_matches (search_error, G_DBUS_ERROR, G_DBUS_ERROR_SERVICE_UNKNOWN)) {
+		/* If the connection always asks for secrets, tolerate
+		 * keyring service not being present. */
+		g_clear_error (&search_error);
+	} else if (search_error) {
+		error = g_error_new (NM_SECRET_AGENT_ERROR,
+		                     NM_SECRET_AGENT_ERROR_FAILED,
+		                     "%s.%d - failed to read secrets from keyring (%s)",
+		                     __FILE__, __LINE__, search_error->message);
+		g_error_free (search_error);
+		goto error;
+	}
+
+	/* Only ask if we're allowed to, so that eg a connection editor which
+	 * requests secrets for its UI, for a connection which doesn't have any
+	 * secrets yet, doesn't trigger the applet secrets dialog.
+	 */
+	if (   (r->flags & NM_SECRET_AGENT_GET_SECRETS_FLAG_ALLOW_INTERACTION)
+	    && g_list_length (list) == 0) {
+		g_message ("No keyring secrets found for %s/%s; asking user.", connection_id, r->setting_name);
+		ask_for_secrets (r);
+		return;
+	}
+
+	secrets = secrets_from_items (list);
+	g_list_free_full (list, g_object_unref);
+
+	cache_insert (APPLET_AGENT_GET_PRIVATE (r->agent),
+	              nm_connection_get_uuid (r->connection),
+	              r->setting_name,
+	              secrets,
+	              FALSE);
+	request_return_secrets (r, secrets);
+	g_ptr_array_unref (secrets);
+	return;
+
+error:
+	g_list_free_full (list, g_object_unref);
+	r->get_callback (NM_SECRET_AGENT_OLD (r->agent), r->connection, NULL, error, r->callback_data);
+	request_free (r);
+	g_error_free (error);
+}
+
+static void
+request_search_keyring (Request *r)
+{
+	GHashTable *attrs;
+
+	/* For everything else we scrape the keyring for secrets first, and ask
+	 * later if required.
+	 */
+	attrs = secret_attributes_build (&network_manager_secret_schema,
+	                                 KEYRING_UUID_TAG, nm_connection_get_uuid (r->connection),
+	                                 KEYRING_SN_TAG, r->setting_name,
+	                                 NULL);
+
+	secret_service_search (NULL, &network_manager_secret_schema, attrs,
+	                       SECRET_SEARCH_ALL | SECRET_SEARCH_UNLOCK | SECRET_SEARCH_LOAD_SECRETS,
+	                       r->cancellable, keyring_find_secrets_cb, r);
+
+	r->keyring_calls++;
+	g_hash_table_unref (attrs);
+}
+
+/*******************************************************/
+
+/* NetworkManager only asks for secrets once the device is well into
+ * activation, and only then would the keyring be searched.  When the
+ * applet sees an activation start it can look the secrets up right away;
+ * the result is kept for a little while for the GetSecrets that is
+ * likely to follow, and a GetSecrets arriving while the lookup is still
+ * running waits for it instead of starting its own.
+ */
+
+typedef struct {
+	AppletAgentPrivate *priv;
+	char *uuid;
+	char *setting_name;
+	char *cache_key;
+	GCancellable *cancellable;
+	GSList *waiting;
+} Prefetch;
+
+static void
+prefetch_free (Prefetch *prefetch)
+{
+	g_free (prefetch->uuid);
+	g_free (prefetch->setting_name);
+	g_free (prefetch->cache_key);
+	g_object_unref (prefetch->cancellable);
+	g_slist_free (prefetch->waiting);
+	g_slice_free (Prefetch, prefetch);
+}
+
+static void
+prefetch_search_cb (GObject *source,
+                    GAsyncResult *result,
+                    gpointer user_data)
+{
+	Prefetch *prefetch = user_data;
+	GPtrArray *secrets;
+	GList *list;
+	GSList *iter;
+
+	list = secret_service_search_finish (NULL, result, NULL);
+
+	if (g_cancellable_is_cancelled (prefetch->cancellable)) {
+		/* The agent is gone, and with it all waiting requests */
+		for (iter = prefetch->waiting; iter; iter = iter->next)
+			request_free (iter->data);
+		g_list_free_full (list, g_object_unref);
+		prefetch_free (prefetch);
+		return;
 	}
 
-	if (settings)
-		g_variant_unref (settings);
-	g_clear_error (&error);
+	g_hash_table_remove (prefetch->priv->prefetches, prefetch->cache_key);
+
+	secrets = secrets_from_items (list);
+	g_list_free_full (list, g_object_unref);
+
+	if (!prefetch->waiting)
+		cache_insert (prefetch->priv, prefetch->uuid, prefetch->setting_name, secrets, TRUE);
+
+	for (iter = prefetch->waiting; iter; iter = iter->next) {
+		Request *r = iter->data;
+
+		if (g_cancellable_is_cancelled (r->cancellable))
+			request_free (r);
+		else if (secrets->len) {
+			nma_trace_count (NMA_TRACE_SECRETS_PREFETCH_HIT);
+			request_return_secrets (r, secrets);
+		} else {
+			/* Nothing usable without unlocking the keyring; do the
+			 * real search now.
+			 */
+			request_search_keyring (r);
+		}
+	}
+
+	g_ptr_array_unref (secrets);
+	prefetch_free (prefetch);
 }
 
+static void
+prefetch_setting (AppletAgentPrivate *priv,
+                  const char *uuid,
+                  const char *setting_name)
+{
+	Prefetch *prefetch;
+	GHashTable *attrs;
+	char *cache_key;
+
+	cache_key = g_strdup_printf ("%s|%s", uuid, setting_name);
+	if (   (priv->cache && g_hash_table_contains (priv->cache, cache_key))
+	    || g_hash_table_contains (priv->prefetches, cache_key)) {
+		g_free (cache_key);
+		return;
+	}
+
+	prefetch = g_slice_new0 (Prefetch);
+	prefetch->priv = priv;
+	prefetch->uuid = g_strdup (uuid);
+	prefetch->setting_name = g_strdup (setting_name);
+	prefetch->cache_key = cache_key;
+	prefetch->cancellable = g_cancellable_new ();
+	g_hash_table_insert (priv->prefetches, prefetch->cache_key, prefetch);
+
+	attrs = secret_attributes_build (&network_manager_secret_schema,
+	                                 KEYRING_UUID_TAG, uuid,
+	                                 KEYRING_SN_TAG, setting_name,
+	                                 NULL);
+
+	/* Don't unlock: nobody asked for anything yet, so no prompts either */
+	secret_service_search (NULL, &network_manager_secret_schema, attrs,
+	                       SECRET_SEARCH_ALL | SECRET_SEARCH_LOAD_SECRETS,
+	                       prefetch->cancellable, prefetch_search_cb, prefetch);
+	g_hash_table_unref (attrs);
+}
+
+static void
+collect_agent_owned_cb (NMSetting *setting,
+                        const char *key,
+                        const GValue *value,
+                        GParamFlags flags,
+                        gpointer user_data)
+{
+	GHashTable *setting_names = user_data;
+	NMSettingSecretFlags secret_flags = NM_SETTING_SECRET_FLAG_NONE;
+
+	if (!(flags & NM_SETTING_PARAM_SECRET))
+		return;
+	if (!nm_setting_get_secret_flags (setting, key, &secret_flags, NULL))
+		return;
+	if (secret_flags == NM_SETTING_SECRET_FLAG_AGENT_OWNED)
+		g_hash_table_add (setting_names, (gpointer) nm_setting_get_name (setting));
+}
+
+/* Starts looking up the agent-owned secrets of @connection in the keyring,
+ * in anticipation of NetworkManager asking for them.  VPN secrets are left
+ * alone as the plugin's auth dialog reads those itself.
+ */
+void
+applet_agent_prefetch_secrets (AppletAgent *agent, NMConnection *connection)
+{
+	AppletAgentPrivate *priv;
+	GHashTable *setting_names;
+	GHashTableIter iter;
+	const char *setting_name;
+	const char *uuid;
+
+	g_return_if_fail (APPLET_IS_AGENT (agent));
+	g_return_if_fail (NM_IS_CONNECTION (connection));
+
+	priv = APPLET_AGENT_GET_PRIVATE (agent);
+	if (priv->vpn_only || priv->disposed)
+		return;
+
+	uuid = nm_connection_get_uuid (connection);
+	if (!uuid || nm_connection_is_type (connection, NM_SETTING_VPN_SETTING_NAME))
+		return;
+
+	if (!priv->prefetches)
+		priv->prefetches = g_hash_table_new (g_str_hash, g_str_equal);
+
+	/* Secrets nobody asked for yet are kept for a while, even with the
+	 * cache disabled, so they have to go when the screen gets locked too.
+	 */
+	watch_screen_lock (agent);
+
+	setting_names = g_hash_table_new (g_str_hash, g_str_equal);
+	nm_connection_for_each_setting_value (connection, collect_agent_owned_cb, setting_names);
+
+	g_hash_table_iter_init (&iter, setting_names);
+	while (g_hash_table_iter_next (&iter, (gpointer) &setting_name, NULL))
+		prefetch_setting (priv, uuid, setting_name);
+
+	g_hash_table_unref (setting_names);
+}
+
+/*******************************************************/
+
 static void
 get_secrets (NMSecretAgentOld *agent,
              NMConnection *connection,
@@ -410,7 +816,7 @@ get_secrets (NMSecretAgentOld *agent,
 	NMSettingConnection *s_con;
 	NMSetting *setting;
 	const char *uuid, *ctype;
-	GHashTable *attrs;
+	GPtrArray *secrets;
 
 	setting = nm_connection_get_setting_by_name (connection, setting_name);
 	if (!setting) {
@@ -459,20 +865,26 @@ get_secrets (NMSecretAgentOld *agent,
 		return;
 	}
 
-	/* For everything else we scrape the keyring for secrets first, and ask
-	 * later if required.
-	 */
-	attrs = secret_attributes_build (&network_manager_secret_schema,
-	                                 KEYRING_UUID_TAG, uuid,
-	                                 KEYRING_SN_TAG, setting_name,
-	                                 NULL);
+	secrets = cache_lookup (priv, uuid, setting_name);
+	if (secrets) {
+		request_return_secrets (r, secrets);
+		g_ptr_array_unref (secrets);
+		return;
+	}
 
-	secret_service_search (NULL, &network_manager_secret_schema, attrs,
-	                       SECRET_SEARCH_ALL | SECRET_SEARCH_UNLOCK | SECRET_SEARCH_LOAD_SECRETS,
-	                       r->cancellable, keyring_find_secrets_cb, r);
+	/* A speculative lookup for these secrets may already be underway */
+	if (priv->prefetches) {
+		gs_free char *cache_key = g_strdup_printf ("%s|%s", uuid, setting_name);
+		Prefetch *prefetch;
 
-	r->keyring_calls++;
-	g_hash_table_unref (attrs);
+		prefetch = g_hash_table_lookup (priv->prefetches, cache_key);
+		if (prefetch) {
+			prefetch->waiting = g_slist_append (prefetch->waiting, r);
+			return;
+		}
+	}
+
+	request_search_keyring (r);
 }
 
 /*******************************************************/
@@ -514,6 +926,14 @@ cancel_get_secrets (NMSecretAgentOld *agent,
 
 /*******************************************************/
 
+/* Secrets to save are collected into r->save_queue first and then written
+ * with at most SAVE_MAX_IN_FLIGHT keyring calls outstanding, so that a VPN
+ * with a pile of secrets neither floods the keyring daemon nor waits for
+ * each write in turn.  The request completes once when the queue is drained.
+ */
+
+static void save_request_pump (Request *r);
+
 static void
 save_request_try_complete (Request *r)
 {
@@ -532,8 +952,30 @@ save_secret_cb (GObject *source,
                 GAsyncResult *result,
                 gpointer user_data)
 {
+	Request *r = user_data;
+
 	secret_password_store_finish (result, NULL);
-	save_request_try_complete (user_data);
+	r->keyring_calls--;
+	save_request_pump (r);
+}
+
+static void
+save_request_pump (Request *r)
+{
+	SaveItem *item;
+
+	while (   r->keyring_calls < SAVE_MAX_IN_FLIGHT
+	       && !g_cancellable_is_cancelled (r->cancellable)
+	       && (item = g_queue_pop_head (&r->save_queue))) {
+		secret_password_storev (&network_manager_secret_schema, item->attrs, NULL,
+		                        item->label, secret_value_get (item->value, NULL),
+		                        r->cancellable, save_secret_cb, r);
+		r->keyring_calls++;
+		save_item_free (item);
+	}
+
+	if (!r->save_queue.length || g_cancellable_is_cancelled (r->cancellable))
+		save_request_try_complete (r);
 }
 
 
@@ -576,7 +1018,7 @@ save_one_secret (Request *r,
                  const char *secret,
                  const char *display_name)
 {
-	GHashTable *attrs;
+	SaveItem *item;
 	char *alt_display_name = NULL;
 	const char *setting_name;
 	NMSettingSecretFlags secret_flags = NM_SETTING_SECRET_FLAG_NONE;
@@ -590,19 +1032,15 @@ save_one_secret (Request *r,
 	setting_name = nm_setting_get_name (setting);
 	g_assert (setting_name);
 
-	attrs = _create_keyring_add_attr_list (r->connection,
-	                                       setting_name,
-	                                       key,
-	                                       display_name ? NULL : &alt_display_name);
-	g_assert (attrs);
-
-	secret_password_storev (&network_manager_secret_schema, attrs, NULL,
-	                        display_name ? display_name : alt_display_name, secret,
-	                        r->cancellable, save_secret_cb, r);
-	r->keyring_calls++;
-
-	g_hash_table_unref (attrs);
-	g_free (alt_display_name);
+	item = g_slice_new (SaveItem);
+	item->attrs = _create_keyring_add_attr_list (r->connection,
+	                                             setting_name,
+	                                             key,
+	                                             display_name ? NULL : &alt_display_name);
+	g_assert (item->attrs);
+	item->label = display_name ? g_strdup (display_name) : alt_display_name;
+	item->value = secret_value_new (secret, -1, "text/plain");
+	g_queue_push_tail (&r->save_queue, item);
 }
 
 static void
@@ -672,11 +1110,11 @@ save_delete_cb (NMSecretAgentOld *agent,
 	/* Ignore errors; now save all new secrets */
 	nm_connection_for_each_setting_value (connection, write_one_secret_to_keyring, r);
 
-	/* If no secrets actually got saved there may be nothing to do so
-	 * try to complete the request here.  If there were secrets to save the
-	 * request will get completed when those keyring calls return.
+	/* If no secrets actually got queued there is nothing to do and the
+	 * request completes right away; otherwise it gets completed when the
+	 * last keyring call returns.
 	 */
-	save_request_try_complete (r);
+	save_request_pump (r);
 }
 
 static void
@@ -692,6 +1130,8 @@ save_secrets (NMSecretAgentOld *agent,
 	r = request_new (agent, connection, connection_path, NULL, NULL, FALSE, NULL, callback, NULL, callback_data);
 	g_hash_table_insert (priv->requests, GUINT_TO_POINTER (r->id), r);
 
+	cache_invalidate (priv, nm_connection_get_uuid (connection));
+
 	/* First delete any existing items in the keyring */
 	nm_secret_agent_old_delete_secrets (agent, connection, save_delete_cb, r);
 }
@@ -747,6 +1187,8 @@ delete_secrets (NMSecretAgentOld *agent,
 	uuid = nm_setting_connection_get_uuid (s_con);
 	g_assert (uuid);
 
+	cache_invalidate (priv, uuid);
+
 	secret_password_clear (&network_manager_secret_schema, r->cancellable,
 	                       delete_find_items_cb, r,
 	                       KEYRING_UUID_TAG, uuid,
@@ -763,6 +1205,111 @@ applet_agent_handle_vpn_only (AppletAgent *agent, gboolean vpn_only)
 	APPLET_AGENT_GET_PRIVATE (agent)->vpn_only = vpn_only;
 }
 
+void
+applet_agent_clear_cache (AppletAgent *agent)
+{
+	AppletAgentPrivate *priv;
+
+	g_return_if_fail (APPLET_IS_AGENT (agent));
+
+	priv = APPLET_AGENT_GET_PRIVATE (agent);
+	if (priv->cache)
+		g_hash_table_remove_all (priv->cache);
+}
+
+static void
+screensaver_active_changed_cb (GDBusConnection *connection,
+                               const char *sender_name,
+                               const char *object_path,
+                               const char *interface_name,
+                               const char *signal_name,
+                               GVariant *parameters,
+                               gpointer user_data)
+{
+	gboolean active;
+
+	if (!g_variant_is_of_type (parameters, G_VARIANT_TYPE ("(b)")))
+		return;
+
+	g_variant_get (parameters, "(b)", &active);
+	if (active)
+		applet_agent_clear_cache (user_data);
+}
+
+static void
+watch_screen_lock (AppletAgent *agent)
+{
+	AppletAgentPrivate *priv = APPLET_AGENT_GET_PRIVATE (agent);
+	static const char *interfaces[] = {
+		"org.gnome.ScreenSaver",
+		"org.freedesktop.ScreenSaver",
+	};
+	guint i;
+
+	if (priv->session_bus)
+		return;
+
+	priv->session_bus = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, NULL);
+	if (!priv->session_bus)
+		return;
+
+	for (i = 0; i < G_N_ELEMENTS (interfaces); i++) {
+		priv->lock_signal_ids[i] =
+			g_dbus_connection_signal_subscribe (priv->session_bus,
+			                                    NULL,
+			                                    interfaces[i],
+			                                    "ActiveChanged",
+			                                    NULL,
+			                                    NULL,
+			                                    G_DBUS_SIGNAL_FLAGS_NONE,
+			                                    screensaver_active_changed_cb,
+			                                    agent,
+			                                    NULL);
+	}
+}
+
+static void
+unwatch_screen_lock (AppletAgent *agent)
+{
+	AppletAgentPrivate *priv = APPLET_AGENT_GET_PRIVATE (agent);
+	guint i;
+
+	if (!priv->session_bus)
+		return;
+
+	for (i = 0; i < G_N_ELEMENTS (priv->lock_signal_ids); i++) {
+		if (priv->lock_signal_ids[i]) {
+			g_dbus_connection_signal_unsubscribe (priv->session_bus, priv->lock_signal_ids[i]);
+			priv->lock_signal_ids[i] = 0;
+		}
+	}
+	g_clear_object (&priv->session_bus);
+}
+
+/* Remember keyring secrets for @seconds, or not at all if 0.  Entries for
+ * a connection are dropped when its secrets are saved or deleted, and all
+ * of them when the screen gets locked.
+ */
+void
+applet_agent_set_cache_ttl (AppletAgent *agent, guint seconds)
+{
+	AppletAgentPrivate *priv;
+
+	g_return_if_fail (APPLET_IS_AGENT (agent));
+
+	priv = APPLET_AGENT_GET_PRIVATE (agent);
+	priv->cache_ttl = seconds;
+
+	if (seconds)
+		watch_screen_lock (agent);
+	else {
+		applet_agent_clear_cache (agent);
+		/* Still needed for prefetched secrets */
+		if (!priv->prefetches)
+			unwatch_screen_lock (agent);
+	}
+}
+
 /*******************************************************/
 
 AppletAgent *
@@ -806,6 +1353,19 @@ dispose (GObject *object)
 			g_cancellable_cancel (r->cancellable);
 
 		g_hash_table_destroy (priv->requests);
+
+		/* Prefetches free themselves once their search returns */
+		if (priv->prefetches) {
+			Prefetch *prefetch;
+
+			g_hash_table_iter_init (&iter, priv->prefetches);
+			while (g_hash_table_iter_next (&iter, NULL, (gpointer) &prefetch))
+				g_cancellable_cancel (prefetch->cancellable);
+			g_clear_pointer (&priv->prefetches, g_hash_table_destroy);
+		}
+
+		g_clear_pointer (&priv->cache, g_hash_table_destroy);
+		unwatch_screen_lock (self);
 		priv->disposed = TRUE;
 	}
 
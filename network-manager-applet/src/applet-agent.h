@@ -53,5 +53,11 @@ AppletAgent *applet_agent_new (GError **error);
 
 void applet_agent_handle_vpn_only (AppletAgent *agent, gboolean vpn_only);
 
+void applet_agent_set_cache_ttl (AppletAgent *agent, guint seconds);
+
+void applet_agent_clear_cache (AppletAgent *agent);
+
+void applet_agent_prefetch_secrets (AppletAgent *agent, NMConnection *connection);
+
 #endif /* _APPLET_AGENT_H_ */
 
@@ -689,6 +689,9 @@ add_connection_item (NMDevice *device,
 	info->device = g_object_ref (device);
 	info->connection = connection ? g_object_ref (connection) : NULL;
 
+	if (connection)
+		applet_menu_item_set_key (item, "connection", nm_connection_get_path (connection));
+
 	g_signal_connect_data (item, "activate",
 	                       G_CALLBACK (menu_item_activate),
 	                       info,
@@ -817,8 +820,8 @@ signal_quality_updated (GObject *object,
                         GParamSpec *pspec,
                         BroadbandDeviceInfo *info)
 {
-	applet_schedule_update_icon (info->applet);
-	applet_schedule_update_menu (info->applet);
+	applet_schedule_update (info->applet, APPLET_UPDATE_LINK | APPLET_UPDATE_TOOLTIP);
+	applet_schedule_update_device (info->applet, info->device);
 }
 
 static void
@@ -826,8 +829,8 @@ access_technologies_updated (GObject *object,
                              GParamSpec *pspec,
                              BroadbandDeviceInfo *info)
 {
-	applet_schedule_update_icon (info->applet);
-	applet_schedule_update_menu (info->applet);
+	applet_schedule_update (info->applet, APPLET_UPDATE_LINK | APPLET_UPDATE_TOOLTIP);
+	applet_schedule_update_device (info->applet, info->device);
 }
 
 static void
@@ -19,8 +19,13 @@
 #include "utils.h"
 #include "nma-wifi-dialog.h"
 #include "mobile-helpers.h"
+#include "applet-trace.h"
 
 #define ACTIVE_AP_TAG "active-ap"
+#define CONNECTION_INDEX_TAG "connection-index"
+#define STRENGTH_BUCKETS_TAG "nma-strength-buckets"
+
+extern guint strength_hysteresis;
 
 static void wifi_dialog_response_cb (GtkDialog *dialog, gint response, gpointer user_data);
 
@@ -33,6 +38,7 @@ typedef struct {
 	NMDevice *device;
 	NMAccessPoint *ap;
 	gulong signal_id;
+	int bucket;
 } ActiveAPData;
 
 static void _active_ap_set (NMApplet *applet, NMDevice *device, NMAccessPoint *ap);
@@ -42,6 +48,7 @@ static void
 _active_ap_set_notify (NMAccessPoint *ap, GParamSpec *pspec, gpointer user_data)
 {
 	ActiveAPData *d = user_data;
+	int bucket;
 
 	g_return_if_fail (NM_IS_ACCESS_POINT (ap));
 	g_return_if_fail (d);
@@ -50,7 +57,19 @@ _active_ap_set_notify (NMAccessPoint *ap, GParamSpec *pspec, gpointer user_data)
 	g_return_if_fail (d->ap == ap);
 	g_return_if_fail (d->signal_id);
 
-	applet_schedule_update_icon (d->applet);
+	/* The tooltip shows the exact strength, the icon only its bucket */
+	bucket = utils_strength_bucket (MIN (nm_access_point_get_strength (ap), 100),
+	                                d->bucket,
+	                                strength_hysteresis);
+	if (bucket == d->bucket) {
+		nma_trace_count (NMA_TRACE_STRENGTH_SUPPRESSED);
+		applet_schedule_update (d->applet, APPLET_UPDATE_TOOLTIP);
+		return;
+	}
+
+	nma_trace_count (NMA_TRACE_STRENGTH_CHANGED);
+	d->bucket = bucket;
+	applet_schedule_update (d->applet, APPLET_UPDATE_LINK | APPLET_UPDATE_TOOLTIP);
 }
 
 static void
@@ -83,6 +102,22 @@ _active_ap_get (NMApplet *applet, NMDevice *device)
 	return NULL;
 }
 
+/* Returns the strength bucket shown for the active AP of @device */
+static int
+_active_ap_get_bucket (NMApplet *applet, NMDevice *device)
+{
+	GSList *list, *iter;
+
+	list = g_object_get_data ((GObject *) applet, ACTIVE_AP_TAG);
+	for (iter = list; iter; iter = iter->next) {
+		ActiveAPData *d = iter->data;
+
+		if (device == d->device && d->ap)
+			return d->bucket;
+	}
+	return 0;
+}
+
 static void
 _active_ap_set_destroy (gpointer data)
 {
@@ -159,6 +194,9 @@ remove_empty:
 		list = g_slist_append (list, d);
 	}
 	d->ap = ap;
+	d->bucket = utils_strength_bucket (MIN (nm_access_point_get_strength (ap), 100),
+	                                   -1,
+	                                   strength_hysteresis);
 	g_object_weak_ref ((GObject *) ap, _active_ap_set_weakref, d);
 	d->signal_id = g_signal_connect (ap,
 	                                 "notify::" NM_ACCESS_POINT_STRENGTH,
@@ -558,56 +596,127 @@ wifi_menu_item_activate (GtkMenuItem *item, gpointer user_data)
 	                                  user_data);
 }
 
-struct dup_data {
-	NMDevice *device;
-	NMNetworkMenuItem *found;
-	char *hash;
-};
+/*****************************************************************************/
+
+/* Connections usable with a device, grouped by SSID.  Rebuilt whenever
+ * the set of connections changes, so that matching the connections of an
+ * AP only has to look at those with the same SSID.
+ */
+typedef struct {
+	guint serial;
+	GHashTable *by_ssid;  /* GBytes -> GPtrArray of NMConnection */
+} ConnectionIndex;
 
 static void
-find_duplicate (gpointer d, gpointer user_data)
+connection_index_free (ConnectionIndex *index)
 {
-	struct dup_data * data = (struct dup_data *) user_data;
-	NMDevice *device;
-	const char *hash;
-	GtkWidget *widget = GTK_WIDGET (d);
+	g_hash_table_unref (index->by_ssid);
+	g_slice_free (ConnectionIndex, index);
+}
 
-	g_assert (d && widget);
-	g_return_if_fail (data);
-	g_return_if_fail (data->hash);
+/* nm_access_point_connection_valid() ignores a trailing NUL in SSIDs */
+static GBytes *
+ssid_to_key (GBytes *ssid)
+{
+	const guint8 *data;
+	gsize len;
 
-	if (data->found || !NM_IS_NETWORK_MENU_ITEM (widget))
-		return;
+	data = g_bytes_get_data (ssid, &len);
+	if (len && !data[len - 1])
+		len--;
+	return g_bytes_new_from_bytes (ssid, 0, len);
+}
 
-	device = g_object_get_data (G_OBJECT (widget), "device");
-	if (NM_DEVICE (device) != data->device)
-		return;
+static const GPtrArray *
+get_connections_for_ssid (NMDeviceWifi *device, GBytes *ssid, NMApplet *applet)
+{
+	ConnectionIndex *index;
+	gs_unref_bytes GBytes *key = NULL;
+
+	index = g_object_get_data (G_OBJECT (device), CONNECTION_INDEX_TAG);
+	if (!index || index->serial != applet->connections_serial) {
+		GPtrArray *all_connections, *connections;
+		int i;
+
+		index = g_slice_new0 (ConnectionIndex);
+		index->serial = applet->connections_serial;
+		index->by_ssid = g_hash_table_new_full (g_bytes_hash, g_bytes_equal,
+		                                        (GDestroyNotify) g_bytes_unref,
+		                                        (GDestroyNotify) g_ptr_array_unref);
+
+		all_connections = applet_get_all_connections (applet);
+		connections = nm_device_filter_connections (NM_DEVICE (device), all_connections);
+		g_ptr_array_unref (all_connections);
+
+		for (i = 0; i < connections->len; i++) {
+			NMConnection *connection = connections->pdata[i];
+			NMSettingWireless *s_wifi;
+			GBytes *connection_ssid;
+			GPtrArray *list;
+
+			s_wifi = nm_connection_get_setting_wireless (connection);
+			connection_ssid = s_wifi ? nm_setting_wireless_get_ssid (s_wifi) : NULL;
+			if (!connection_ssid)
+				continue;
+
+			key = ssid_to_key (connection_ssid);
+			list = g_hash_table_lookup (index->by_ssid, key);
+			if (!list) {
+				list = g_ptr_array_new_with_free_func (g_object_unref);
+				g_hash_table_insert (index->by_ssid, g_bytes_ref (key), list);
+			}
+			g_ptr_array_add (list, g_object_ref (connection));
+			g_clear_pointer (&key, g_bytes_unref);
+		}
+		g_ptr_array_unref (connections);
 
-	hash = nm_network_menu_item_get_hash (NM_NETWORK_MENU_ITEM (widget));
-	if (hash && (strcmp (hash, data->hash) == 0))
-		data->found = NM_NETWORK_MENU_ITEM (widget);
+		g_object_set_data_full (G_OBJECT (device), CONNECTION_INDEX_TAG,
+		                        index, (GDestroyNotify) connection_index_free);
+	}
+
+	key = ssid_to_key (ssid);
+	return g_hash_table_lookup (index->by_ssid, key);
+}
+
+/*
+ * get_connections_for_ap
+ *
+ * Returns the connections of @device that can be used with @ap.
+ */
+static GPtrArray *
+get_connections_for_ap (NMDeviceWifi *device, NMAccessPoint *ap, NMApplet *applet)
+{
+	const GPtrArray *candidates = NULL;
+	GBytes *ssid;
+
+	ssid = nm_access_point_get_ssid (ap);
+	if (ssid)
+		candidates = get_connections_for_ssid (device, ssid, applet);
+	if (!candidates)
+		return g_ptr_array_new ();
+
+	/* Leave the details (security, mode, BSSID...) to libnm */
+	return nm_access_point_filter_connections (ap, candidates);
 }
 
 static NMNetworkMenuItem *
 create_new_ap_item (NMDeviceWifi *device,
                     NMAccessPoint *ap,
-                    struct dup_data *dup_data,
-                    const GPtrArray *connections,
+                    guint64 hash,
                     NMApplet *applet)
 {
 	WifiMenuItemInfo *info;
 	int i;
 	GtkWidget *item;
-	GPtrArray *dev_connections;
+	const char *path = NULL;
+	gs_free char *key = NULL;
 	GPtrArray *ap_connections;
 
-	dev_connections = nm_device_filter_connections (NM_DEVICE (device), connections);
-	ap_connections = nm_access_point_filter_connections (ap, dev_connections);
-	g_ptr_array_unref (dev_connections);
+	ap_connections = get_connections_for_ap (device, ap, applet);
 
 	item = nm_network_menu_item_new (ap,
 	                                 nm_device_wifi_get_capabilities (device),
-	                                 dup_data->hash,
+	                                 hash,
 	                                 ap_connections->len != 0,
 	                                 applet);
 	g_object_set_data (G_OBJECT (item), "device", NM_DEVICE (device));
@@ -625,6 +734,7 @@ create_new_ap_item (NMDeviceWifi *device,
 
 			s_con = nm_connection_get_setting_connection (connection);
 			subitem = gtk_menu_item_new_with_label (nm_setting_connection_get_id (s_con));
+			applet_menu_item_set_key (subitem, "connection", nm_connection_get_path (connection));
 
 			info = g_slice_new0 (WifiMenuItemInfo);
 			info->applet = applet;
@@ -653,6 +763,7 @@ create_new_ap_item (NMDeviceWifi *device,
 		if (ap_connections->len == 1) {
 			connection = NM_CONNECTION (ap_connections->pdata[0]);
 			info->connection = g_object_ref (connection);
+			path = nm_connection_get_path (connection);
 		}
 
 		g_signal_connect_data (GTK_WIDGET (item),
@@ -663,84 +774,146 @@ create_new_ap_item (NMDeviceWifi *device,
 		                       0);
 	}
 
+	/* The item activates a specific connection when there is only one */
+	key = g_strdup_printf ("%016" G_GINT64_MODIFIER "x/%s", hash, path ? path : "");
+	applet_menu_item_set_key (item, "ap", key);
+
 	g_ptr_array_unref (ap_connections);
 	return NM_NETWORK_MENU_ITEM (item);
 }
 
+/* What the menu needs to know about a network (all BSSs sharing an SSID
+ * and security) to place it, before deciding to build its item.
+ */
+typedef struct {
+	guint64 hash;
+	char *ssid;
+	gboolean is_adhoc;
+	gboolean is_encrypted;
+	gboolean has_connections;
+	GPtrArray *aps;  /* the first one is what the item activates */
+} NetworkSummary;
+
+static void
+network_summary_free (gpointer data)
+{
+	NetworkSummary *summary = data;
+
+	g_free (summary->ssid);
+	g_ptr_array_unref (summary->aps);
+	g_slice_free (NetworkSummary, summary);
+}
+
+/* Summarizes a group of APs of one network; the first one is what the
+ * menu item activates.
+ */
+static NetworkSummary *
+network_summary_new (NMDeviceWifi *device, GPtrArray *group, NMApplet *applet)
+{
+	NetworkSummary *summary;
+	NMAccessPoint *ap = group->pdata[0];
+	GPtrArray *ap_connections;
+	GBytes *ssid;
+	guint i;
+
+	summary = g_slice_new0 (NetworkSummary);
+	summary->hash = *(guint64 *) g_object_get_data (G_OBJECT (ap), "hash");
+	summary->aps = g_ptr_array_new_full (group->len, g_object_unref);
+	for (i = 0; i < group->len; i++)
+		g_ptr_array_add (summary->aps, g_object_ref (group->pdata[i]));
+
+	ssid = nm_access_point_get_ssid (ap);
+	summary->ssid = nm_utils_ssid_to_utf8 (g_bytes_get_data (ssid, NULL),
+	                                       g_bytes_get_size (ssid));
+	summary->is_adhoc = nm_access_point_get_mode (ap) == NM_802_11_MODE_ADHOC;
+	summary->is_encrypted =    (nm_access_point_get_flags (ap) & NM_802_11_AP_FLAGS_PRIVACY)
+	                        || nm_access_point_get_wpa_flags (ap)
+	                        || nm_access_point_get_rsn_flags (ap);
+
+	ap_connections = get_connections_for_ap (device, ap, applet);
+	summary->has_connections = ap_connections->len != 0;
+	g_ptr_array_unref (ap_connections);
+
+	return summary;
+}
+
 static NMNetworkMenuItem *
-get_menu_item_for_ap (NMDeviceWifi *device,
-                      NMAccessPoint *ap,
-                      const GPtrArray *connections,
-                      GSList *menu_list,
-                      NMApplet *applet)
+network_summary_create_item (NMDeviceWifi *device, NetworkSummary *summary, NMApplet *applet)
+{
+	NMNetworkMenuItem *item;
+	GHashTable *buckets;
+	gpointer previous;
+	guint i;
+
+	item = create_new_ap_item (device, summary->aps->pdata[0], summary->hash, applet);
+	for (i = 1; i < summary->aps->len; i++) {
+		NMAccessPoint *ap = summary->aps->pdata[i];
+
+		nm_network_menu_item_set_strength (item, nm_access_point_get_strength (ap), applet);
+		nm_network_menu_item_add_dupe (item, ap);
+	}
+
+	/* Remember the strength bucket each network was last shown with on
+	 * this device, so that rebuilt items keep the hysteresis.
+	 */
+	buckets = g_object_get_data (G_OBJECT (device), STRENGTH_BUCKETS_TAG);
+	if (!buckets) {
+		buckets = g_hash_table_new_full (g_int64_hash, g_int64_equal, g_free, NULL);
+		g_object_set_data_full (G_OBJECT (device), STRENGTH_BUCKETS_TAG,
+		                        buckets, (GDestroyNotify) g_hash_table_unref);
+	}
+	previous = g_hash_table_lookup (buckets, &summary->hash);
+	nm_network_menu_item_set_previous_bucket (item,
+	                                          previous ? GPOINTER_TO_INT (previous) - 1 : -1,
+	                                          applet);
+	g_hash_table_insert (buckets,
+	                     utils_hash_key_new (summary->hash),
+	                     GINT_TO_POINTER (nm_network_menu_item_get_strength_bucket (item) + 1));
+	return item;
+}
+
+/*
+ * ap_network_key
+ *
+ * Key for utils_group_by_key(): APs that share an SSID and security
+ * settings belong to one network and end up in one menu item.
+ */
+static gboolean
+ap_network_key (gpointer item, guint64 *out_key, gpointer user_data)
 {
+	NMAccessPoint *ap = item;
 	GBytes *ssid;
-	struct dup_data dup_data = { NULL, NULL };
+	guint64 *hash;
 
 	/* Don't add BSSs that hide their SSID or are blacklisted */
 	ssid = nm_access_point_get_ssid (ap);
 	if (   !ssid
 	    || nm_utils_is_empty_ssid (g_bytes_get_data (ssid, NULL), g_bytes_get_size (ssid))
 	    || is_blacklisted_ssid (ssid))
-		return NULL;
-
-	/* Find out if this AP is a member of a larger network that all uses the
-	 * same SSID and security settings.  If so, we'll already have a menu item
-	 * for this SSID, so just update that item's strength and add this AP to
-	 * menu item's duplicate list.
-	 */
-	dup_data.found = NULL;
-	dup_data.hash = g_object_get_data (G_OBJECT (ap), "hash");
-	g_return_val_if_fail (dup_data.hash != NULL, NULL);
-
-	dup_data.device = NM_DEVICE (device);
-	g_slist_foreach (menu_list, find_duplicate, &dup_data);
+		return FALSE;
 
-	if (dup_data.found) {
-		nm_network_menu_item_set_strength (dup_data.found, nm_access_point_get_strength (ap), applet);
-		nm_network_menu_item_add_dupe (dup_data.found, ap);
-		return NULL;
-	}
+	hash = g_object_get_data (G_OBJECT (ap), "hash");
+	g_return_val_if_fail (hash != NULL, FALSE);
 
-	return create_new_ap_item (device, ap, &dup_data, connections, applet);
+	*out_key = *hash;
+	return TRUE;
 }
 
 static gint
 sort_by_name (gconstpointer tmpa, gconstpointer tmpb)
 {
-	NMNetworkMenuItem *a = NM_NETWORK_MENU_ITEM (tmpa);
-	NMNetworkMenuItem *b = NM_NETWORK_MENU_ITEM (tmpb);
-	const char *a_ssid, *b_ssid;
-	gboolean a_adhoc, b_adhoc;
+	const NetworkSummary *a = tmpa;
+	const NetworkSummary *b = tmpb;
 	int i;
 
-	if (a && !b)
-		return 1;
-	else if (!a && b)
-		return -1;
-	else if (a == b)
-		return 0;
-
-	a_ssid = nm_network_menu_item_get_ssid (a);
-	b_ssid = nm_network_menu_item_get_ssid (b);
-
-	if (a_ssid && !b_ssid)
-		return 1;
-	if (b_ssid && !a_ssid)
-		return -1;
-
-	if (a_ssid && b_ssid) {
-		i = g_ascii_strcasecmp (a_ssid, b_ssid);
-		if (i != 0)
-			return i;
-	}
+	i = g_ascii_strcasecmp (a->ssid, b->ssid);
+	if (i != 0)
+		return i;
 
 	/* If the names are the same, sort infrastructure APs first */
-	a_adhoc = nm_network_menu_item_get_is_adhoc (a);
-	b_adhoc = nm_network_menu_item_get_is_adhoc (b);
-	if (a_adhoc && !b_adhoc)
+	if (a->is_adhoc && !b->is_adhoc)
 		return 1;
-	else if (!a_adhoc && b_adhoc)
+	else if (!a->is_adhoc && b->is_adhoc)
 		return -1;
 
 	return 0;
@@ -755,33 +928,19 @@ sort_by_name (gconstpointer tmpa, gconstpointer tmpb)
 static gint
 sort_toplevel (gconstpointer tmpa, gconstpointer tmpb)
 {
-	NMNetworkMenuItem *a = NM_NETWORK_MENU_ITEM (tmpa);
-	NMNetworkMenuItem *b = NM_NETWORK_MENU_ITEM (tmpb);
-	gboolean a_fave, b_fave;
-
-	if (a && !b)
-		return 1;
-	else if (!a && b)
-		return -1;
-	else if (a == b)
-		return 0;
-
-	a_fave = nm_network_menu_item_get_has_connections (a);
-	b_fave = nm_network_menu_item_get_has_connections (b);
+	const NetworkSummary *a = tmpa;
+	const NetworkSummary *b = tmpb;
 
 	/* Items with a saved connection first */
-	if (a_fave && !b_fave)
+	if (a->has_connections && !b->has_connections)
 		return -1;
-	else if (!a_fave && b_fave)
+	else if (!a->has_connections && b->has_connections)
 		return 1;
-	else if (!a_fave && !b_fave) {
-		gboolean a_enc = nm_network_menu_item_get_is_encrypted (a);
-		gboolean b_enc = nm_network_menu_item_get_is_encrypted (b);
-
+	else if (!a->has_connections && !b->has_connections) {
 		/* If neither item has a saved connection, sort by encryption */
-		if (a_enc && !b_enc)
+		if (a->is_encrypted && !b->is_encrypted)
 			return -1;
-		else if (!a_enc && b_enc)
+		else if (!a->is_encrypted && b->is_encrypted)
 			return 1;
 	}
 
@@ -791,6 +950,37 @@ sort_toplevel (gconstpointer tmpa, gconstpointer tmpb)
 	return sort_by_name (a, b);
 }
 
+typedef struct {
+	NMDeviceWifi *device;
+	NMApplet *applet;
+	GSList *summaries;
+} MoreNetworksData;
+
+static void
+more_networks_data_free (gpointer data)
+{
+	MoreNetworksData *more = data;
+
+	g_object_unref (more->device);
+	g_slist_free_full (more->summaries, network_summary_free);
+	g_slice_free (MoreNetworksData, more);
+}
+
+static void
+more_networks_populate (GtkWidget *submenu, gpointer user_data)
+{
+	MoreNetworksData *more = user_data;
+	GSList *iter;
+
+	for (iter = more->summaries; iter; iter = g_slist_next (iter)) {
+		NMNetworkMenuItem *item;
+
+		item = network_summary_create_item (more->device, iter->data, more->applet);
+		gtk_menu_shell_append (GTK_MENU_SHELL (submenu), GTK_WIDGET (item));
+		gtk_widget_show_all (GTK_WIDGET (item));
+	}
+}
+
 static void
 wifi_add_menu_item (NMDevice *device,
                     gboolean multiple_devices,
@@ -804,12 +994,15 @@ wifi_add_menu_item (NMDevice *device,
 	const GPtrArray *aps;
 	int i;
 	NMAccessPoint *active_ap = NULL;
+	NetworkSummary *active_summary = NULL;
 	GSList *iter;
 	gboolean wifi_enabled = TRUE;
 	gboolean wifi_hw_enabled = TRUE;
-	GSList *menu_items = NULL;  /* All menu items we'll be adding */
-	NMNetworkMenuItem *item, *active_item = NULL;
+	GSList *networks = NULL;  /* All networks we'll be adding */
+	NetworkSummary *summary;
+	NMNetworkMenuItem *item;
 	GtkWidget *widget;
+	guint n_items;
 
 	wdev = NM_DEVICE_WIFI (device);
 	aps = nm_device_wifi_get_access_points (wdev);
@@ -832,19 +1025,39 @@ wifi_add_menu_item (NMDevice *device,
 	gtk_menu_shell_append (GTK_MENU_SHELL (menu), widget);
 	gtk_widget_show (widget);
 
-	/* Add the active AP if we're connected to something and the device is available */
+	/* Group the APs into networks, starting with the active AP if we're
+	 * connected to something and the device is available.
+	 */
 	if (!nma_menu_device_check_unusable (device)) {
+		gs_unref_ptrarray GPtrArray *candidates = NULL;
+		gs_unref_ptrarray GPtrArray *groups = NULL;
+
+		candidates = g_ptr_array_new ();
 		active_ap = nm_device_wifi_get_active_access_point (wdev);
-		if (active_ap) {
-			active_item = item = get_menu_item_for_ap (wdev, active_ap, connections, NULL, applet);
-			if (item) {
-				nm_network_menu_item_set_active (item, TRUE);
-				menu_items = g_slist_append (menu_items, item);
-
-				gtk_menu_shell_append (GTK_MENU_SHELL (menu), GTK_WIDGET (item));
-				gtk_widget_show_all (GTK_WIDGET (item));
-			}
+		if (active_ap)
+			g_ptr_array_add (candidates, active_ap);
+		for (i = 0; aps && (i < aps->len); i++)
+			g_ptr_array_add (candidates, g_ptr_array_index (aps, i));
+
+		groups = utils_group_by_key (candidates->pdata, candidates->len,
+		                             ap_network_key, NULL);
+		for (i = 0; i < groups->len; i++) {
+			summary = network_summary_new (wdev, groups->pdata[i], applet);
+			if (active_ap && summary->aps->pdata[0] == active_ap)
+				active_summary = summary;
+			else
+				networks = g_slist_prepend (networks, summary);
 		}
+		networks = g_slist_reverse (networks);
+	}
+
+	if (active_summary) {
+		item = network_summary_create_item (wdev, active_summary, applet);
+		nm_network_menu_item_set_active (item, TRUE);
+
+		gtk_menu_shell_append (GTK_MENU_SHELL (menu), GTK_WIDGET (item));
+		gtk_widget_show_all (GTK_WIDGET (item));
+		network_summary_free (active_summary);
 	}
 
 	/* Notify user of unmanaged or unavailable device */
@@ -863,39 +1076,24 @@ wifi_add_menu_item (NMDevice *device,
 	if (nma_menu_device_check_unusable (device))
 		goto out;
 
-	/* Create menu items for the rest of the APs */
-	for (i = 0; aps && (i < aps->len); i++) {
-		NMAccessPoint *ap = g_ptr_array_index (aps, i);
-
-		item = get_menu_item_for_ap (wdev, ap, connections, menu_items, applet);
-		if (item)
-			menu_items = g_slist_append (menu_items, item);
-	}
-
-	/* Now remove the active AP item from the list, as we've already dealt with
-	 * it.  (Needed it when creating menu items for the rest of the APs though
-	 * to ensure duplicate APs are handled correctly)
-	 */
-	if (active_item)
-		menu_items = g_slist_remove (menu_items, active_item);
-
-	/* Sort all the rest of the menu items for the top-level menu */
-	menu_items = g_slist_sort (menu_items, sort_toplevel);
+	/* Sort all the rest of the networks for the top-level menu */
+	networks = g_slist_sort (networks, sort_toplevel);
 
-	if (g_slist_length (menu_items)) {
+	n_items = g_slist_length (networks);
+	if (n_items) {
 		GSList *submenu_items = NULL;
 		GSList *topmenu_items = NULL;
 		guint32 num_for_toplevel = 5;
 
 		applet_menu_item_add_complex_separator_helper (menu, applet, _("Available"));
 
-		if (g_slist_length (menu_items) == (num_for_toplevel + 1))
+		if (n_items == (num_for_toplevel + 1))
 			num_for_toplevel++;
 
 		/* Add the first 5 APs (or 6 if there are only 6 total) from the sorted
 		 * toplevel list.
 		 */
-		for (iter = menu_items; iter && num_for_toplevel; iter = g_slist_next (iter)) {
+		for (iter = networks; iter && num_for_toplevel; iter = g_slist_next (iter)) {
 			topmenu_items = g_slist_append (topmenu_items, iter->data);
 			num_for_toplevel--;
 			submenu_items = iter->next;
@@ -903,29 +1101,40 @@ wifi_add_menu_item (NMDevice *device,
 		topmenu_items = g_slist_sort (topmenu_items, sort_by_name);
 
 		for (iter = topmenu_items; iter; iter = g_slist_next (iter)) {
-			gtk_menu_shell_append (GTK_MENU_SHELL (menu), GTK_WIDGET (iter->data));
-			gtk_widget_show_all (GTK_WIDGET (iter->data));
+			item = network_summary_create_item (wdev, iter->data, applet);
+			gtk_menu_shell_append (GTK_MENU_SHELL (menu), GTK_WIDGET (item));
+			gtk_widget_show_all (GTK_WIDGET (item));
 		}
 		g_slist_free (topmenu_items);
 		topmenu_items = NULL;
 
-		/* If there are any submenu items, make a submenu for those */
+		/* If there are any submenu items, make a submenu for those.  Their
+		 * items are only built when the submenu is first shown.
+		 */
 		if (submenu_items) {
 			GtkWidget *subitem, *submenu;
-			GSList *sorted_subitems;
+			MoreNetworksData *more;
+			GSList *link;
 
 			subitem = gtk_menu_item_new_with_mnemonic (_("More networks"));
 			submenu = gtk_menu_new ();
 			gtk_menu_item_set_submenu (GTK_MENU_ITEM (subitem), submenu);
 
-			/* Sort the subitems alphabetically */
-			sorted_subitems = g_slist_copy (submenu_items);
-			sorted_subitems = g_slist_sort (sorted_subitems, sort_by_name);
+			/* Hand the rest of the networks over to the submenu */
+			for (link = networks; link->next != submenu_items; link = link->next)
+				;
+			link->next = NULL;
+
+			more = g_slice_new0 (MoreNetworksData);
+			more->device = g_object_ref (wdev);
+			more->applet = applet;
+			more->summaries = g_slist_sort (submenu_items, sort_by_name);
+			applet_menu_set_lazy (submenu, more_networks_populate,
+			                      more, more_networks_data_free);
 
-			/* And add the rest to the submenu */
-			for (iter = sorted_subitems; iter; iter = g_slist_next (iter))
-				gtk_menu_shell_append (GTK_MENU_SHELL (submenu), GTK_WIDGET (iter->data));
-			g_slist_free (sorted_subitems);
+			/* The indicator exports the menu without showing it */
+			if (INDICATOR_ENABLED (applet))
+				applet_menu_ensure_populated (submenu);
 
 			gtk_menu_shell_append (GTK_MENU_SHELL (menu), subitem);
 			gtk_widget_show_all (subitem);
@@ -933,7 +1142,7 @@ wifi_add_menu_item (NMDevice *device,
 	}
 
 out:
-	g_slist_free (menu_items);
+	g_slist_free_full (networks, network_summary_free);
 }
 
 static void
@@ -970,20 +1179,26 @@ notify_active_ap_changed_cb (NMDeviceWifi *device,
 	                            TRUE))
 		return;
 
-	applet_schedule_update_icon (applet);
+	applet_schedule_update (applet, APPLET_UPDATE_LINK | APPLET_UPDATE_TOOLTIP);
 }
 
 static void
 add_hash_to_ap (NMAccessPoint *ap)
 {
-	char *hash;
+	guint64 *hash;
+
+	/* Updated in place, this runs on every flags or SSID change */
+	hash = g_object_get_data (G_OBJECT (ap), "hash");
+	if (!hash) {
+		hash = g_new (guint64, 1);
+		g_object_set_data_full (G_OBJECT (ap), "hash", hash, (GDestroyNotify) g_free);
+	}
 
-	hash = utils_hash_ap (nm_access_point_get_ssid (ap),
-	                      nm_access_point_get_mode (ap),
-	                      nm_access_point_get_flags (ap),
-	                      nm_access_point_get_wpa_flags (ap),
-	                      nm_access_point_get_rsn_flags (ap));
-	g_object_set_data_full (G_OBJECT (ap), "hash", hash, (GDestroyNotify) g_free);
+	*hash = utils_hash_ap (nm_access_point_get_ssid (ap),
+	                       nm_access_point_get_mode (ap),
+	                       nm_access_point_get_flags (ap),
+	                       nm_access_point_get_wpa_flags (ap),
+	                       nm_access_point_get_rsn_flags (ap));
 }
 
 static void
@@ -1019,6 +1234,16 @@ wifi_available_dont_show_cb (NotifyNotification *notify,
 }
 
 
+/* How a visible AP counts towards the "networks available" notification */
+typedef enum {
+	AP_AVAIL_NONE = 0,     /* hidden SSID */
+	AP_AVAIL_AUTOCONNECT,  /* has a connection that autoconnects */
+	AP_AVAIL_UNKNOWN,
+	_AP_AVAIL_NUM,
+} ApAvailClass;
+
+#define AP_AVAIL_CLASS_TAG "nma-ap-avail-class"
+
 struct ap_notification_data 
 {
 	NMApplet *applet;
@@ -1026,12 +1251,122 @@ struct ap_notification_data
 	guint id;
 	gulong last_notification_time;
 	guint new_con_id;
+
+	guint removed_con_id;
+
+	/* Number of the device's APs in each class.  Connections coming and
+	 * going only affect the APs with their SSID, which are reclassified
+	 * from @dirty_ssids; all are counted afresh when one changed.
+	 */
+	guint counts[_AP_AVAIL_NUM];
+	guint modified_serial;
+	GHashTable *dirty_ssids;
 };
 
-/* Scan the list of access points, looking for the case where we have no
- * known (i.e. autoconnect) access points, but we do have unknown ones.
- * 
- * If we find one, notify the user.
+static ApAvailClass
+ap_avail_classify (NMDeviceWifi *device, NMAccessPoint *ap, NMApplet *applet)
+{
+	GPtrArray *ap_connections;
+	ApAvailClass klass = AP_AVAIL_UNKNOWN;
+	int a;
+
+	if (!nm_access_point_get_ssid (ap))
+		return AP_AVAIL_NONE;
+
+	ap_connections = get_connections_for_ap (device, ap, applet);
+	for (a = 0; a < ap_connections->len; a++) {
+		NMConnection *connection = NM_CONNECTION (ap_connections->pdata[a]);
+		NMSettingConnection *s_con;
+
+		s_con = nm_connection_get_setting_connection (connection);
+		if (nm_setting_connection_get_autoconnect (s_con))  {
+			klass = AP_AVAIL_AUTOCONNECT;
+			break;
+		}
+	}
+	g_ptr_array_unref (ap_connections);
+
+	return klass;
+}
+
+static void
+ap_avail_add (struct ap_notification_data *data, NMAccessPoint *ap)
+{
+	ApAvailClass klass;
+
+	klass = ap_avail_classify (data->device, ap, data->applet);
+	data->counts[klass]++;
+	g_object_set_data (G_OBJECT (ap), AP_AVAIL_CLASS_TAG, GUINT_TO_POINTER (klass + 1));
+}
+
+static void
+ap_avail_remove (struct ap_notification_data *data, NMAccessPoint *ap)
+{
+	guint klass;
+
+	klass = GPOINTER_TO_UINT (g_object_steal_data (G_OBJECT (ap), AP_AVAIL_CLASS_TAG));
+	if (klass && data->counts[klass - 1])
+		data->counts[klass - 1]--;
+}
+
+/* Counts all APs afresh; only needed after a connection changed */
+static void
+ap_avail_recount (struct ap_notification_data *data)
+{
+	const GPtrArray *aps;
+	int i;
+
+	memset (data->counts, 0, sizeof (data->counts));
+	data->modified_serial = data->applet->connections_modified_serial;
+	g_hash_table_remove_all (data->dirty_ssids);
+
+	aps = nm_device_wifi_get_access_points (data->device);
+	for (i = 0; aps && i < aps->len; i++)
+		ap_avail_add (data, aps->pdata[i]);
+}
+
+/* Reclassifies the APs a connection added or removed since could match */
+static void
+ap_avail_reclassify (struct ap_notification_data *data)
+{
+	const GPtrArray *aps;
+	int i;
+
+	aps = nm_device_wifi_get_access_points (data->device);
+	for (i = 0; aps && i < aps->len; i++) {
+		NMAccessPoint *ap = aps->pdata[i];
+		gs_unref_bytes GBytes *key = NULL;
+		GBytes *ssid;
+
+		ssid = nm_access_point_get_ssid (ap);
+		if (!ssid)
+			continue;
+
+		key = ssid_to_key (ssid);
+		if (g_hash_table_contains (data->dirty_ssids, key)) {
+			ap_avail_remove (data, ap);
+			ap_avail_add (data, ap);
+		}
+	}
+	g_hash_table_remove_all (data->dirty_ssids);
+}
+
+static void
+ap_avail_connection_dirty (struct ap_notification_data *data, NMConnection *connection)
+{
+	NMSettingWireless *s_wifi;
+	GBytes *ssid;
+
+	/* Connections without an SSID never match an AP */
+	s_wifi = nm_connection_get_setting_wireless (connection);
+	ssid = s_wifi ? nm_setting_wireless_get_ssid (s_wifi) : NULL;
+	if (ssid)
+		g_hash_table_add (data->dirty_ssids, ssid_to_key (ssid));
+}
+
+/* Notify the user when we have no known (i.e. autoconnect) access points,
+ * but we do have unknown ones.  The APs are counted as they come and go,
+ * so this doesn't have to look at each of them.
  */
 static gboolean
 idle_check_avail_access_point_notification (gpointer datap)
@@ -1039,13 +1374,7 @@ idle_check_avail_access_point_notification (gpointer datap)
 	struct ap_notification_data *data = datap;
 	NMApplet *applet = data->applet;
 	NMDeviceWifi *device = data->device;
-	int i;
-	const GPtrArray *aps;
-	GPtrArray *all_connections;
-	GPtrArray *connections;
 	GTimeVal timeval;
-	gboolean have_unused_access_point = FALSE;
-	gboolean have_no_autoconnect_points = TRUE;
 
 	data->id = 0;
 
@@ -1059,42 +1388,12 @@ idle_check_avail_access_point_notification (gpointer datap)
 	if ((timeval.tv_sec - data->last_notification_time) < 60*60) /* Notify at most once an hour */
 		return FALSE;	
 
-	all_connections = applet_get_all_connections (applet);
-	connections = nm_device_filter_connections (NM_DEVICE (device), all_connections);
-	g_ptr_array_unref (all_connections);	
-
-	aps = nm_device_wifi_get_access_points (device);
-	for (i = 0; i < aps->len; i++) {
-		NMAccessPoint *ap = aps->pdata[i];
-		GPtrArray *ap_connections;
-		int a;
-		gboolean is_autoconnect = FALSE;
-
-		if (!nm_access_point_get_ssid (ap))
-			continue;
-
-		ap_connections = nm_access_point_filter_connections (ap, connections);
-
-		for (a = 0; a < ap_connections->len; a++) {
-			NMConnection *connection = NM_CONNECTION (ap_connections->pdata[a]);
-			NMSettingConnection *s_con;
-
-			s_con = nm_connection_get_setting_connection (connection);
-			if (nm_setting_connection_get_autoconnect (s_con))  {
-				is_autoconnect = TRUE;
-				break;
-			}
-		}
-		g_ptr_array_unref (ap_connections);
-
-		if (!is_autoconnect)
-			have_unused_access_point = TRUE;
-		else
-			have_no_autoconnect_points = FALSE;
-	}
-	g_ptr_array_unref (connections);
+	if (data->modified_serial != applet->connections_modified_serial)
+		ap_avail_recount (data);
+	else if (g_hash_table_size (data->dirty_ssids))
+		ap_avail_reclassify (data);
 
-	if (!(have_unused_access_point && have_no_autoconnect_points))
+	if (!data->counts[AP_AVAIL_UNKNOWN] || data->counts[AP_AVAIL_AUTOCONNECT])
 		return FALSE;
 
 	/* Avoid notifying too often */
@@ -1129,6 +1428,43 @@ queue_avail_access_point_notification (NMDevice *device)
 	data->id = g_timeout_add_seconds (3, idle_check_avail_access_point_notification, data);
 }
 
+static void
+notify_ap_device_prop_changed_cb (NMAccessPoint *ap,
+                                  GParamSpec *pspec,
+                                  NMDevice *device)
+{
+	const char *prop = g_param_spec_get_name (pspec);
+	struct ap_notification_data *data;
+
+	data = g_object_get_data (G_OBJECT (device), "notify-wifi-avail-data");
+
+	if (   !strcmp (prop, NM_ACCESS_POINT_FLAGS)
+	    || !strcmp (prop, NM_ACCESS_POINT_WPA_FLAGS)
+	    || !strcmp (prop, NM_ACCESS_POINT_RSN_FLAGS)
+	    || !strcmp (prop, NM_ACCESS_POINT_SSID)
+	    || !strcmp (prop, NM_ACCESS_POINT_MODE)) {
+		/* May match other connections now */
+		ap_avail_remove (data, ap);
+		ap_avail_add (data, ap);
+	}
+}
+
+/* Keeps the per-device state derived from @ap up to date */
+static void
+watch_ap (NMDeviceWifi *device, NMAccessPoint *ap)
+{
+	struct ap_notification_data *data;
+
+	data = g_object_get_data (G_OBJECT (device), "notify-wifi-avail-data");
+	ap_avail_add (data, ap);
+
+	g_signal_connect_object (ap,
+	                         "notify",
+	                         G_CALLBACK (notify_ap_device_prop_changed_cb),
+	                         device,
+	                         0);
+}
+
 static void
 access_point_added_cb (NMDeviceWifi *device,
                        NMAccessPoint *ap,
@@ -1141,9 +1477,10 @@ access_point_added_cb (NMDeviceWifi *device,
 	                  "notify",
 	                  G_CALLBACK (notify_ap_prop_changed_cb),
 	                  applet);
+	watch_ap (device, ap);
 
 	queue_avail_access_point_notification (NM_DEVICE (device));
-	applet_schedule_update_menu (applet);
+	applet_schedule_update_device (applet, NM_DEVICE (device));
 }
 
 static void
@@ -1160,10 +1497,13 @@ access_point_removed_cb (NMDeviceWifi *device,
 	old = _active_ap_get (applet, (NMDevice *) device);
 	if (old == ap) {
 		_active_ap_set (applet, (NMDevice *) device, NULL);
-		applet_schedule_update_icon (applet);
+		applet_schedule_update (applet, APPLET_UPDATE_LINK | APPLET_UPDATE_TOOLTIP);
 	}
 
-	applet_schedule_update_menu (applet);
+	ap_avail_remove (g_object_get_data (G_OBJECT (device), "notify-wifi-avail-data"), ap);
+	g_signal_handlers_disconnect_by_func (ap, notify_ap_device_prop_changed_cb, device);
+
+	applet_schedule_update_device (applet, NM_DEVICE (device));
 }
 
 static void
@@ -1172,9 +1512,21 @@ on_new_connection (NMClient *client,
                    gpointer datap)
 {
 	struct ap_notification_data *data = datap;
+
+	ap_avail_connection_dirty (data, NM_CONNECTION (connection));
 	queue_avail_access_point_notification (NM_DEVICE (data->device));
 }
 
+static void
+on_connection_removed (NMClient *client,
+                       NMRemoteConnection *connection,
+                       gpointer datap)
+{
+	struct ap_notification_data *data = datap;
+
+	ap_avail_connection_dirty (data, NM_CONNECTION (connection));
+}
+
 static void
 free_ap_notification_data (gpointer user_data)
 {
@@ -1183,8 +1535,11 @@ free_ap_notification_data (gpointer user_data)
 
 	nm_clear_g_source (&data->id);
 
-	if (client)
+	if (client) {
 		g_signal_handler_disconnect (client, data->new_con_id);
+		g_signal_handler_disconnect (client, data->removed_con_id);
+	}
+	g_hash_table_unref (data->dirty_ssids);
 	memset (data, 0, sizeof (*data));
 	g_free (data);
 }
@@ -1228,15 +1583,24 @@ wifi_device_added (NMDevice *device, NMApplet *applet)
 	                       G_CALLBACK (on_new_connection),
 	                       data);
 	data->new_con_id = id;
+	data->removed_con_id = g_signal_connect (applet->nm_client,
+	                                         NM_CLIENT_CONNECTION_REMOVED,
+	                                         G_CALLBACK (on_connection_removed),
+	                                         data);
+	data->dirty_ssids = g_hash_table_new_full (g_bytes_hash, g_bytes_equal,
+	                                           (GDestroyNotify) g_bytes_unref, NULL);
 	g_object_set_data_full (G_OBJECT (wdev), "notify-wifi-avail-data",
 	                        data, free_ap_notification_data);
 
-	queue_avail_access_point_notification (device);
-
-	/* Hash all APs this device knows about */
+	/* Hash and count all APs this device knows about */
+	data->modified_serial = applet->connections_modified_serial;
 	aps = nm_device_wifi_get_access_points (wdev);
-	for (i = 0; aps && (i < aps->len); i++)
+	for (i = 0; aps && (i < aps->len); i++) {
 		add_hash_to_ap (g_ptr_array_index (aps, i));
+		watch_ap (wdev, g_ptr_array_index (aps, i));
+	}
+
+	queue_avail_access_point_notification (device);
 }
 
 static NMAccessPoint *
@@ -1338,7 +1702,10 @@ wifi_get_icon (NMDevice *device,
 		strength = ap ? nm_access_point_get_strength (ap) : 0;
 		strength = MIN (strength, 100);
 
-		*out_icon_name = mobile_helper_get_quality_icon_name (strength);
+		if (ap)
+			*out_icon_name = mobile_helper_get_quality_bucket_icon_name (_active_ap_get_bucket (applet, device));
+		else
+			*out_icon_name = mobile_helper_get_quality_icon_name (strength);
 
 		if (ap) {
 			char *ssid = get_ssid_utf8 (ap);
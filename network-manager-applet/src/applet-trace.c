@@ -0,0 +1,162 @@
+// SPDX-License-Identifier: GPL-2.0+
+/* NetworkManager Applet -- allow user control over networking */
+
+#include "nm-default.h"
+
+#include "applet-trace.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* Timings are always collected; they're cheap and can be read with
+ *
+ *   gdbus call --session --dest org.freedesktop.network-manager-applet \
+ *     --object-path /org/freedesktop/network_manager_applet \
+ *     --method org.freedesktop.NetworkManagerApplet.Debug.GetStats
+ *
+ * Setting NMA_TRACE in the environment additionally writes every span to
+ * the ftrace marker file, in the format systrace-style tools (sysprof,
+ * perfetto, trace-cmd) understand.  Spans can overlap (secrets requests
+ * and scans are asynchronous), so they are written as async slices with
+ * the start time as the cookie.
+ */
+
+typedef struct {
+	guint64 count;
+	guint64 total_usec;
+	guint64 max_usec;
+} SpanStats;
+
+static const char *span_names[_NMA_TRACE_SPAN_NUM] = {
+	[NMA_TRACE_UPDATE_ICON]     = "update-icon",
+	[NMA_TRACE_UPDATE_MENU]     = "update-menu",
+	[NMA_TRACE_ICON_LOAD]       = "icon-load",
+	[NMA_TRACE_SECRETS_REQUEST] = "secrets-request",
+	[NMA_TRACE_WIFI_SCAN]       = "wifi-scan",
+};
+
+static const char *counter_names[_NMA_TRACE_COUNTER_NUM] = {
+	[NMA_TRACE_UPDATE_SCHEDULED]     = "updates-scheduled",
+	[NMA_TRACE_UPDATE_COALESCED]     = "updates-coalesced",
+	[NMA_TRACE_UPDATE_RUN]           = "updates-run",
+	[NMA_TRACE_STRENGTH_CHANGED]     = "strength-changes-shown",
+	[NMA_TRACE_STRENGTH_SUPPRESSED]  = "strength-changes-suppressed",
+	[NMA_TRACE_MENU_ITEM_CREATED]    = "menu-items-created",
+	[NMA_TRACE_MENU_ITEM_REUSED]     = "menu-items-reused",
+	[NMA_TRACE_SECRETS_SHARED]       = "secrets-requests-shared",
+	[NMA_TRACE_SECRETS_QUEUED]       = "secrets-requests-queued",
+	[NMA_TRACE_SECRETS_CACHE_HIT]    = "secrets-cache-hits",
+	[NMA_TRACE_SECRETS_CACHE_MISS]   = "secrets-cache-misses",
+	[NMA_TRACE_SECRETS_PREFETCH_HIT] = "secrets-prefetch-hits",
+};
+
+static SpanStats spans[_NMA_TRACE_SPAN_NUM];
+static guint64 counters[_NMA_TRACE_COUNTER_NUM];
+static int marker_fd = -1;
+
+static void
+trace_mark (char phase, NMATraceSpan span, gint64 cookie)
+{
+	char buf[128];
+	int len;
+
+	len = g_snprintf (buf, sizeof (buf), "%c|%d|nm-applet:%s|%" G_GINT64_FORMAT,
+	                  phase, (int) getpid (), span_names[span], cookie);
+	if (write (marker_fd, buf, MIN (len, (int) sizeof (buf) - 1)) < 0) {
+		/* Tracing got switched off underneath us */
+		close (marker_fd);
+		marker_fd = -1;
+	}
+}
+
+void
+nma_trace_init (void)
+{
+	static const char *markers[] = {
+		"/sys/kernel/tracing/trace_marker",
+		"/sys/kernel/debug/tracing/trace_marker",
+	};
+	guint i;
+
+	if (marker_fd >= 0 || !g_getenv ("NMA_TRACE"))
+		return;
+
+	for (i = 0; i < G_N_ELEMENTS (markers) && marker_fd < 0; i++)
+		marker_fd = open (markers[i], O_WRONLY | O_CLOEXEC);
+
+	if (marker_fd < 0)
+		g_warning ("NMA_TRACE is set but no ftrace marker file could be opened");
+}
+
+/*
+ * nma_trace_begin
+ *
+ * Starts timing @span.  Returns the start time, which must be handed
+ * back to nma_trace_end().
+ */
+gint64
+nma_trace_begin (NMATraceSpan span)
+{
+	gint64 now = g_get_monotonic_time ();
+
+	g_return_val_if_fail (span < _NMA_TRACE_SPAN_NUM, now);
+
+	if (marker_fd >= 0)
+		trace_mark ('S', span, now);
+	return now;
+}
+
+void
+nma_trace_end (NMATraceSpan span, gint64 begin)
+{
+	SpanStats *stats;
+	guint64 elapsed;
+
+	g_return_if_fail (span < _NMA_TRACE_SPAN_NUM);
+
+	if (!begin)
+		return;
+
+	elapsed = MAX (g_get_monotonic_time () - begin, 0);
+	stats = &spans[span];
+	stats->count++;
+	stats->total_usec += elapsed;
+	stats->max_usec = MAX (stats->max_usec, elapsed);
+
+	if (marker_fd >= 0)
+		trace_mark ('F', span, begin);
+}
+
+void
+nma_trace_count (NMATraceCounter counter)
+{
+	g_return_if_fail (counter < _NMA_TRACE_COUNTER_NUM);
+
+	counters[counter]++;
+}
+
+/*
+ * nma_trace_add_stats
+ *
+ * Adds the spans as (count, total usec, max usec) and the counters as
+ * plain numbers to an a{sv} @builder.
+ */
+void
+nma_trace_add_stats (GVariantBuilder *builder)
+{
+	guint i;
+
+	for (i = 0; i < _NMA_TRACE_SPAN_NUM; i++) {
+		g_variant_builder_add (builder, "{sv}", span_names[i],
+		                       g_variant_new ("(ttt)",
+		                                      spans[i].count,
+		                                      spans[i].total_usec,
+		                                      spans[i].max_usec));
+	}
+	for (i = 0; i < _NMA_TRACE_COUNTER_NUM; i++) {
+		g_variant_builder_add (builder, "{sv}", counter_names[i],
+		                       g_variant_new_uint64 (counters[i]));
+	}
+}
@@ -0,0 +1,42 @@
+// SPDX-License-Identifier: GPL-2.0+
+/* NetworkManager Applet -- allow user control over networking */
+
+#ifndef APPLET_TRACE_H
+#define APPLET_TRACE_H
+
+typedef enum {
+	NMA_TRACE_UPDATE_ICON,
+	NMA_TRACE_UPDATE_MENU,
+	NMA_TRACE_ICON_LOAD,
+	NMA_TRACE_SECRETS_REQUEST,
+	NMA_TRACE_WIFI_SCAN,
+	_NMA_TRACE_SPAN_NUM,
+} NMATraceSpan;
+
+typedef enum {
+	NMA_TRACE_UPDATE_SCHEDULED,
+	NMA_TRACE_UPDATE_COALESCED,
+	NMA_TRACE_UPDATE_RUN,
+	NMA_TRACE_STRENGTH_CHANGED,
+	NMA_TRACE_STRENGTH_SUPPRESSED,
+	NMA_TRACE_MENU_ITEM_CREATED,
+	NMA_TRACE_MENU_ITEM_REUSED,
+	NMA_TRACE_SECRETS_SHARED,
+	NMA_TRACE_SECRETS_QUEUED,
+	NMA_TRACE_SECRETS_CACHE_HIT,
+	NMA_TRACE_SECRETS_CACHE_MISS,
+	NMA_TRACE_SECRETS_PREFETCH_HIT,
+	_NMA_TRACE_COUNTER_NUM,
+} NMATraceCounter;
+
+void nma_trace_init (void);
+
+gint64 nma_trace_begin (NMATraceSpan span);
+
+void nma_trace_end (NMATraceSpan span, gint64 begin);
+
+void nma_trace_count (NMATraceCounter counter);
+
+void nma_trace_add_stats (GVariantBuilder *builder);
+
+#endif  /* APPLET_TRACE_H */
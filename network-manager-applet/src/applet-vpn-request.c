@@ -18,11 +18,16 @@
 #include <sys/wait.h>
 #include <unistd.h>
 #include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <glib-unix.h>
 
 #include "nma-vpn-password-dialog.h"
 #include "nm-utils/nm-compat.h"
 #include "nm-utils/nm-shared-utils.h"
 
+extern gboolean vpn_auth_pool;
+
 /*****************************************************************************/
 
 typedef struct {
@@ -40,9 +45,20 @@ typedef struct {
 
 	guint watch_id;
 	GPid pid;
+	char **argv;
+
+	int child_stdin;
+	GIOChannel *stdin_channel;
+	guint stdin_eventid;
+	char *stdin_data;
+	gsize stdin_len;
+	gsize stdin_written;
 
 	int child_stdout;
 	GString *child_response;
+	gsize child_response_total;
+	char *child_key;
+	gboolean child_done;
 	GIOChannel *channel;
 	guint channel_eventid;
 	GVariantBuilder secrets_builder;
@@ -58,9 +74,17 @@ typedef struct {
 	RequestData *req_data;
 } VpnSecretsInfo;
 
+/* Limits on what an auth dialog may send back */
+#define CHILD_RESPONSE_MAX  (1024 * 1024)
+#define CHILD_LINE_MAX      (64 * 1024)
+
+/* Largest single write() of the connection to the auth dialog */
+#define CHILD_WRITE_CHUNK   (64 * 1024)
+
 /*****************************************************************************/
 
 static void complete_request (VpnSecretsInfo *info);
+static void warm_pool_add (const char *service_type, const char *const*argv);
 
 /*****************************************************************************/
 
@@ -285,9 +309,89 @@ complete_request (VpnSecretsInfo *info)
 	settings = g_variant_ref_sink (g_variant_builder_end (&settings_builder));
 
 	applet_secrets_request_complete (req, settings, NULL);
+
+	/* The connection is likely to be reconnected; have a dialog ready */
+	warm_pool_add (req_data->service_type, (const char *const*) req_data->argv);
+
 	applet_secrets_request_free (req);
 }
 
+/* Wipes the buffered output, which may well contain secrets */
+static void
+child_response_clear (GString *response)
+{
+	memset (response->str, 0, response->len);
+	g_string_truncate (response, 0);
+}
+
+/* The plain protocol is alternating key and value lines, up to the first
+ * empty key.
+ */
+static void
+child_response_line (RequestData *req_data, const char *line)
+{
+	if (req_data->child_done)
+		return;
+
+	if (!req_data->child_key) {
+		if (!line[0])
+			req_data->child_done = TRUE;
+		else
+			req_data->child_key = g_strdup (line);
+	} else {
+		g_variant_builder_add (&req_data->secrets_builder, "{ss}", req_data->child_key, line);
+		nm_clear_g_free (&req_data->child_key);
+	}
+}
+
+static gboolean
+child_response_append (RequestData *req_data,
+                       const char *buf,
+                       gsize len,
+                       GError **error)
+{
+	const char *nl;
+	gsize n;
+
+	req_data->child_response_total += len;
+	if (req_data->child_response_total > CHILD_RESPONSE_MAX) {
+		g_set_error_literal (error,
+		                     NM_SECRET_AGENT_ERROR,
+		                     NM_SECRET_AGENT_ERROR_FAILED,
+		                     "Too much output from VPN UI");
+		return FALSE;
+	}
+
+	/* The external UI description is a key file and is parsed as a whole */
+	if (req_data->external_ui_mode) {
+		g_string_append_len (req_data->child_response, buf, len);
+		return TRUE;
+	}
+
+	while (len) {
+		nl = memchr (buf, '\n', len);
+		n = nl ? (gsize) (nl - buf) : len;
+
+		if (req_data->child_response->len + n > CHILD_LINE_MAX) {
+			g_set_error_literal (error,
+			                     NM_SECRET_AGENT_ERROR,
+			                     NM_SECRET_AGENT_ERROR_FAILED,
+			                     "Line too long in output from VPN UI");
+			return FALSE;
+		}
+		g_string_append_len (req_data->child_response, buf, n);
+		if (!nl)
+			break;
+
+		child_response_line (req_data, req_data->child_response->str);
+		child_response_clear (req_data->child_response);
+		buf = nl + 1;
+		len -= n + 1;
+	}
+
+	return TRUE;
+}
+
 static void
 process_child_response (VpnSecretsInfo *info)
 {
@@ -301,16 +405,9 @@ process_child_response (VpnSecretsInfo *info)
 			applet_secrets_request_free (req);
 		}
 	} else {
-		char **lines = g_strsplit (req_data->child_response->str, "\n", -1);
-		int i;
-
-		for (i = 0; lines[i] && *(lines[i]); i += 2) {
-			if (lines[i + 1] == NULL)
-				break;
-			g_variant_builder_add (&req_data->secrets_builder, "{ss}", lines[i], lines[i + 1]);
-		}
-
-		g_strfreev (lines);
+		/* Whatever follows the last newline counts as a line too */
+		child_response_line (req_data, req_data->child_response->str);
+		child_response_clear (req_data->child_response);
 		complete_request (info);
 	}
 }
@@ -366,7 +463,12 @@ child_stdout_data_cb (GIOChannel *source, GIOCondition condition, gpointer user_
 		}
 		return FALSE;
 	case G_IO_STATUS_NORMAL:
-		g_string_append_len (req_data->child_response, buf, bytes_read);
+		if (!child_response_append (req_data, buf, bytes_read, &error)) {
+			req_data->channel_eventid = 0;
+			applet_secrets_request_complete (req, NULL, error);
+			applet_secrets_request_free (req);
+			return FALSE;
+		}
 		break;
 	default:
 		/* What just happened... */
@@ -451,41 +553,150 @@ connection_to_data (NMConnection *connection,
 
 /*****************************************************************************/
 
+/* write() with SIGPIPE blocked, so that an auth dialog that went away only
+ * makes it fail with EPIPE instead of killing the applet.
+ */
+static gssize
+write_no_sigpipe (int fd, const void *buf, gsize len)
+{
+	sigset_t sigpipe, old_mask, pending;
+	struct timespec zero = { 0, 0 };
+	gboolean was_pending;
+	gssize w;
+	int errsv;
+
+	sigemptyset (&sigpipe);
+	sigaddset (&sigpipe, SIGPIPE);
+	pthread_sigmask (SIG_BLOCK, &sigpipe, &old_mask);
+
+	sigpending (&pending);
+	was_pending = sigismember (&pending, SIGPIPE);
+
+	w = write (fd, buf, len);
+	errsv = errno;
+
+	/* Consume the signal raised by this write, but not one raised elsewhere */
+	if (w < 0 && errsv == EPIPE && !was_pending) {
+		while (sigtimedwait (&sigpipe, NULL, &zero) < 0 && errno == EINTR)
+			;
+	}
+
+	pthread_sigmask (SIG_SETMASK, &old_mask, NULL);
+
+	errno = errsv;
+	return w;
+}
+
+/* Writes as much of the connection as the pipe takes right now */
 static gboolean
-connection_to_fd (NMConnection *connection,
-                  int fd,
-                  GError **error)
+child_stdin_write (RequestData *req_data, GError **error)
 {
-	gs_free char *data = NULL;
-	gsize data_len;
 	gssize w;
 	int errsv;
 
-	data = connection_to_data (connection, &data_len, error);
-	if (!data)
-		return FALSE;
+	while (req_data->stdin_written < req_data->stdin_len) {
+		w = write_no_sigpipe (req_data->child_stdin,
+		                      req_data->stdin_data + req_data->stdin_written,
+		                      MIN (req_data->stdin_len - req_data->stdin_written, CHILD_WRITE_CHUNK));
+		if (w < 0) {
+			errsv = errno;
+			if (errsv == EINTR)
+				continue;
+			if (errsv == EAGAIN)
+				return TRUE;
+			g_set_error (error,
+			             NM_SECRET_AGENT_ERROR,
+			             NM_SECRET_AGENT_ERROR_FAILED,
+			             _("Failed to write connection to VPN UI: %s (%d)"), g_strerror (errsv), errsv);
+			return FALSE;
+		}
+		req_data->stdin_written += w;
+	}
 
-again:
-	w = write (fd, data, data_len);
-	if (w < 0) {
-		errsv = errno;
-		if (errsv == EINTR)
-			goto again;
-		g_set_error (error,
+	return TRUE;
+}
+
+static void
+child_stdin_close (RequestData *req_data)
+{
+	nm_clear_g_source (&req_data->stdin_eventid);
+	if (req_data->stdin_channel) {
+		g_io_channel_unref (req_data->stdin_channel);
+		req_data->stdin_channel = NULL;
+	} else if (req_data->child_stdin >= 0)
+		close (req_data->child_stdin);
+	req_data->child_stdin = -1;
+
+	nm_free_secret (req_data->stdin_data);
+	req_data->stdin_data = NULL;
+}
+
+static gboolean
+child_stdin_cb (GIOChannel *source, GIOCondition condition, gpointer user_data)
+{
+	SecretsRequest *req = user_data;
+	RequestData *req_data = ((VpnSecretsInfo *) req)->req_data;
+	gs_free_error GError *error = NULL;
+
+	/* The dialog closed its input before reading all of the connection */
+	if (condition & (G_IO_ERR | G_IO_HUP | G_IO_NVAL)) {
+		g_set_error (&error,
 		             NM_SECRET_AGENT_ERROR,
 		             NM_SECRET_AGENT_ERROR_FAILED,
-		             _("Failed to write connection to VPN UI: %s (%d)"), g_strerror (errsv), errsv);
-		return FALSE;
+		             _("VPN UI closed its input before reading the connection"));
+		req_data->stdin_eventid = 0;
+		applet_secrets_request_complete (req, NULL, error);
+		applet_secrets_request_free (req);
+		return G_SOURCE_REMOVE;
 	}
 
-	if ((gsize) w != data_len) {
-		g_set_error_literal (error,
-		                     NM_SECRET_AGENT_ERROR,
-		                     NM_SECRET_AGENT_ERROR_FAILED,
-		                     _("Failed to write connection to VPN UI: incomplete write"));
+	if (!child_stdin_write (req_data, &error)) {
+		req_data->stdin_eventid = 0;
+		applet_secrets_request_complete (req, NULL, error);
+		applet_secrets_request_free (req);
+		return G_SOURCE_REMOVE;
+	}
+
+	if (req_data->stdin_written < req_data->stdin_len)
+		return G_SOURCE_CONTINUE;
+
+	req_data->stdin_eventid = 0;
+	child_stdin_close (req_data);
+	return G_SOURCE_REMOVE;
+}
+
+/* Sends the connection to the auth dialog.  Anything that doesn't fit into
+ * the pipe right away is written from the main loop as the dialog reads it,
+ * so big inline certificates and configs neither block the applet nor fail.
+ */
+static gboolean
+connection_to_child (VpnSecretsInfo *info,
+                     NMConnection *connection,
+                     GError **error)
+{
+	RequestData *req_data = info->req_data;
+
+	req_data->stdin_data = connection_to_data (connection, &req_data->stdin_len, error);
+	if (!req_data->stdin_data)
 		return FALSE;
+
+	if (!g_unix_set_fd_nonblocking (req_data->child_stdin, TRUE, error))
+		return FALSE;
+
+	if (!child_stdin_write (req_data, error))
+		return FALSE;
+
+	if (req_data->stdin_written == req_data->stdin_len) {
+		child_stdin_close (req_data);
+		return TRUE;
 	}
 
+	req_data->stdin_channel = g_io_channel_unix_new (req_data->child_stdin);
+	g_io_channel_set_close_on_unref (req_data->stdin_channel, TRUE);
+	req_data->stdin_eventid = g_io_add_watch (req_data->stdin_channel,
+	                                          G_IO_OUT | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
+	                                          child_stdin_cb,
+	                                          info);
 	return TRUE;
 }
 
@@ -499,33 +710,24 @@ vpn_child_setup (gpointer user_data)
 	setpgid (pid, pid);
 }
 
-static gboolean
-auth_dialog_spawn (const char *con_id,
-                   const char *con_uuid,
-                   const char *const*hints,
-                   const char *auth_dialog,
-                   const char *service_type,
-                   gboolean supports_hints,
-                   gboolean external_ui_mode,
-                   guint32 flags,
-                   GPid *out_pid,
-                   int *out_stdin,
-                   int *out_stdout,
-                   GError **error)
+static const char **
+auth_dialog_argv (const char *con_id,
+                  const char *con_uuid,
+                  const char *const*hints,
+                  const char *auth_dialog,
+                  const char *service_type,
+                  gboolean supports_hints,
+                  gboolean external_ui_mode,
+                  guint32 flags)
 {
 	gsize hints_len;
 	gsize i, j;
-	gs_free const char **argv = NULL;
-	gs_free const char **envp = NULL;
-	gsize environ_len;
+	const char **argv;
 
-	g_return_val_if_fail (con_id, FALSE);
-	g_return_val_if_fail (con_uuid, FALSE);
-	g_return_val_if_fail (auth_dialog, FALSE);
-	g_return_val_if_fail (service_type, FALSE);
-	g_return_val_if_fail (out_pid, FALSE);
-	g_return_val_if_fail (out_stdin, FALSE);
-	g_return_val_if_fail (out_stdout, FALSE);
+	g_return_val_if_fail (con_id, NULL);
+	g_return_val_if_fail (con_uuid, NULL);
+	g_return_val_if_fail (auth_dialog, NULL);
+	g_return_val_if_fail (service_type, NULL);
 
 	hints_len = NM_PTRARRAY_LEN (hints);
 	argv = g_new (const char *, 11 + (2 * hints_len));
@@ -550,6 +752,25 @@ auth_dialog_spawn (const char *con_id,
 	nm_assert (i <= 10 + (2 * hints_len));
 	argv[i++] = NULL;
 
+	return argv;
+}
+
+static gboolean
+auth_dialog_spawn (const char *const*argv,
+                   GPid *out_pid,
+                   int *out_stdin,
+                   int *out_stdout,
+                   GError **error)
+{
+	gsize i, j;
+	gs_free const char **envp = NULL;
+	gsize environ_len;
+
+	g_return_val_if_fail (argv && argv[0], FALSE);
+	g_return_val_if_fail (out_pid, FALSE);
+	g_return_val_if_fail (out_stdin, FALSE);
+	g_return_val_if_fail (out_stdout, FALSE);
+
 	environ_len = NM_PTRARRAY_LEN (environ);
 	envp = g_new (const char *, environ_len + 1);
 	memcpy (envp, environ, sizeof (const char *) * environ_len);
@@ -593,6 +814,242 @@ ensure_killed (gpointer data)
 	return FALSE;
 }
 
+static void
+terminate_child (GPid pid)
+{
+	if (kill (pid, SIGTERM) == 0)
+		g_timeout_add_seconds (2, ensure_killed, GINT_TO_POINTER (pid));
+	else {
+		kill (pid, SIGKILL);
+		waitpid (pid, NULL, 0);
+	}
+}
+
+/*****************************************************************************/
+
+/* Warm auth dialog pool (--vpn-auth-pool)
+ *
+ * Starting an auth dialog means loading GTK and the plugin's editor
+ * library, which easily dominates the time it takes to bring a VPN up.
+ * The dialogs read the connection from stdin before doing anything else,
+ * so once a request for a connection has succeeded, another dialog with
+ * the same arguments is started and left waiting there.  The next request
+ * with identical arguments takes it over and only has to write the
+ * connection out.  There is at most one waiting dialog per VPN service
+ * type, they go away when unused for a while, and one that takes more
+ * memory than allowed is killed and not started again.
+ */
+
+#define WARM_POOL_MAX_HELPERS   2
+#define WARM_POOL_IDLE_TIMEOUT  600
+#define WARM_POOL_CHECK_DELAY   10
+#define WARM_POOL_MAX_RSS       (64 * 1024 * 1024)
+
+typedef struct {
+	char *service_type;
+	char *key;
+	GPid pid;
+	int child_stdin;
+	int child_stdout;
+	gint64 started;
+
+	guint watch_id;
+	guint idle_id;
+	guint check_id;
+} WarmHelper;
+
+/* service type -> WarmHelper */
+static GHashTable *warm_helpers;
+/* service types whose dialogs were too big to keep around */
+static GHashTable *warm_oversized;
+
+static char *
+warm_pool_key (const char *const*argv)
+{
+	return g_strjoinv ("\x1f", (char **) argv);
+}
+
+static void
+warm_helper_free (WarmHelper *helper, gboolean terminate)
+{
+	nm_clear_g_source (&helper->watch_id);
+	nm_clear_g_source (&helper->idle_id);
+	nm_clear_g_source (&helper->check_id);
+
+	if (terminate) {
+		close (helper->child_stdin);
+		close (helper->child_stdout);
+		if (helper->pid)
+			terminate_child (helper->pid);
+	}
+
+	g_free (helper->service_type);
+	g_free (helper->key);
+	g_slice_free (WarmHelper, helper);
+}
+
+static void
+warm_helper_remove (WarmHelper *helper)
+{
+	g_hash_table_steal (warm_helpers, helper->service_type);
+	warm_helper_free (helper, TRUE);
+}
+
+static void
+warm_helper_exited_cb (GPid pid, int status, gpointer user_data)
+{
+	WarmHelper *helper = user_data;
+
+	helper->watch_id = 0;
+	helper->pid = 0;
+	warm_helper_remove (helper);
+}
+
+static gboolean
+warm_helper_idle_cb (gpointer user_data)
+{
+	WarmHelper *helper = user_data;
+
+	helper->idle_id = 0;
+	warm_helper_remove (helper);
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean
+warm_helper_check_cb (gpointer user_data)
+{
+	WarmHelper *helper = user_data;
+	gs_free char *path = NULL;
+	gs_free char *contents = NULL;
+	unsigned long size, resident;
+
+	helper->check_id = 0;
+
+	/* By now the dialog should have finished loading whatever it loads
+	 * before reading the connection.
+	 */
+	path = g_strdup_printf ("/proc/%d/statm", (int) helper->pid);
+	if (   !g_file_get_contents (path, &contents, NULL, NULL)
+	    || sscanf (contents, "%lu %lu", &size, &resident) != 2)
+		return G_SOURCE_REMOVE;
+
+	if ((guint64) resident * sysconf (_SC_PAGESIZE) > WARM_POOL_MAX_RSS) {
+		g_message ("Not keeping %s auth dialogs around: %lu KiB resident",
+		           helper->service_type,
+		           (unsigned long) (resident * (sysconf (_SC_PAGESIZE) / 1024)));
+		if (!warm_oversized)
+			warm_oversized = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+		g_hash_table_add (warm_oversized, g_strdup (helper->service_type));
+		warm_helper_remove (helper);
+	}
+
+	return G_SOURCE_REMOVE;
+}
+
+static void
+warm_pool_add (const char *service_type, const char *const*argv)
+{
+	gs_free_error GError *error = NULL;
+	gs_free char *key = NULL;
+	WarmHelper *helper;
+	GHashTableIter iter;
+
+	if (!vpn_auth_pool || !service_type || !argv)
+		return;
+	if (warm_oversized && g_hash_table_contains (warm_oversized, service_type))
+		return;
+
+	if (!warm_helpers)
+		warm_helpers = g_hash_table_new (g_str_hash, g_str_equal);
+
+	key = warm_pool_key (argv);
+	helper = g_hash_table_lookup (warm_helpers, service_type);
+	if (helper) {
+		if (nm_streq (helper->key, key)) {
+			/* Already waiting; just start the idle timeout over */
+			nm_clear_g_source (&helper->idle_id);
+			helper->idle_id = g_timeout_add_seconds (WARM_POOL_IDLE_TIMEOUT, warm_helper_idle_cb, helper);
+			return;
+		}
+		warm_helper_remove (helper);
+	}
+
+	/* Make room by dropping the oldest one */
+	if (g_hash_table_size (warm_helpers) >= WARM_POOL_MAX_HELPERS) {
+		WarmHelper *oldest = NULL;
+
+		g_hash_table_iter_init (&iter, warm_helpers);
+		while (g_hash_table_iter_next (&iter, NULL, (gpointer) &helper)) {
+			if (!oldest || helper->started < oldest->started)
+				oldest = helper;
+		}
+		warm_helper_remove (oldest);
+	}
+
+	helper = g_slice_new0 (WarmHelper);
+	if (!auth_dialog_spawn (argv, &helper->pid, &helper->child_stdin, &helper->child_stdout, &error)) {
+		g_debug ("Could not start a %s auth dialog in advance: %s", service_type, error->message);
+		g_slice_free (WarmHelper, helper);
+		return;
+	}
+
+	helper->service_type = g_strdup (service_type);
+	helper->key = g_steal_pointer (&key);
+	helper->started = g_get_monotonic_time ();
+	helper->watch_id = g_child_watch_add (helper->pid, warm_helper_exited_cb, helper);
+	helper->idle_id = g_timeout_add_seconds (WARM_POOL_IDLE_TIMEOUT, warm_helper_idle_cb, helper);
+	helper->check_id = g_timeout_add_seconds (WARM_POOL_CHECK_DELAY, warm_helper_check_cb, helper);
+	g_hash_table_insert (warm_helpers, helper->service_type, helper);
+}
+
+/* Hands over the waiting dialog for @service_type if it was started with
+ * exactly @argv.
+ */
+static gboolean
+warm_pool_take (const char *service_type,
+                const char *const*argv,
+                GPid *out_pid,
+                int *out_stdin,
+                int *out_stdout)
+{
+	gs_free char *key = NULL;
+	WarmHelper *helper;
+
+	if (!warm_helpers)
+		return FALSE;
+
+	helper = g_hash_table_lookup (warm_helpers, service_type);
+	if (!helper)
+		return FALSE;
+
+	key = warm_pool_key (argv);
+	if (!nm_streq (helper->key, key))
+		return FALSE;
+
+	g_hash_table_steal (warm_helpers, service_type);
+	*out_pid = helper->pid;
+	*out_stdin = helper->child_stdin;
+	*out_stdout = helper->child_stdout;
+	warm_helper_free (helper, FALSE);
+	return TRUE;
+}
+
+void
+applet_vpn_request_clear_pool (void)
+{
+	GHashTableIter iter;
+	WarmHelper *helper;
+
+	if (!warm_helpers)
+		return;
+
+	g_hash_table_iter_init (&iter, warm_helpers);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer) &helper)) {
+		g_hash_table_iter_steal (&iter);
+		warm_helper_free (helper, TRUE);
+	}
+}
+
 static void
 dialog_response_destroy (GtkDialog *dialog, int response_id, gpointer user_data)
 {
@@ -615,24 +1072,24 @@ free_vpn_secrets_info (SecretsRequest *req)
 	g_free (req_data->uuid);
 	g_free (req_data->id);
 	g_free (req_data->service_type);
+	g_strfreev (req_data->argv);
 
 	nm_clear_g_source (&req_data->watch_id);
 
+	child_stdin_close (req_data);
+
 	nm_clear_g_source (&req_data->channel_eventid);
 	if (req_data->channel)
 		g_io_channel_unref (req_data->channel);
 
-	if (req_data->pid) {
-		if (kill (req_data->pid, SIGTERM) == 0)
-			g_timeout_add_seconds (2, ensure_killed, GINT_TO_POINTER (req_data->pid));
-		else {
-			kill (req_data->pid, SIGKILL);
-			waitpid (req_data->pid, NULL, 0);
-		}
-	}
+	if (req_data->pid)
+		terminate_child (req_data->pid);
 
-	if (req_data->child_response)
+	if (req_data->child_response) {
+		child_response_clear (req_data->child_response);
 		g_string_free (req_data->child_response, TRUE);
+	}
+	g_free (req_data->child_key);
 
 	g_variant_builder_clear (&req_data->secrets_builder);
 
@@ -670,7 +1127,7 @@ applet_vpn_request_get_secrets (SecretsRequest *req, GError **error)
 	const char *service_type;
 	const char *auth_dialog;
 	gs_unref_object NMVpnPluginInfo *plugin = NULL;
-	int child_stdin;
+	gs_free const char **argv = NULL;
 
 	applet_secrets_request_set_free_func (req, free_vpn_secrets_info);
 
@@ -703,6 +1160,8 @@ applet_vpn_request_get_secrets (SecretsRequest *req, GError **error)
 		return FALSE;
 	}
 	req_data = info->req_data;
+	req_data->service_type = g_strdup (service_type);
+	req_data->child_stdin = -1;
 
 	g_variant_builder_init (&req_data->secrets_builder, G_VARIANT_TYPE ("a{ss}"));
 
@@ -712,19 +1171,37 @@ applet_vpn_request_get_secrets (SecretsRequest *req, GError **error)
 		                                    "supports-external-ui-mode"),
 		FALSE);
 
-	if (!auth_dialog_spawn (nm_setting_connection_get_id (s_con),
-	                        nm_setting_connection_get_uuid (s_con),
-	                        (const char *const*) req->hints,
-	                        auth_dialog,
-	                        service_type,
-	                        nm_vpn_plugin_info_supports_hints (plugin),
-	                        req_data->external_ui_mode,
-	                        req->flags,
-	                        &req_data->pid,
-	                        &child_stdin,
-	                        &req_data->child_stdout,
-	                        error))
+	argv = auth_dialog_argv (nm_setting_connection_get_id (s_con),
+	                         nm_setting_connection_get_uuid (s_con),
+	                         (const char *const*) req->hints,
+	                         auth_dialog,
+	                         service_type,
+	                         nm_vpn_plugin_info_supports_hints (plugin),
+	                         req_data->external_ui_mode,
+	                         req->flags);
+	if (!argv) {
+		g_set_error_literal (error,
+		                     NM_SECRET_AGENT_ERROR,
+		                     NM_SECRET_AGENT_ERROR_FAILED,
+		                     "Connection had no ID or UUID");
 		return FALSE;
+	}
+
+	if (!warm_pool_take (service_type,
+	                     argv,
+	                     &req_data->pid,
+	                     &req_data->child_stdin,
+	                     &req_data->child_stdout)) {
+		if (!auth_dialog_spawn (argv,
+		                        &req_data->pid,
+		                        &req_data->child_stdin,
+		                        &req_data->child_stdout,
+		                        error))
+			return FALSE;
+	}
+
+	if (vpn_auth_pool)
+		req_data->argv = g_strdupv ((char **) argv);
 
 	/* catch when child is reaped */
 	req_data->watch_id = g_child_watch_add (req_data->pid, child_finished_cb, info);
@@ -737,12 +1214,8 @@ applet_vpn_request_get_secrets (SecretsRequest *req, GError **error)
 	                                            child_stdout_data_cb,
 	                                            info);
 
-	if (!connection_to_fd (req->connection, child_stdin, error))
-		return FALSE;
-	close (child_stdin);
-
 	g_io_channel_set_encoding (req_data->channel, NULL, NULL);
 
 	/* Dump parts of the connection to the child */
-	return TRUE;
+	return connection_to_child (info, req->connection, error);
 }
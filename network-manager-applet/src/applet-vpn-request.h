@@ -15,5 +15,7 @@ size_t applet_vpn_request_get_secrets_size (void);
 
 gboolean applet_vpn_request_get_secrets (SecretsRequest *req, GError **error);
 
+void applet_vpn_request_clear_pool (void);
+
 #endif  /* APPLET_VPN_REQUEST_H */
 
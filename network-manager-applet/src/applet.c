@@ -24,12 +24,15 @@
 #include <libnotify/notify.h>
 
 #include "applet.h"
+#include "ap-menu-item.h"
+#include "mb-menu-item.h"
 #include "applet-device-bt.h"
 #include "applet-device-ethernet.h"
 #include "applet-device-wifi.h"
 #include "applet-dialogs.h"
 #include "nma-wifi-dialog.h"
 #include "applet-vpn-request.h"
+#include "applet-trace.h"
 #include "utils.h"
 
 #if WITH_WWAN
@@ -41,28 +44,210 @@
 extern gboolean shell_debug;
 extern gboolean with_agent;
 extern gboolean with_appindicator;
+extern guint max_refresh_rate;
+extern guint max_secrets_requests;
+extern guint secrets_cache_ttl;
 
 G_DEFINE_TYPE (NMApplet, nma, G_TYPE_APPLICATION)
 
 /********************************************************************/
 
-static gboolean
-applet_request_wifi_scan (NMApplet *applet)
+static void
+applet_startup_phase (NMApplet *applet, const char *phase)
 {
-	const GPtrArray *devices;
-	NMDevice *device;
-	int i;
+	if (shell_debug) {
+		g_message ("startup: %s after %.1f ms", phase,
+		           (g_get_monotonic_time () - applet->startup_time) / 1000.0);
+	}
+}
+
+/********************************************************************/
+
+/* Wi-Fi scan scheduling
+ *
+ * While the menu is open each Wi-Fi device is considered every
+ * WIFI_SCAN_TICK seconds.  A device is only asked to scan when its own
+ * interval has passed, no scan is in flight and NetworkManager has not
+ * scanned recently on its own.  The interval doubles while the list of
+ * access points stays the same and drops back to the minimum when it
+ * changes or the device seems to be roaming, that is when the active
+ * access point changes or its signal first drops below
+ * WIFI_SCAN_WEAK_STRENGTH.  Roaming scans are still never requested
+ * more often than every WIFI_SCAN_INTERVAL_MIN seconds.
+ */
+#define WIFI_SCAN_TICK          5
+#define WIFI_SCAN_INTERVAL_MIN  15
+#define WIFI_SCAN_INTERVAL_MAX  120
+#define WIFI_SCAN_RECENT_MSEC   10000
+#define WIFI_SCAN_WEAK_STRENGTH 30
+
+#define WIFI_SCAN_STATE_TAG "nma-wifi-scan-state"
+
+typedef struct {
+	gint64 next_msec;
+	gint64 last_request_msec;
+	guint interval;
+	guint ap_fingerprint;
+	char *active_ap;
+	gboolean active_ap_weak;
+	gboolean in_flight;
+	gint64 scan_started;
+} WifiScanState;
+
+static void
+wifi_scan_state_free (gpointer data)
+{
+	WifiScanState *state = data;
+
+	g_free (state->active_ap);
+	g_slice_free (WifiScanState, state);
+}
+
+static WifiScanState *
+wifi_scan_state_get (NMDeviceWifi *device)
+{
+	WifiScanState *state;
+
+	state = g_object_get_data (G_OBJECT (device), WIFI_SCAN_STATE_TAG);
+	if (!state) {
+		state = g_slice_new0 (WifiScanState);
+		state->interval = WIFI_SCAN_INTERVAL_MIN;
+		g_object_set_data_full (G_OBJECT (device), WIFI_SCAN_STATE_TAG,
+		                        state, wifi_scan_state_free);
+	}
+	return state;
+}
+
+static guint
+wifi_ap_fingerprint (NMDeviceWifi *device)
+{
+	const GPtrArray *aps;
+	guint i, fingerprint;
+
+	aps = nm_device_wifi_get_access_points (device);
+	if (!aps)
+		return 0;
+
+	/* Order-independent, so that only a change in the set counts */
+	fingerprint = aps->len;
+	for (i = 0; i < aps->len; i++)
+		fingerprint += g_str_hash (nm_object_get_path (aps->pdata[i]));
+	return fingerprint;
+}
+
+static void
+wifi_scan_done_cb (GObject *object, GAsyncResult *result, gpointer user_data)
+{
+	NMDeviceWifi *device = NM_DEVICE_WIFI (object);
+	WifiScanState *state = wifi_scan_state_get (device);
+	GError *error = NULL;
+
+	state->in_flight = FALSE;
+	nma_trace_end (NMA_TRACE_WIFI_SCAN, state->scan_started);
+	state->scan_started = 0;
 
-	g_debug ("requesting wifi scan");
+	if (!nm_device_wifi_request_scan_finish (device, result, &error)) {
+		g_debug ("wifi scan on %s failed: %s",
+		         nm_device_get_iface (NM_DEVICE (device)), error->message);
+		g_error_free (error);
+	}
+}
+
+static void
+wifi_scan_device (NMApplet *applet, NMDeviceWifi *device, gint64 now, gboolean menu_shown)
+{
+	WifiScanState *state = wifi_scan_state_get (device);
+	NMAWifiScanStats *stats = &applet->wifi_scan_stats;
+	NMAccessPoint *active_ap;
+	const char *active_path = NULL;
+	gboolean roaming = FALSE;
+	gboolean weak = FALSE;
+	gint64 last_scan;
+	guint fingerprint;
+
+	active_ap = nm_device_wifi_get_active_access_point (device);
+	if (active_ap) {
+		active_path = nm_object_get_path (NM_OBJECT (active_ap));
+		weak = nm_access_point_get_strength (active_ap) < WIFI_SCAN_WEAK_STRENGTH;
+	}
+	if (state->active_ap && g_strcmp0 (state->active_ap, active_path))
+		roaming = TRUE;
+	else if (weak && !state->active_ap_weak)
+		roaming = TRUE;
+	g_free (state->active_ap);
+	state->active_ap = g_strdup (active_path);
+	state->active_ap_weak = weak;
+
+	fingerprint = wifi_ap_fingerprint (device);
+	if (roaming || fingerprint != state->ap_fingerprint)
+		state->interval = WIFI_SCAN_INTERVAL_MIN;
+	state->ap_fingerprint = fingerprint;
+
+	if (roaming) {
+		/* Scan soon, but not sooner than the shortest interval allows */
+		stats->roaming++;
+		state->next_msec = MIN (state->next_msec,
+		                        state->last_request_msec + WIFI_SCAN_INTERVAL_MIN * 1000);
+	}
+
+	if (state->in_flight) {
+		stats->skipped_in_flight++;
+		return;
+	}
+
+	last_scan = nm_device_wifi_get_last_scan (device);
+	if (last_scan >= 0 && now - last_scan < WIFI_SCAN_RECENT_MSEC) {
+		stats->skipped_recent++;
+		state->next_msec = last_scan + state->interval * 1000;
+		return;
+	}
+
+	if (!menu_shown && now < state->next_msec) {
+		stats->skipped_backoff++;
+		return;
+	}
+
+	state->in_flight = TRUE;
+	state->last_request_msec = now;
+	state->next_msec = now + state->interval * 1000;
+	state->interval = MIN (state->interval * 2, WIFI_SCAN_INTERVAL_MAX);
+	stats->requested++;
+
+	state->scan_started = nma_trace_begin (NMA_TRACE_WIFI_SCAN);
+	nm_device_wifi_request_scan_async (device, NULL, wifi_scan_done_cb, NULL);
+}
+
+static void
+applet_schedule_wifi_scans (NMApplet *applet, gboolean menu_shown)
+{
+	const GPtrArray *devices;
+	gint64 now;
+	guint i;
 
-	/* Request scan for all wifi devices */
 	devices = nm_client_get_devices (applet->nm_client);
-	for (i = 0; devices && i < devices->len; i++) {
-		device = g_ptr_array_index (devices, i);
+	if (!devices)
+		return;
+
+	now = nm_utils_get_timestamp_msec ();
+	for (i = 0; i < devices->len; i++) {
+		NMDevice *device = g_ptr_array_index (devices, i);
+
 		if (NM_IS_DEVICE_WIFI (device))
-			nm_device_wifi_request_scan ((NMDeviceWifi *) device, NULL, NULL);
+			wifi_scan_device (applet, NM_DEVICE_WIFI (device), now, menu_shown);
 	}
 
+	g_debug ("wifi scans: %u requested, skipped %u recent, %u backoff, %u in flight; %u roaming",
+	         applet->wifi_scan_stats.requested,
+	         applet->wifi_scan_stats.skipped_recent,
+	         applet->wifi_scan_stats.skipped_backoff,
+	         applet->wifi_scan_stats.skipped_in_flight,
+	         applet->wifi_scan_stats.roaming);
+}
+
+static gboolean
+applet_wifi_scan_tick (gpointer user_data)
+{
+	applet_schedule_wifi_scans (NM_APPLET (user_data), FALSE);
 	return G_SOURCE_CONTINUE;
 }
 
@@ -70,10 +255,10 @@ static void
 applet_start_wifi_scan (NMApplet *applet, gpointer unused)
 {
 	nm_clear_g_source (&applet->wifi_scan_id);
-	applet->wifi_scan_id = g_timeout_add_seconds (15,
-	                                              (GSourceFunc) applet_request_wifi_scan,
+	applet->wifi_scan_id = g_timeout_add_seconds (WIFI_SCAN_TICK,
+	                                              applet_wifi_scan_tick,
 	                                              applet);
-	applet_request_wifi_scan (applet);
+	applet_schedule_wifi_scans (applet, TRUE);
 }
 
 static void
@@ -289,50 +474,96 @@ applet_get_all_connections (NMApplet *applet)
 	return connections;
 }
 
-static NMActiveConnection *
-applet_get_active_for_connection (NMApplet *applet, NMConnection *connection)
+/*
+ * applet_active_index_ensure
+ *
+ * The lookups below are done for every device and menu item on each
+ * menu and icon update, so rather than walking the active connections
+ * each time, index them by connection path and by device.  The index is
+ * rebuilt when the active connections, their devices, connection or
+ * state, or device states change.  Like the walks it replaces, it keeps
+ * the first match.
+ */
+static void
+applet_active_index_ensure (NMApplet *applet)
 {
 	const GPtrArray *active_list;
-	int i;
-	const char *cpath;
-
-	cpath = nm_connection_get_path (connection);
-	g_return_val_if_fail (cpath != NULL, NULL);
+	guint i, j;
 
 	active_list = nm_client_get_active_connections (applet->nm_client);
+	if (   !applet->active_index_dirty
+	    && applet->active_index_list == active_list
+	    && applet->active_index_len == (active_list ? active_list->len : 0))
+		return;
+
+	g_hash_table_remove_all (applet->active_by_path);
+	g_hash_table_remove_all (applet->active_by_device);
+	g_hash_table_remove_all (applet->any_active_by_device);
+
 	for (i = 0; active_list && (i < active_list->len); i++) {
 		NMActiveConnection *active = NM_ACTIVE_CONNECTION (g_ptr_array_index (active_list, i));
 		NMRemoteConnection *conn = nm_active_connection_get_connection (active);
+		const GPtrArray *devices = nm_active_connection_get_devices (active);
+		gboolean is_vpn = nm_active_connection_get_vpn (active);
+		const char *cpath;
 
-		if (conn) {
-			const char *active_cpath = nm_connection_get_path (NM_CONNECTION (conn));
+		if (!conn)
+			continue;
+
+		cpath = nm_connection_get_path (NM_CONNECTION (conn));
+		if (cpath && !g_hash_table_contains (applet->active_by_path, cpath)) {
+			g_hash_table_insert (applet->active_by_path,
+			                     g_strdup (cpath),
+			                     g_object_ref (active));
+		}
+
+		for (j = 0; devices && (j < devices->len); j++) {
+			NMDevice *device = g_ptr_array_index (devices, j);
 
-			if (active_cpath && !strcmp (active_cpath, cpath))
-				return active;
+			if (!g_hash_table_contains (applet->any_active_by_device, device)) {
+				g_hash_table_insert (applet->any_active_by_device,
+				                     g_object_ref (device),
+				                     g_object_ref (active));
+			}
+			if (!is_vpn && !g_hash_table_contains (applet->active_by_device, device)) {
+				g_hash_table_insert (applet->active_by_device,
+				                     g_object_ref (device),
+				                     g_object_ref (active));
+			}
 		}
 	}
-	return NULL;
+
+	applet->active_index_dirty = FALSE;
+	applet->active_index_list = active_list;
+	applet->active_index_len = active_list ? active_list->len : 0;
 }
 
-NMDevice *
-applet_get_device_for_connection (NMApplet *applet, NMConnection *connection)
+static NMActiveConnection *
+applet_get_active_for_connection (NMApplet *applet, NMConnection *connection)
 {
-	const GPtrArray *active_list;
 	const char *cpath;
-	int i;
 
 	cpath = nm_connection_get_path (connection);
 	g_return_val_if_fail (cpath != NULL, NULL);
 
-	active_list = nm_client_get_active_connections (applet->nm_client);
-	for (i = 0; active_list && (i < active_list->len); i++) {
-		NMActiveConnection *active = NM_ACTIVE_CONNECTION (g_ptr_array_index (active_list, i));
-		NMRemoteConnection *ac_conn = nm_active_connection_get_connection (active);
+	applet_active_index_ensure (applet);
+	return g_hash_table_lookup (applet->active_by_path, cpath);
+}
 
-		if (!g_strcmp0 (nm_connection_get_path (NM_CONNECTION (ac_conn)), cpath))
-			return g_ptr_array_index (nm_active_connection_get_devices (active), 0);
-	}
-	return NULL;
+NMDevice *
+applet_get_device_for_connection (NMApplet *applet, NMConnection *connection)
+{
+	NMActiveConnection *active;
+	const GPtrArray *devices;
+
+	active = applet_get_active_for_connection (applet, connection);
+	if (!active)
+		return NULL;
+
+	devices = nm_active_connection_get_devices (active);
+	if (!devices || !devices->len)
+		return NULL;
+	return g_ptr_array_index (devices, 0);
 }
 
 typedef struct {
@@ -515,6 +746,220 @@ applet_menu_item_activate_helper (NMDevice *device,
 		applet_item_activate_info_destroy (info);
 }
 
+/* Menu items are matched up across menu updates by their section (the
+ * device they belong to) and a key unique within that section.  Items
+ * that don't set a key are matched by their type and label.
+ */
+#define MENU_ITEM_KEY_TAG     "nma-menu-item-key"
+#define MENU_ITEM_SECTION_TAG "nma-menu-item-section"
+#define MENU_ITEM_FIXED_TAG   "nma-menu-item-fixed"
+#define MENU_ITEM_STATIC_TAG  "nma-menu-item-static"
+#define MENU_ITEM_PLACEHOLDER_TAG "nma-menu-item-placeholder"
+#define MENU_LAZY_TAG         "nma-menu-lazy"
+#define MENU_ITEM_TITLE_TAG   "nma-menu-item-title"
+
+void
+applet_menu_item_set_key (GtkWidget *item, const char *kind, const char *id)
+{
+	g_return_if_fail (GTK_IS_MENU_ITEM (item));
+	g_return_if_fail (kind != NULL);
+
+	g_object_set_data_full (G_OBJECT (item), MENU_ITEM_KEY_TAG,
+	                        g_strdup_printf ("%s/%s", kind, id ? id : ""),
+	                        g_free);
+}
+
+typedef struct {
+	AppletMenuPopulateFunc populate;
+	gpointer user_data;
+	GDestroyNotify destroy;
+} MenuLazyInfo;
+
+static void
+menu_lazy_info_free (gpointer data)
+{
+	MenuLazyInfo *info = data;
+
+	if (info->destroy)
+		info->destroy (info->user_data);
+	g_slice_free (MenuLazyInfo, info);
+}
+
+/*
+ * applet_menu_set_lazy
+ *
+ * Defer filling @submenu until it is first shown (or until
+ * applet_menu_ensure_populated() is called on it); @populate then gets
+ * called once with @user_data, which is freed with @destroy afterwards or
+ * when @submenu goes away.
+ */
+void
+applet_menu_set_lazy (GtkWidget *submenu,
+                      AppletMenuPopulateFunc populate,
+                      gpointer user_data,
+                      GDestroyNotify destroy)
+{
+	MenuLazyInfo *info;
+
+	g_return_if_fail (GTK_IS_MENU (submenu));
+	g_return_if_fail (populate != NULL);
+
+	info = g_slice_new (MenuLazyInfo);
+	info->populate = populate;
+	info->user_data = user_data;
+	info->destroy = destroy;
+	g_object_set_data_full (G_OBJECT (submenu), MENU_LAZY_TAG, info, menu_lazy_info_free);
+
+	if (!g_signal_handler_find (submenu, G_SIGNAL_MATCH_FUNC, 0, 0, NULL,
+	                            (gpointer) applet_menu_ensure_populated, NULL))
+		g_signal_connect (submenu, "show", G_CALLBACK (applet_menu_ensure_populated), NULL);
+}
+
+void
+applet_menu_ensure_populated (GtkWidget *submenu)
+{
+	MenuLazyInfo *info;
+
+	info = g_object_steal_data (G_OBJECT (submenu), MENU_LAZY_TAG);
+	if (!info)
+		return;
+
+	info->populate (submenu, info->user_data);
+	menu_lazy_info_free (info);
+}
+
+/* Items of a closed or throwaway menu that are expensive to build (the
+ * network items with their boxes, labels and images, and the device
+ * titles) are parked in a pool instead of being destroyed, and handed
+ * out again by applet_menu_item_pool_take() for the next menu.
+ */
+#define MENU_ITEM_POOL_MAX 64
+
+static gboolean
+menu_item_is_poolable (GtkWidget *item)
+{
+	if (g_object_get_data (G_OBJECT (item), MENU_ITEM_STATIC_TAG))
+		return FALSE;
+
+	return    NM_IS_NETWORK_MENU_ITEM (item)
+	       || NM_IS_MB_MENU_ITEM (item)
+	       || g_object_get_data (G_OBJECT (item), MENU_ITEM_TITLE_TAG);
+}
+
+/* Drops what the previous menu attached to @item */
+static void
+menu_item_unbind (GtkWidget *item)
+{
+	static const char *tags[] = {
+		MENU_ITEM_KEY_TAG,
+		MENU_ITEM_SECTION_TAG,
+		MENU_ITEM_FIXED_TAG,
+		MENU_ITEM_PLACEHOLDER_TAG,
+		MENU_ITEM_TITLE_TAG,
+		"device",
+	};
+	guint i;
+
+	/* Frees the activation info along with the closures */
+	g_signal_handlers_disconnect_matched (item, G_SIGNAL_MATCH_ID,
+	                                      g_signal_lookup ("activate", GTK_TYPE_MENU_ITEM),
+	                                      0, NULL, NULL, NULL);
+	gtk_menu_item_set_submenu (GTK_MENU_ITEM (item), NULL);
+	for (i = 0; i < G_N_ELEMENTS (tags); i++)
+		g_object_set_data (G_OBJECT (item), tags[i], NULL);
+
+	gtk_widget_set_sensitive (item, TRUE);
+	gtk_widget_hide (item);
+}
+
+/*
+ * applet_menu_recycle
+ *
+ * Moves the poolable items of @menu and its submenus into the pool, as
+ * long as there's room; @menu is about to be destroyed.
+ */
+void
+applet_menu_recycle (NMApplet *applet, GtkWidget *menu)
+{
+	GList *children, *iter;
+
+	children = gtk_container_get_children (GTK_CONTAINER (menu));
+	for (iter = children; iter; iter = g_list_next (iter)) {
+		GtkWidget *item = iter->data;
+		GtkWidget *submenu;
+
+		submenu = gtk_menu_item_get_submenu (GTK_MENU_ITEM (item));
+		if (submenu)
+			applet_menu_recycle (applet, submenu);
+
+		if (   applet->menu_item_pool->len >= MENU_ITEM_POOL_MAX
+		    || !menu_item_is_poolable (item))
+			continue;
+
+		g_object_ref (item);
+		gtk_container_remove (GTK_CONTAINER (menu), item);
+		menu_item_unbind (item);
+		g_ptr_array_add (applet->menu_item_pool, item);
+	}
+	g_list_free (children);
+}
+
+/*
+ * applet_menu_item_pool_take
+ *
+ * Returns a pooled item of exactly @type, unbound and floating like a
+ * new widget, or %NULL if there is none and the caller has to create one.
+ */
+GtkWidget *
+applet_menu_item_pool_take (NMApplet *applet, GType type)
+{
+	GPtrArray *pool = applet->menu_item_pool;
+	GtkWidget *item;
+	guint i;
+
+	for (i = pool->len; i > 0; i--) {
+		item = pool->pdata[i - 1];
+		if (G_OBJECT_TYPE (item) == type) {
+			g_ptr_array_remove_index_fast (pool, i - 1);
+			g_object_force_floating (G_OBJECT (item));
+			nma_trace_count (NMA_TRACE_MENU_ITEM_REUSED);
+			return item;
+		}
+	}
+
+	nma_trace_count (NMA_TRACE_MENU_ITEM_CREATED);
+	return NULL;
+}
+
+static gboolean
+menu_is_lazy (GtkWidget *menu)
+{
+	return g_object_get_data (G_OBJECT (menu), MENU_LAZY_TAG) != NULL;
+}
+
+static guint
+menu_get_n_items (GtkWidget *menu)
+{
+	GList *children;
+	guint n;
+
+	children = gtk_container_get_children (GTK_CONTAINER (menu));
+	n = g_list_length (children);
+	g_list_free (children);
+	return n;
+}
+
+static void
+menu_mark_items (GtkWidget *menu, guint first, const char *tag, const char *value)
+{
+	GList *children, *iter;
+
+	children = gtk_container_get_children (GTK_CONTAINER (menu));
+	for (iter = g_list_nth (children, first); iter; iter = g_list_next (iter))
+		g_object_set_data_full (G_OBJECT (iter->data), tag, g_strdup (value), g_free);
+	g_list_free (children);
+}
+
 void
 applet_menu_item_add_complex_separator_helper (GtkWidget *menu,
                                                NMApplet *applet,
@@ -550,6 +995,10 @@ applet_menu_item_add_complex_separator_helper (GtkWidget *menu,
 		          "sensitive", FALSE,
 		          NULL);
 
+	/* The item shows nothing but its label */
+	applet_menu_item_set_key (menu_item, "separator", label);
+	g_object_set_data (G_OBJECT (menu_item), MENU_ITEM_FIXED_TAG, GINT_TO_POINTER (TRUE));
+
 	gtk_menu_shell_append (GTK_MENU_SHELL (menu), menu_item);
 }
 
@@ -647,10 +1096,16 @@ applet_menu_item_create_device_item_helper (NMDevice *device,
 {
 	GtkWidget *item;
 
-	item = gtk_menu_item_new_with_label (text);
+	item = applet_menu_item_pool_take (applet, GTK_TYPE_MENU_ITEM);
+	if (item)
+		gtk_menu_item_set_label (GTK_MENU_ITEM (item), text);
+	else {
+		item = gtk_menu_item_new_with_label (text);
+		if (!INDICATOR_ENABLED (applet))
+			g_signal_connect (item, "draw", G_CALLBACK (menu_title_item_draw), NULL);
+	}
+	g_object_set_data (G_OBJECT (item), MENU_ITEM_TITLE_TAG, "title");
 	gtk_widget_set_sensitive (item, FALSE);
-	if (!INDICATOR_ENABLED (applet))
-		g_signal_connect (item, "draw", G_CALLBACK (menu_title_item_draw), NULL);
 	return item;
 }
 
@@ -665,27 +1120,92 @@ applet_clear_notify (NMApplet *applet)
 	applet->notification = NULL;
 }
 
-static gboolean
-applet_notify_server_has_actions (void)
+/* The notification server's capabilities are fetched asynchronously
+ * whenever a server takes the bus name, so that showing a notification
+ * never waits for a D-Bus round trip.  The name is watched with
+ * auto-start, so that a D-Bus activated server that isn't running yet is
+ * started and asked, like the synchronous query used to.  Until the
+ * answer is in, no actions are added.
+ */
+#define NOTIFY_DBUS_NAME      "org.freedesktop.Notifications"
+#define NOTIFY_DBUS_PATH      "/org/freedesktop/Notifications"
+
+static void
+notify_caps_cb (GObject *source, GAsyncResult *result, gpointer user_data)
 {
-	static gboolean has_actions = FALSE;
-	static gboolean initialized = FALSE;
-	GList *server_caps, *iter;
+	NMApplet *applet;
+	gs_unref_variant GVariant *ret = NULL;
+	gs_free const char **caps = NULL;
+	GError *error = NULL;
+	guint i;
+
+	ret = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source), result, &error);
+	if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+		g_error_free (error);
+		return;
+	}
+
+	applet = NM_APPLET (user_data);
+	g_clear_object (&applet->notify_caps_cancellable);
 
-	if (initialized)
-		return has_actions;
-	initialized = TRUE;
+	if (!ret) {
+		g_debug ("failed to get notification server capabilities: %s", error->message);
+		g_error_free (error);
+		return;
+	}
 
-	server_caps = notify_get_server_caps();
-	for (iter = server_caps; iter; iter = g_list_next (iter)) {
-		if (!strcmp ((const char *) iter->data, NOTIFY_CAPS_ACTIONS_KEY)) {
-			has_actions = TRUE;
+	g_variant_get (ret, "(^a&s)", &caps);
+	applet->notify_has_actions = FALSE;
+	for (i = 0; caps[i]; i++) {
+		if (!strcmp (caps[i], NOTIFY_CAPS_ACTIONS_KEY)) {
+			applet->notify_has_actions = TRUE;
 			break;
 		}
 	}
-	g_list_free_full (server_caps, g_free);
+}
+
+static void
+notify_server_appeared_cb (GDBusConnection *connection,
+                           const char *name,
+                           const char *name_owner,
+                           gpointer user_data)
+{
+	NMApplet *applet = NM_APPLET (user_data);
+
+	/* A new server may well do things differently */
+	applet->notify_has_actions = FALSE;
+	nm_clear_g_cancellable (&applet->notify_caps_cancellable);
+	applet->notify_caps_cancellable = g_cancellable_new ();
+
+	g_dbus_connection_call (connection,
+	                        name_owner,
+	                        NOTIFY_DBUS_PATH,
+	                        NOTIFY_DBUS_NAME,
+	                        "GetCapabilities",
+	                        NULL,
+	                        G_VARIANT_TYPE ("(as)"),
+	                        G_DBUS_CALL_FLAGS_NONE,
+	                        -1,
+	                        applet->notify_caps_cancellable,
+	                        notify_caps_cb,
+	                        applet);
+}
+
+static void
+notify_server_vanished_cb (GDBusConnection *connection,
+                           const char *name,
+                           gpointer user_data)
+{
+	NMApplet *applet = NM_APPLET (user_data);
 
-	return has_actions;
+	applet->notify_has_actions = FALSE;
+	nm_clear_g_cancellable (&applet->notify_caps_cancellable);
+}
+
+static gboolean
+applet_notify_server_has_actions (NMApplet *applet)
+{
+	return applet->notify_has_actions;
 }
 
 void
@@ -744,7 +1264,7 @@ applet_do_notify (NMApplet *applet,
 	notify_notification_set_urgency (notify, urgency);
 	notify_notification_set_timeout (notify, NOTIFY_EXPIRES_DEFAULT);
 
-	if (applet_notify_server_has_actions () && action1) {
+	if (applet_notify_server_has_actions (applet) && action1) {
 		notify_notification_clear_actions (notify);
 		notify_notification_add_action (notify, action1, action1_label,
 		                                action1_cb, action1_user_data, NULL);
@@ -790,29 +1310,79 @@ void applet_do_notify_with_pref (NMApplet *applet,
 	                  applet);
 }
 
-static gboolean
-animation_timeout (gpointer data)
+static void
+animation_frames_clear (NMApplet *applet)
 {
-	applet_schedule_update_icon (NM_APPLET (data));
-	return TRUE;
+	g_clear_pointer (&applet->animation_frames, g_ptr_array_unref);
+	g_clear_pointer (&applet->animation_key, g_free);
 }
 
-static void
-start_animation_timeout (NMApplet *applet)
+static gboolean
+status_icon_shown (NMApplet *applet)
 {
-	if (applet->animation_id == 0) {
-		applet->animation_step = 0;
-		applet->animation_id = g_timeout_add (100, animation_timeout, applet);
-	}
+	return    gtk_status_icon_get_visible (applet->status_icon)
+	       && gtk_status_icon_is_embedded (applet->status_icon);
 }
 
-static void
-clear_animation_timeout (NMApplet *applet)
+static gboolean
+animation_timeout (gpointer data)
 {
-	if (applet->animation_id) {
-		g_source_remove (applet->animation_id);
+	NMApplet *applet = NM_APPLET (data);
+
+	if (applet->status_icon && !status_icon_shown (applet)) {
+		/* Nobody can see the icon; resumed from applet_embedded_cb() */
 		applet->animation_id = 0;
-		applet->animation_step = 0;
+		applet->animation_paused = TRUE;
+		return G_SOURCE_REMOVE;
+	}
+
+	/* Unless something else changed, just flip to the next pre-rendered
+	 * frame instead of recomputing the whole icon and tooltip.
+	 */
+	if (   applet->animation_frames
+	    && !(applet->update_flags & (APPLET_UPDATE_LINK | APPLET_UPDATE_VPN))) {
+		GdkPixbuf *frame;
+		guint32 layer;
+
+		if ((guint) applet->animation_step >= applet->animation_frames->len)
+			applet->animation_step = 0;
+		frame = applet->animation_frames->pdata[applet->animation_step];
+		gtk_status_icon_set_from_pixbuf (applet->status_icon, frame);
+		applet->animation_step = (applet->animation_step + 1) % applet->animation_frames->len;
+
+		/* The animated layer no longer matches what is displayed; make
+		 * the next update set it again.
+		 */
+		layer = applet->animation_vpn ? ICON_LAYER_VPN : ICON_LAYER_LINK;
+		g_clear_object (&applet->icon_layers[layer]);
+		g_clear_pointer (&applet->icon_layer_names[layer], g_free);
+		return G_SOURCE_CONTINUE;
+	}
+
+	applet_schedule_update_icon (applet);
+	return G_SOURCE_CONTINUE;
+}
+
+static void
+start_animation_timeout (NMApplet *applet)
+{
+	if (applet->animation_id == 0) {
+		if (!applet->animation_paused)
+			applet->animation_step = 0;
+		applet->animation_paused = FALSE;
+		applet->animation_id = g_timeout_add (100, animation_timeout, applet);
+	}
+}
+
+static void
+clear_animation_timeout (NMApplet *applet)
+{
+	applet->animation_paused = FALSE;
+	animation_frames_clear (applet);
+	if (applet->animation_id) {
+		g_source_remove (applet->animation_id);
+		applet->animation_id = 0;
+		applet->animation_step = 0;
 	}
 }
 
@@ -950,8 +1520,7 @@ vpn_active_connection_state_changed (NMVpnConnection *vpn,
 	else
 		clear_animation_timeout (applet);
 
-	applet_schedule_update_icon (applet);
-	applet_schedule_update_menu (applet);
+	applet_schedule_update (applet, APPLET_UPDATE_VPN | APPLET_UPDATE_TOOLTIP | APPLET_UPDATE_MENU);
 }
 
 typedef struct {
@@ -994,8 +1563,7 @@ activate_vpn_cb (GObject *client,
 		g_error_free (error);
 	}
 
-	applet_schedule_update_icon (info->applet);
-	applet_schedule_update_menu (info->applet);
+	applet_schedule_update (info->applet, APPLET_UPDATE_VPN | APPLET_UPDATE_TOOLTIP | APPLET_UPDATE_MENU);
 	g_free (info->vpn_name);
 	g_free (info);
 }
@@ -1168,57 +1736,27 @@ sort_devices_by_description (gconstpointer a, gconstpointer b)
 	return g_strcmp0 (aa_desc, bb_desc);
 }
 
-static gboolean
-nm_g_ptr_array_contains (const GPtrArray *haystack, gpointer needle)
-{
-	int i;
-
-	for (i = 0; haystack && (i < haystack->len); i++) {
-		if (g_ptr_array_index (haystack, i) == needle)
-			return TRUE;
-	}
-	return FALSE;
-}
-
 static NMConnection *
 applet_find_active_connection_for_device (NMDevice *device,
                                           NMApplet *applet,
                                           NMActiveConnection **out_active)
 {
-	const GPtrArray *active_connections;
-	int i;
+	NMActiveConnection *active;
 
 	g_return_val_if_fail (NM_IS_DEVICE (device), NULL);
 	g_return_val_if_fail (NM_IS_APPLET (applet), NULL);
 	if (out_active)
 		g_return_val_if_fail (*out_active == NULL, NULL);
 
-	active_connections = nm_client_get_active_connections (applet->nm_client);
-	for (i = 0; i < active_connections->len; i++) {
-		NMRemoteConnection *conn;
-		NMActiveConnection *active;
-		const GPtrArray *devices;
-
-		active = NM_ACTIVE_CONNECTION (g_ptr_array_index (active_connections, i));
-		devices = nm_active_connection_get_devices (active);
-		conn = nm_active_connection_get_connection (active);
-
-		/* Skip VPN connections */
-		if (nm_active_connection_get_vpn (active))
-			continue;
-
-		if (!devices || !conn)
-			continue;
-
-		if (!nm_g_ptr_array_contains (devices, device))
-			continue;
-
-		if (out_active)
-			*out_active = active;
-		return NM_CONNECTION (conn);
-	}
+	/* VPN connections are not in this index */
+	applet_active_index_ensure (applet);
+	active = g_hash_table_lookup (applet->active_by_device, device);
+	if (!active)
+		return NULL;
 
-	return NULL;
+	if (out_active)
+		*out_active = active;
+	return NM_CONNECTION (nm_active_connection_get_connection (active));
 }
 
 gboolean
@@ -1329,6 +1867,7 @@ add_device_items (NMDeviceType type, const GPtrArray *all_devices,
 {
 	GSList *devices = NULL, *iter;
 	int i, n_devices = 0;
+	guint n_items;
 
 	for (i = 0; all_devices && (i < all_devices->len); i++) {
 		NMDevice *device = all_devices->pdata[i];
@@ -1345,27 +1884,45 @@ add_device_items (NMDeviceType type, const GPtrArray *all_devices,
 		NMADeviceClass *dclass;
 		NMConnection *active;
 		GPtrArray *connections;
+		GtkWidget *item;
 
 		dclass = get_device_class (device, applet);
 		if (!dclass)
 			continue;
 
+		if (   applet->menu_sections_filter
+		    && !g_hash_table_contains (applet->menu_sections_filter,
+		                               nm_object_get_path (NM_OBJECT (device)))) {
+			/* Unchanged; applet_menu_reconcile() keeps the shown items */
+			item = gtk_separator_menu_item_new ();
+			g_object_set_data (G_OBJECT (item), MENU_ITEM_PLACEHOLDER_TAG, "placeholder");
+			g_object_set_data_full (G_OBJECT (item), MENU_ITEM_SECTION_TAG,
+			                        g_strdup (nm_object_get_path (NM_OBJECT (device))), g_free);
+			gtk_menu_shell_append (GTK_MENU_SHELL (menu), item);
+			continue;
+		}
+
 		connections = nm_device_filter_connections (device, all_connections);
 		active = applet_find_active_connection_for_device (device, applet, NULL);
 
+		n_items = menu_get_n_items (menu);
 		dclass->add_menu_item (device, n_devices > 1, connections, active, menu, applet);
 
 		g_ptr_array_unref (connections);
 
 		if (INDICATOR_ENABLED (applet))
 			gtk_menu_shell_append (GTK_MENU_SHELL (menu), gtk_separator_menu_item_new ());
+
+		/* Everything the device class added belongs to the device's section */
+		menu_mark_items (menu, n_items, MENU_ITEM_SECTION_TAG,
+		                 nm_object_get_path (NM_OBJECT (device)));
 	}
 
 	g_slist_free (devices);
 	return n_devices;
 }
 
-static void
+void
 nma_menu_add_devices (GtkWidget *menu, NMApplet *applet)
 {
 	const GPtrArray *all_devices;
@@ -1430,7 +1987,7 @@ get_vpn_connections (NMApplet *applet)
 	return vpn_connections;
 }
 
-static void
+void
 nma_menu_add_vpn_submenu (GtkWidget *menu, NMApplet *applet)
 {
 	GtkMenu *vpn_menu;
@@ -1475,6 +2032,7 @@ nma_menu_add_vpn_submenu (GtkWidget *menu, NMApplet *applet)
 		g_object_set_data_full (G_OBJECT (item), "connection",
 		                        g_object_ref (connection),
 		                        (GDestroyNotify) g_object_unref);
+		applet_menu_item_set_key (GTK_WIDGET (item), "vpn", nm_connection_get_path (connection));
 
 		g_signal_connect (item, "activate", G_CALLBACK (nma_menu_vpn_item_clicked), applet);
 		gtk_menu_shell_append (GTK_MENU_SHELL (vpn_menu), GTK_WIDGET (item));
@@ -1584,7 +2142,7 @@ has_usable_wifi (NMApplet *applet)
  * Pop up the wifi networks menu
  *
  */
-static void nma_menu_show_cb (GtkWidget *menu, NMApplet *applet)
+void nma_menu_show_cb (GtkWidget *menu, NMApplet *applet)
 {
 	g_return_if_fail (menu != NULL);
 	g_return_if_fail (applet != NULL);
@@ -1617,9 +2175,17 @@ static void nma_menu_show_cb (GtkWidget *menu, NMApplet *applet)
 }
 
 static gboolean
-destroy_old_menu (gpointer user_data)
+destroy_old_menus (gpointer user_data)
 {
-	g_object_unref (user_data);
+	NMApplet *applet = NM_APPLET (user_data);
+	GSList *iter;
+
+	applet->old_menus_id = 0;
+	for (iter = applet->old_menus; iter; iter = g_slist_next (iter)) {
+		applet_menu_recycle (applet, iter->data);
+		g_object_unref (iter->data);
+	}
+	g_clear_pointer (&applet->old_menus, g_slist_free);
 	return FALSE;
 }
 
@@ -1631,7 +2197,9 @@ nma_menu_deactivate_cb (GtkWidget *widget, NMApplet *applet)
 	 * fires for an item.
 	 */
 	g_signal_handlers_disconnect_by_func (applet->menu, G_CALLBACK (nma_menu_deactivate_cb), applet);
-	g_idle_add_full (G_PRIORITY_LOW, destroy_old_menu, applet->menu, NULL);
+	applet->old_menus = g_slist_prepend (applet->old_menus, applet->menu);
+	if (!applet->old_menus_id)
+		applet->old_menus_id = g_idle_add_full (G_PRIORITY_LOW, destroy_old_menus, applet, NULL);
 	applet->menu = NULL;
 
 	applet_stop_wifi_scan (applet, NULL);
@@ -1936,6 +2504,7 @@ applet_add_connection_items (NMDevice *device,
 		item = applet_new_menu_item_helper (connection, active, (flag & NMA_ADD_ACTIVE));
 		gtk_widget_set_sensitive (item, sensitive);
 		gtk_widget_show_all (item);
+		applet_menu_item_set_key (item, "connection", nm_connection_get_path (connection));
 
 		info = g_slice_new0 (AppletMenuItemInfo);
 		info->applet = applet;
@@ -1977,12 +2546,204 @@ applet_add_default_connection_item (NMDevice *device,
 	gtk_menu_shell_append (GTK_MENU_SHELL (menu), item);
 }
 
+static const char *
+menu_item_get_label (GtkWidget *item)
+{
+	GtkWidget *child = gtk_bin_get_child (GTK_BIN (item));
+
+	return GTK_IS_LABEL (child) ? gtk_label_get_label (GTK_LABEL (child)) : NULL;
+}
+
+static char *
+menu_item_get_key (GtkWidget *item, GHashTable *seen)
+{
+	const char *section, *key;
+	char *base, *full;
+	guint n;
+
+	section = g_object_get_data (G_OBJECT (item), MENU_ITEM_SECTION_TAG);
+	key = g_object_get_data (G_OBJECT (item), MENU_ITEM_KEY_TAG);
+	if (key)
+		base = g_strdup_printf ("%s|%s", section ? section : "", key);
+	else {
+		base = g_strdup_printf ("%s|%s|%s",
+		                        section ? section : "",
+		                        G_OBJECT_TYPE_NAME (item),
+		                        menu_item_get_label (item));
+	}
+
+	/* Repeated items (eg, separators) are told apart by their order */
+	n = GPOINTER_TO_UINT (g_hash_table_lookup (seen, base));
+	full = g_strdup_printf ("%s|%u", base, n);
+	g_hash_table_insert (seen, base, GUINT_TO_POINTER (n + 1));
+
+	return full;
+}
+
 static gboolean
-applet_update_menu (gpointer user_data)
+menu_item_equal (GtkWidget *a, GtkWidget *b)
 {
-	NMApplet *applet = NM_APPLET (user_data);
+	GtkWidget *a_child, *b_child;
+
+	if (G_OBJECT_TYPE (a) != G_OBJECT_TYPE (b))
+		return FALSE;
+
+	if (   gtk_widget_get_sensitive (a) != gtk_widget_get_sensitive (b)
+	    || gtk_widget_get_visible (a) != gtk_widget_get_visible (b))
+		return FALSE;
+
+	if (   !gtk_menu_item_get_submenu (GTK_MENU_ITEM (a))
+	    != !gtk_menu_item_get_submenu (GTK_MENU_ITEM (b)))
+		return FALSE;
+
+	if (GTK_IS_CHECK_MENU_ITEM (a)) {
+		GtkCheckMenuItem *a_check = GTK_CHECK_MENU_ITEM (a);
+		GtkCheckMenuItem *b_check = GTK_CHECK_MENU_ITEM (b);
+
+		if (   gtk_check_menu_item_get_active (a_check) != gtk_check_menu_item_get_active (b_check)
+		    || gtk_check_menu_item_get_draw_as_radio (a_check) != gtk_check_menu_item_get_draw_as_radio (b_check))
+			return FALSE;
+	}
+
+	if (NM_IS_NETWORK_MENU_ITEM (a))
+		return nm_network_menu_item_equal (NM_NETWORK_MENU_ITEM (a), NM_NETWORK_MENU_ITEM (b));
+
+	if (   GTK_IS_SEPARATOR_MENU_ITEM (a)
+	    || (   g_object_get_data (G_OBJECT (a), MENU_ITEM_FIXED_TAG)
+	        && g_object_get_data (G_OBJECT (b), MENU_ITEM_FIXED_TAG)))
+		return TRUE;
+
+	a_child = gtk_bin_get_child (GTK_BIN (a));
+	b_child = gtk_bin_get_child (GTK_BIN (b));
+	if (!GTK_IS_LABEL (a_child) || !GTK_IS_LABEL (b_child)) {
+		/* Don't know how to compare custom items; always take the new one */
+		return FALSE;
+	}
+
+	return    gtk_label_get_use_markup (GTK_LABEL (a_child)) == gtk_label_get_use_markup (GTK_LABEL (b_child))
+	       && !g_strcmp0 (gtk_label_get_label (GTK_LABEL (a_child)), gtk_label_get_label (GTK_LABEL (b_child)));
+}
+
+/*
+ * applet_menu_reconcile
+ *
+ * Make @menu look like @fresh, moving over the items of @fresh that
+ * aren't already shown in @menu and dropping those of @menu that are gone
+ * or have changed.  Items that are equal in both stay where they are in
+ * @menu (modulo reordering), so an open menu doesn't flicker and keeps
+ * its selection.  Items marked static are left alone.
+ */
+void
+applet_menu_reconcile (GtkMenu *menu, GtkMenu *fresh)
+{
+	gs_unref_hashtable GHashTable *seen = NULL;
+	gs_unref_hashtable GHashTable *old_items = NULL;
+	gs_unref_ptrarray GPtrArray *old_list = NULL;
+	gs_unref_ptrarray GPtrArray *old_keys = NULL;
+	gs_unref_ptrarray GPtrArray *items = NULL;
+	GHashTableIter iter;
 	GList *children, *elt;
-	GtkMenu *menu;
+	GtkWidget *item;
+	guint i, n_kept = 0;
+
+	seen = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+	old_items = g_hash_table_new (g_str_hash, g_str_equal);
+	old_list = g_ptr_array_new ();
+	old_keys = g_ptr_array_new_with_free_func (g_free);
+
+	children = gtk_container_get_children (GTK_CONTAINER (menu));
+	for (elt = children; elt; elt = g_list_next (elt)) {
+		char *key;
+
+		item = elt->data;
+		if (g_object_get_data (G_OBJECT (item), MENU_ITEM_STATIC_TAG))
+			continue;
+
+		key = menu_item_get_key (item, seen);
+		g_hash_table_insert (old_items, key, item);
+		g_ptr_array_add (old_list, item);
+		g_ptr_array_add (old_keys, key);
+	}
+	g_list_free (children);
+
+	g_hash_table_remove_all (seen);
+
+	/* Work out which item goes where */
+	items = g_ptr_array_new ();
+	children = gtk_container_get_children (GTK_CONTAINER (fresh));
+	for (elt = children; elt; elt = g_list_next (elt)) {
+		gs_free char *key = NULL;
+		GtkWidget *old;
+
+		item = elt->data;
+
+		if (g_object_get_data (G_OBJECT (item), MENU_ITEM_PLACEHOLDER_TAG)) {
+			const char *section = g_object_get_data (G_OBJECT (item), MENU_ITEM_SECTION_TAG);
+
+			/* Keep the whole section as it is shown */
+			for (i = 0; i < old_list->len; i++) {
+				old = old_list->pdata[i];
+				if (   !g_strcmp0 (g_object_get_data (G_OBJECT (old), MENU_ITEM_SECTION_TAG), section)
+				    && g_hash_table_remove (old_items, old_keys->pdata[i])) {
+					g_ptr_array_add (items, old);
+					n_kept++;
+				}
+			}
+			continue;
+		}
+
+		key = menu_item_get_key (item, seen);
+		old = g_hash_table_lookup (old_items, key);
+		if (old && menu_item_equal (old, item)) {
+			GtkWidget *submenu = gtk_menu_item_get_submenu (GTK_MENU_ITEM (old));
+			GtkWidget *fresh_submenu = gtk_menu_item_get_submenu (GTK_MENU_ITEM (item));
+
+			if (submenu && menu_is_lazy (submenu) && menu_is_lazy (fresh_submenu)) {
+				/* Neither was filled in yet; just take over the newer contents */
+				g_object_set_data_full (G_OBJECT (submenu), MENU_LAZY_TAG,
+				                        g_object_steal_data (G_OBJECT (fresh_submenu), MENU_LAZY_TAG),
+				                        menu_lazy_info_free);
+			} else if (submenu) {
+				if (menu_is_lazy (submenu)) {
+					/* Drop what was never shown; the fresh items replace it */
+					menu_lazy_info_free (g_object_steal_data (G_OBJECT (submenu), MENU_LAZY_TAG));
+				}
+				applet_menu_ensure_populated (fresh_submenu);
+				applet_menu_reconcile (GTK_MENU (submenu), GTK_MENU (fresh_submenu));
+			}
+			g_hash_table_remove (old_items, key);
+			g_ptr_array_add (items, old);
+			n_kept++;
+		} else
+			g_ptr_array_add (items, item);
+	}
+	g_list_free (children);
+
+	/* Whatever wasn't matched is stale */
+	g_hash_table_iter_init (&iter, old_items);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &item))
+		gtk_container_remove (GTK_CONTAINER (menu), item);
+
+	for (i = 0; i < items->len; i++) {
+		item = items->pdata[i];
+
+		if (gtk_widget_get_parent (item) == GTK_WIDGET (fresh)) {
+			g_object_ref (item);
+			gtk_container_remove (GTK_CONTAINER (fresh), item);
+			gtk_menu_shell_insert (GTK_MENU_SHELL (menu), item, i);
+			g_object_unref (item);
+		} else
+			gtk_menu_reorder_child (menu, item, i);
+	}
+
+	g_debug ("menu update: %u items kept, %u replaced or added, %u removed",
+	         n_kept, items->len - n_kept, g_hash_table_size (old_items));
+}
+
+static void
+applet_update_menu (NMApplet *applet)
+{
+	GtkMenu *menu, *fresh;
 
 	if (INDICATOR_ENABLED (applet)) {
 #ifdef WITH_APPINDICATOR
@@ -1994,49 +2755,109 @@ applet_update_menu (gpointer user_data)
 			g_signal_connect_swapped (menu, "hide", G_CALLBACK (applet_stop_wifi_scan), applet);
 		}
 #else
-		g_return_val_if_reached (G_SOURCE_REMOVE);
+		g_return_if_reached ();
 #endif /* WITH_APPINDICATOR */
 	} else {
 		menu = GTK_MENU (applet->menu);
 		if (!menu) {
 			/* Menu not open */
-			goto out;
+			return;
 		}
 	}
 
-	/* Clear all entries */
-	children = gtk_container_get_children (GTK_CONTAINER (menu));
-	for (elt = children; elt; elt = g_list_next (elt))
-		gtk_container_remove (GTK_CONTAINER (menu), GTK_WIDGET (elt->data));
-	g_list_free (children);
+	/* Build the menu as it should look now and bring the shown one in
+	 * line with it, so that unchanged items stay put.
+	 */
+	fresh = GTK_MENU (gtk_menu_new ());
+	g_object_ref_sink (fresh);
+	nma_menu_show_cb (GTK_WIDGET (fresh), applet);
+	applet_menu_reconcile (menu, fresh);
+	applet_menu_recycle (applet, GTK_WIDGET (fresh));
+	gtk_widget_destroy (GTK_WIDGET (fresh));
+	g_object_unref (fresh);
 
-	/* Update the menu */
 	if (INDICATOR_ENABLED (applet)) {
-		nma_menu_show_cb (GTK_WIDGET (menu), applet);
-		nma_menu_add_separator_item (GTK_WIDGET (menu));
-		nma_context_menu_populate (applet, menu);
+		/* The indicator menu carries the context menu items below the
+		 * networks; those are only created once and then just updated.
+		 */
+		if (!applet->info_menu_item) {
+			guint n_items = menu_get_n_items (GTK_WIDGET (menu));
+
+			nma_menu_add_separator_item (GTK_WIDGET (menu));
+			nma_context_menu_populate (applet, menu);
+			menu_mark_items (GTK_WIDGET (menu), n_items, MENU_ITEM_STATIC_TAG, "static");
+		}
 		nma_context_menu_update (applet);
-	} else
-		nma_menu_show_cb (GTK_WIDGET (menu), applet);
+	}
+}
 
-out:
-	applet->update_menu_id = 0;
-	return G_SOURCE_REMOVE;
+/* Rebuilds only the sections of the devices in update_sections; the
+ * others are carried over from the shown menu as they are.
+ */
+static void
+applet_update_menu_sections (NMApplet *applet)
+{
+	/* Nothing to carry over before the indicator menu is first built */
+	if (INDICATOR_ENABLED (applet) && !applet->info_menu_item) {
+		applet_update_menu (applet);
+		return;
+	}
+
+	applet->menu_sections_filter = applet->update_sections;
+	applet_update_menu (applet);
+	applet->menu_sections_filter = NULL;
 }
 
 void
 applet_schedule_update_menu (NMApplet *applet)
 {
-	if (!applet->update_menu_id)
-		applet->update_menu_id = g_idle_add (applet_update_menu, applet);
+	applet_schedule_update (applet, APPLET_UPDATE_MENU);
 }
 
 /*****************************************************************************/
 
+/* Returns the composite cache key for the current icon layers, or %NULL
+ * if only the link layer is set or any set layer is not a themed icon.
+ */
+static char *
+composite_cache_key (NMApplet *applet)
+{
+	GString *key;
+	gboolean has_overlay = FALSE;
+	int i;
+
+	if (!applet->icon_layer_names[ICON_LAYER_LINK])
+		return NULL;
+
+	key = g_string_new (applet->icon_layer_names[ICON_LAYER_LINK]);
+	for (i = ICON_LAYER_LINK + 1; i <= ICON_LAYER_MAX; i++) {
+		g_string_append_c (key, '|');
+		if (!applet->icon_layers[i])
+			continue;
+		if (!applet->icon_layer_names[i]) {
+			g_string_free (key, TRUE);
+			return NULL;
+		}
+		g_string_append (key, applet->icon_layer_names[i]);
+		has_overlay = TRUE;
+	}
+
+	if (!has_overlay) {
+		g_string_free (key, TRUE);
+		return NULL;
+	}
+
+	g_string_append_printf (key, "|%d|%d",
+	                        applet->icon_size,
+	                        gdk_window_get_scale_factor (gdk_get_default_root_window ()));
+	return g_string_free (key, FALSE);
+}
+
 static void
 foo_set_icon (NMApplet *applet, guint32 layer, GdkPixbuf *pixbuf, const char *icon_name)
 {
 	gs_unref_object GdkPixbuf *pixbuf_free = NULL;
+	const char *layer_name = NULL;
 
 	g_return_if_fail (layer == ICON_LAYER_LINK || layer == ICON_LAYER_VPN);
 
@@ -2055,23 +2876,41 @@ foo_set_icon (NMApplet *applet, guint32 layer, GdkPixbuf *pixbuf, const char *ic
 #endif  /* WITH_APPINDICATOR */
 
 	/* Load the pixbuf by icon name */
-	if (icon_name && !pixbuf)
+	if (icon_name && !pixbuf) {
 		pixbuf = nma_icon_check_and_load (icon_name, applet);
+		layer_name = icon_name;
+	}
 
 	/* Ignore setting of the same icon as is already displayed */
 	if (applet->icon_layers[layer] == pixbuf)
 		return;
 
 	g_clear_object (&applet->icon_layers[layer]);
+	g_clear_pointer (&applet->icon_layer_names[layer], g_free);
 
-	if (pixbuf)
+	if (pixbuf) {
 		applet->icon_layers[layer] = g_object_ref (pixbuf);
+		/* Only themed icons can be part of a composite cache key; a pixbuf
+		 * handed in by the device class has no stable identity. */
+		applet->icon_layer_names[layer] = g_strdup (layer_name);
+	}
 
 	if (applet->icon_layers[0]) {
+		gs_free char *key = NULL;
 		int i;
 
 		pixbuf = applet->icon_layers[0];
 
+		key = composite_cache_key (applet);
+		if (key) {
+			GdkPixbuf *cached = g_hash_table_lookup (applet->composite_cache, key);
+
+			if (cached) {
+				gtk_status_icon_set_from_pixbuf (applet->status_icon, cached);
+				return;
+			}
+		}
+
 		for (i = ICON_LAYER_LINK + 1; i <= ICON_LAYER_MAX; i++) {
 			GdkPixbuf *top = applet->icon_layers[i];
 
@@ -2086,6 +2925,12 @@ foo_set_icon (NMApplet *applet, guint32 layer, GdkPixbuf *pixbuf, const char *ic
 			                      0, 0, 1.0, 1.0,
 			                      GDK_INTERP_NEAREST, 255);
 		}
+
+		if (key && pixbuf_free) {
+			g_hash_table_insert (applet->composite_cache,
+			                     g_steal_pointer (&key),
+			                     g_object_ref (pixbuf_free));
+		}
 	} else
 		pixbuf = nma_icon_check_and_load ("nm-no-connection", applet);
 
@@ -2095,30 +2940,11 @@ foo_set_icon (NMApplet *applet, guint32 layer, GdkPixbuf *pixbuf, const char *ic
 NMRemoteConnection *
 applet_get_exported_connection_for_device (NMDevice *device, NMApplet *applet)
 {
-	const GPtrArray *active_connections;
-	int i;
-
-	active_connections = nm_client_get_active_connections (applet->nm_client);
-	for (i = 0; active_connections && (i < active_connections->len); i++) {
-		NMActiveConnection *active;
-		NMRemoteConnection *connection;
-		const GPtrArray *devices;
-
-		active = g_ptr_array_index (active_connections, i);
-		if (!active)
-			continue;
-
-		devices = nm_active_connection_get_devices (active);
-		connection = nm_active_connection_get_connection (active);
-		if (!devices || !connection)
-			continue;
-
-		if (!nm_g_ptr_array_contains (devices, device))
-			continue;
+	NMActiveConnection *active;
 
-		return connection;
-	}
-	return NULL;
+	applet_active_index_ensure (applet);
+	active = g_hash_table_lookup (applet->any_active_by_device, device);
+	return active ? nm_active_connection_get_connection (active) : NULL;
 }
 
 static void
@@ -2168,6 +2994,8 @@ foo_device_state_changed_cb (NMDevice *device,
 	NMApplet *applet = NM_APPLET (user_data);
 	NMADeviceClass *dclass;
 
+	applet->active_index_dirty = TRUE;
+
 	dclass = get_device_class (device, applet);
 
 	if (dclass && dclass->device_state_changed)
@@ -2175,6 +3003,18 @@ foo_device_state_changed_cb (NMDevice *device,
 
 	applet_common_device_state_changed (device, new_state, old_state, reason, applet);
 
+	/* Get the keyring going before NetworkManager asks for the secrets */
+	if (   applet->agent
+	    && new_state >= NM_DEVICE_STATE_PREPARE
+	    && new_state <= NM_DEVICE_STATE_CONFIG
+	    && (old_state < NM_DEVICE_STATE_PREPARE || old_state > NM_DEVICE_STATE_CONFIG)) {
+		NMConnection *connection;
+
+		connection = applet_find_active_connection_for_device (device, applet, NULL);
+		if (connection)
+			applet_agent_prefetch_secrets (applet->agent, connection);
+	}
+
 	if (   dclass
 	    && new_state == NM_DEVICE_STATE_ACTIVATED
 	    && !g_settings_get_boolean (applet->gsettings, PREF_DISABLE_CONNECTED_NOTIFICATIONS)) {
@@ -2191,8 +3031,7 @@ foo_device_state_changed_cb (NMDevice *device,
 		g_free (str);
 	}
 
-	applet_schedule_update_icon (applet);
-	applet_schedule_update_menu (applet);
+	applet_schedule_update (applet, APPLET_UPDATE_LINK | APPLET_UPDATE_TOOLTIP | APPLET_UPDATE_MENU);
 }
 
 static void
@@ -2257,6 +3096,9 @@ foo_manager_running_cb (NMClient *client,
 		clear_animation_timeout (applet);
 	}
 
+	applet->connections_serial++;
+	applet->connections_modified_serial++;
+
 	applet_schedule_update_icon (applet);
 	applet_schedule_update_menu (applet);
 }
@@ -2268,11 +3110,21 @@ vpn_state_changed (NMActiveConnection *connection,
 {
 	NMApplet *applet = NM_APPLET (user_data);
 
-	applet_schedule_update_icon (applet);
-	applet_schedule_update_menu (applet);
+	applet_schedule_update (applet, APPLET_UPDATE_VPN | APPLET_UPDATE_TOOLTIP | APPLET_UPDATE_MENU);
 }
 
 #define VPN_STATE_ID_TAG "vpn-state-id"
+#define ACTIVE_INDEX_TAG "active-index-tracked"
+
+static void
+active_index_invalidate_cb (NMActiveConnection *active,
+                            GParamSpec *pspec,
+                            gpointer user_data)
+{
+	NMApplet *applet = NM_APPLET (user_data);
+
+	applet->active_index_dirty = TRUE;
+}
 
 static void
 foo_active_connections_changed_cb (NMClient *client,
@@ -2283,12 +3135,25 @@ foo_active_connections_changed_cb (NMClient *client,
 	const GPtrArray *active_list;
 	int i;
 
-	/* Track the state of new VPN connections */
+	applet->active_index_dirty = TRUE;
+
 	active_list = nm_client_get_active_connections (client);
 	for (i = 0; active_list && (i < active_list->len); i++) {
 		NMActiveConnection *candidate = NM_ACTIVE_CONNECTION (g_ptr_array_index (active_list, i));
 		guint id;
 
+		/* The active connection index depends on these, too */
+		if (!g_object_get_data (G_OBJECT (candidate), ACTIVE_INDEX_TAG)) {
+			g_signal_connect (candidate, "notify::" NM_ACTIVE_CONNECTION_DEVICES,
+			                  G_CALLBACK (active_index_invalidate_cb), applet);
+			g_signal_connect (candidate, "notify::" NM_ACTIVE_CONNECTION_CONNECTION,
+			                  G_CALLBACK (active_index_invalidate_cb), applet);
+			g_signal_connect (candidate, "notify::" NM_ACTIVE_CONNECTION_STATE,
+			                  G_CALLBACK (active_index_invalidate_cb), applet);
+			g_object_set_data (G_OBJECT (candidate), ACTIVE_INDEX_TAG, GUINT_TO_POINTER (TRUE));
+		}
+
+		/* Track the state of new VPN connections */
 		if (   !NM_IS_VPN_CONNECTION (candidate)
 		    || g_object_get_data (G_OBJECT (candidate), VPN_STATE_ID_TAG))
 			continue;
@@ -2340,18 +3205,43 @@ foo_set_initial_state (gpointer data)
 	foo_active_connections_changed_cb (applet->nm_client, NULL, applet);
 
 	applet_schedule_update_icon (applet);
+	applet_startup_phase (applet, "initial state");
 
 	return FALSE;
 }
 
+static void
+foo_connection_changed_cb (NMApplet *applet)
+{
+	/* Invalidates anything derived from the set of connections */
+	applet->connections_serial++;
+}
+
+static void
+foo_connection_modified_cb (NMApplet *applet)
+{
+	/* ... and what was derived from a single connection's settings */
+	applet->connections_modified_serial++;
+	foo_connection_changed_cb (applet);
+}
+
+static void
+foo_connection_added_cb (NMClient *client,
+                         NMRemoteConnection *connection,
+                         NMApplet *applet)
+{
+	g_signal_connect_object (connection, NM_CONNECTION_CHANGED,
+	                         G_CALLBACK (foo_connection_modified_cb),
+	                         applet, G_CONNECT_SWAPPED);
+	foo_connection_changed_cb (applet);
+}
+
 static void
 foo_client_setup (NMApplet *applet)
 {
 	NMClientPermission perm;
-
-	applet->nm_client = nm_client_new (NULL, NULL);
-	if (!applet->nm_client)
-		return;
+	const GPtrArray *connections;
+	int i;
 
 	g_signal_connect (applet->nm_client, "notify::state",
 	                  G_CALLBACK (foo_client_state_changed_cb),
@@ -2383,6 +3273,19 @@ foo_client_setup (NMApplet *applet)
 	                  G_CALLBACK (foo_wireless_enabled_changed_cb),
 	                  applet);
 
+	g_signal_connect (applet->nm_client, NM_CLIENT_CONNECTION_ADDED,
+	                  G_CALLBACK (foo_connection_added_cb),
+	                  applet);
+	g_signal_connect_swapped (applet->nm_client, NM_CLIENT_CONNECTION_REMOVED,
+	                          G_CALLBACK (foo_connection_changed_cb),
+	                          applet);
+	connections = nm_client_get_connections (applet->nm_client);
+	for (i = 0; i < connections->len; i++) {
+		g_signal_connect_object (connections->pdata[i], NM_CONNECTION_CHANGED,
+		                         G_CALLBACK (foo_connection_modified_cb),
+		                         applet, G_CONNECT_SWAPPED);
+	}
+
 	/* Initialize permissions - the initial 'permission-changed' signal is emitted from NMClient constructor, and thus not caught */
 	for (perm = NM_CLIENT_PERMISSION_NONE + 1; perm <= NM_CLIENT_PERMISSION_LAST; perm++) {
 		applet->permissions[perm] = nm_client_get_permission_result (applet->nm_client, perm);
@@ -2394,6 +3297,30 @@ foo_client_setup (NMApplet *applet)
 	applet_schedule_update_icon (applet);
 }
 
+static void register_agent (NMApplet *applet);
+
+static void
+foo_client_ready_cb (GObject *source, GAsyncResult *result, gpointer user_data)
+{
+	NMApplet *applet = NM_APPLET (user_data);
+	gs_free_error GError *error = NULL;
+
+	applet->nm_client = nm_client_new_finish (result, &error);
+	if (!applet->nm_client) {
+		g_warning ("Could not connect to NetworkManager: %s", error->message);
+		return;
+	}
+	applet_startup_phase (applet, "NetworkManager client ready");
+
+	foo_client_setup (applet);
+
+	if (with_agent)
+		register_agent (applet);
+
+	/* Replace the placeholder with the real state */
+	applet_schedule_update (applet, APPLET_UPDATE_ICON | APPLET_UPDATE_MENU);
+}
+
 #if WITH_WWAN
 
 static void
@@ -2407,7 +3334,7 @@ mm1_name_owner_changed_cb (GDBusObjectManagerClient *mm1,
 	applet->mm1_running = !!name_owner;
 	g_free (name_owner);
 
-	if (applet->mm1_running) {
+	if (applet->mm1_running && applet->nm_client) {
 		const GPtrArray *devices;
 		NMADeviceClass *dclass;
 		NMDevice *device;
@@ -2451,13 +3378,15 @@ mm_new_ready (GDBusConnection *connection,
 }
 
 static void
-mm1_client_setup (NMApplet *applet)
+mm1_bus_ready_cb (GObject *source, GAsyncResult *result, gpointer user_data)
 {
+	NMApplet *applet = NM_APPLET (user_data);
 	GDBusConnection *system_bus;
 	GError *error = NULL;
 
-	system_bus = g_bus_get_sync (G_BUS_TYPE_SYSTEM, NULL, &error);
+	system_bus = g_bus_get_finish (result, &error);
 	if (system_bus) {
+		applet_startup_phase (applet, "system bus acquired");
 		mm_manager_new (system_bus,
 		                G_DBUS_OBJECT_MANAGER_CLIENT_FLAGS_DO_NOT_AUTO_START,
 		                NULL,
@@ -2470,7 +3399,13 @@ mm1_client_setup (NMApplet *applet)
 	}
 }
 
-#endif /* WITH_WWAN */
+static void
+mm1_client_setup (NMApplet *applet)
+{
+	g_bus_get (G_BUS_TYPE_SYSTEM, NULL, mm1_bus_ready_cb, applet);
+}
+
+#endif /* WITH_WWAN */
 
 static void
 applet_common_get_device_icon (NMDeviceState state,
@@ -2498,6 +3433,8 @@ applet_common_get_device_icon (NMDeviceState state,
 	if (stage >= 0) {
 		char *name = g_strdup_printf ("nm-stage%02d-connecting%02d", stage + 1, applet->animation_step + 1);
 
+		applet->animation_link_stage = stage;
+
 		if (out_pixbuf)
 			*out_pixbuf = nm_g_object_ref (nma_icon_check_and_load (name, applet));
 		if (out_icon_name)
@@ -2626,39 +3563,95 @@ get_tip_for_vpn (NMActiveConnection *active, NMVpnConnectionState state, NMApple
 	return tip;
 }
 
-static gboolean
-applet_update_icon (gpointer user_data)
+static GdkPixbuf *
+animation_frame_layer (NMApplet *applet, guint32 layer, int link_stage, guint i)
+{
+	gs_free char *name = NULL;
+
+	if (layer == ICON_LAYER_LINK && link_stage >= 0)
+		name = g_strdup_printf ("nm-stage%02d-connecting%02d", link_stage + 1, i + 1);
+	else if (layer == ICON_LAYER_VPN && link_stage < 0)
+		name = g_strdup_printf ("nm-vpn-connecting%02d", i + 1);
+	else
+		return applet->icon_layers[layer];
+
+	return nma_icon_check_and_load (name, applet);
+}
+
+/* Renders every frame of the animation the last full update started,
+ * so that animation_timeout() only has to swap pixbufs.  Exactly one
+ * layer may animate; the other one has to be a themed icon so that the
+ * frames can be matched up with the next update.
+ */
+static void
+animation_frames_prepare (NMApplet *applet, gboolean vpn_animating)
+{
+	int link_stage = applet->animation_link_stage;
+	gs_free char *key = NULL;
+	guint32 static_layer;
+	guint i, n_frames;
+
+	if (!applet->status_icon || (link_stage >= 0) == vpn_animating) {
+		animation_frames_clear (applet);
+		return;
+	}
+
+	static_layer = vpn_animating ? ICON_LAYER_LINK : ICON_LAYER_VPN;
+	if (applet->icon_layers[static_layer] && !applet->icon_layer_names[static_layer]) {
+		animation_frames_clear (applet);
+		return;
+	}
+
+	key = g_strdup_printf ("%d|%s|%d|%d", link_stage,
+	                       applet->icon_layer_names[static_layer] ? applet->icon_layer_names[static_layer] : "",
+	                       applet->icon_size,
+	                       gdk_window_get_scale_factor (gdk_get_default_root_window ()));
+	if (!g_strcmp0 (key, applet->animation_key))
+		return;
+
+	animation_frames_clear (applet);
+
+	n_frames = vpn_animating ? NUM_VPN_CONNECTING_FRAMES : NUM_CONNECTING_FRAMES;
+	applet->animation_frames = g_ptr_array_new_full (n_frames, g_object_unref);
+	for (i = 0; i < n_frames; i++) {
+		GdkPixbuf *base = animation_frame_layer (applet, ICON_LAYER_LINK, link_stage, i);
+		GdkPixbuf *top = animation_frame_layer (applet, ICON_LAYER_VPN, link_stage, i);
+		GdkPixbuf *frame;
+
+		if (!base) {
+			animation_frames_clear (applet);
+			return;
+		}
+
+		if (top) {
+			frame = gdk_pixbuf_copy (base);
+			gdk_pixbuf_composite (top, frame, 0, 0,
+			                      gdk_pixbuf_get_width (top),
+			                      gdk_pixbuf_get_height (top),
+			                      0, 0, 1.0, 1.0,
+			                      GDK_INTERP_NEAREST, 255);
+		} else
+			frame = g_object_ref (base);
+		g_ptr_array_add (applet->animation_frames, frame);
+	}
+	applet->animation_key = g_steal_pointer (&key);
+}
+
+static void
+applet_update_link (NMApplet *applet)
 {
-	NMApplet *applet = NM_APPLET (user_data);
 	gs_unref_object GdkPixbuf *pixbuf = NULL;
 	NMState state;
 	const char *icon_name, *dev_tip;
-	char *vpn_tip = NULL;
 	gs_free char *icon_name_free = NULL;
-	gs_free char *dev_tip_free = NULL;
-	NMVpnConnectionState vpn_state = NM_VPN_CONNECTION_STATE_UNKNOWN;
-	gboolean nm_running;
-	NMActiveConnection *active_vpn = NULL;
+	char *dev_tip_free = NULL;
 
-	applet->update_icon_id = 0;
-
-	nm_running = nm_client_get_nm_running (applet->nm_client);
-
-	/* Handle device state first */
+	applet->animation_link_stage = -1;
 
 	state = nm_client_get_state (applet->nm_client);
-	if (!nm_running)
+	if (!nm_client_get_nm_running (applet->nm_client))
 		state = NM_STATE_UNKNOWN;
 
-#ifdef WITH_APPINDICATOR
-	if (INDICATOR_ENABLED (applet))
-		app_indicator_set_status (applet->app_indicator, nm_running ? APP_INDICATOR_STATUS_ACTIVE : APP_INDICATOR_STATUS_PASSIVE);
-	else
-#endif  /* WITH_APPINDICATOR */
-	{
-		gtk_status_icon_set_visible (applet->status_icon, applet->visible);
-	}
-
 	switch (state) {
 	case NM_STATE_UNKNOWN:
 	case NM_STATE_ASLEEP:
@@ -2678,10 +3671,21 @@ applet_update_icon (gpointer user_data)
 
 	foo_set_icon (applet, ICON_LAYER_LINK, pixbuf, icon_name);
 
-	icon_name = NULL;
-	g_clear_pointer (&icon_name_free, g_free);
+	g_free (applet->dev_tip);
+	applet->dev_tip = dev_tip_free ? dev_tip_free : g_strdup (dev_tip);
+}
+
+static void
+applet_update_vpn (NMApplet *applet)
+{
+	NMVpnConnectionState vpn_state = NM_VPN_CONNECTION_STATE_UNKNOWN;
+	NMActiveConnection *active_vpn;
+	const char *icon_name = NULL;
+	gs_free char *icon_name_free = NULL;
+
+	applet->animation_vpn = FALSE;
+	g_clear_pointer (&applet->vpn_tip, g_free);
 
-	/* VPN state next */
 	active_vpn = applet_get_active_vpn_connection (applet, &vpn_state);
 	if (active_vpn) {
 		switch (vpn_state) {
@@ -2697,6 +3701,7 @@ applet_update_icon (gpointer user_data)
 		case NM_VPN_CONNECTION_STATE_CONNECT:
 		case NM_VPN_CONNECTION_STATE_IP_CONFIG_GET:
 			icon_name = icon_name_free = g_strdup_printf ("nm-vpn-connecting%02d", applet->animation_step + 1);
+			applet->animation_vpn = TRUE;
 			applet->animation_step++;
 			if (applet->animation_step >= NUM_VPN_CONNECTING_FRAMES)
 				applet->animation_step = 0;
@@ -2705,42 +3710,246 @@ applet_update_icon (gpointer user_data)
 			break;
 		}
 
-		vpn_tip = get_tip_for_vpn (active_vpn, vpn_state, applet);
-		if (vpn_tip && dev_tip) {
-			char *tmp;
-
-			tmp = g_strdup_printf ("%s\n%s", dev_tip, vpn_tip);
-			g_free (vpn_tip);
-			vpn_tip = tmp;
-		}
+		applet->vpn_tip = get_tip_for_vpn (active_vpn, vpn_state, applet);
 	}
 	foo_set_icon (applet, ICON_LAYER_VPN, NULL, icon_name);
+}
 
-	/* update tooltip */
+static void
+applet_update_tooltip (NMApplet *applet)
+{
 	g_free (applet->tip);
-	if (vpn_tip)
-		applet->tip = vpn_tip;
-	else if (dev_tip == dev_tip_free) {
-		applet->tip = dev_tip_free;
-		dev_tip_free = NULL;
-	} else
-		applet->tip = g_strdup (dev_tip);
+	if (applet->vpn_tip && applet->dev_tip)
+		applet->tip = g_strdup_printf ("%s\n%s", applet->dev_tip, applet->vpn_tip);
+	else if (applet->vpn_tip)
+		applet->tip = g_strdup (applet->vpn_tip);
+	else
+		applet->tip = g_strdup (applet->dev_tip);
 
 	if (applet->status_icon)
 		gtk_status_icon_set_tooltip_text (applet->status_icon, applet->tip);
+}
 
-	return FALSE;
+static void
+applet_update_icon (NMApplet *applet, AppletUpdateFlags flags)
+{
+	gboolean nm_running;
+	gint64 trace = nma_trace_begin (NMA_TRACE_UPDATE_ICON);
+
+	/* Until the client is ready only the startup placeholder is shown */
+	if (!applet->nm_client)
+		flags &= ~(APPLET_UPDATE_LINK | APPLET_UPDATE_VPN);
+
+	nm_running = applet->nm_client && nm_client_get_nm_running (applet->nm_client);
+
+#ifdef WITH_APPINDICATOR
+	if (INDICATOR_ENABLED (applet)) {
+		app_indicator_set_status (applet->app_indicator, nm_running ? APP_INDICATOR_STATUS_ACTIVE : APP_INDICATOR_STATUS_PASSIVE);
+		/* The indicator has a single icon whose name combines both, so
+		 * one can't be updated without the other.
+		 */
+		if (flags & (APPLET_UPDATE_LINK | APPLET_UPDATE_VPN))
+			flags |= APPLET_UPDATE_LINK | APPLET_UPDATE_VPN;
+	} else
+#endif  /* WITH_APPINDICATOR */
+	{
+		gtk_status_icon_set_visible (applet->status_icon, applet->visible);
+	}
+
+	if (flags & APPLET_UPDATE_LINK)
+		applet_update_link (applet);
+	if (flags & APPLET_UPDATE_VPN)
+		applet_update_vpn (applet);
+	if (flags & (APPLET_UPDATE_LINK | APPLET_UPDATE_VPN))
+		animation_frames_prepare (applet, applet->animation_vpn);
+
+	applet_update_tooltip (applet);
+
+	nma_trace_end (NMA_TRACE_UPDATE_ICON, trace);
+}
+
+static gboolean
+applet_update (gpointer user_data)
+{
+	NMApplet *applet = NM_APPLET (user_data);
+	AppletUpdateFlags flags = applet->update_flags;
+	gint64 trace;
+
+	nma_trace_count (NMA_TRACE_UPDATE_RUN);
+	applet->update_id = 0;
+	applet->update_flags = 0;
+	applet->update_last = g_get_monotonic_time ();
+
+	if (flags & APPLET_UPDATE_ICON)
+		applet_update_icon (applet, flags);
+
+	if (!applet->nm_client) {
+		/* The menu is built once the client is ready */
+		g_hash_table_remove_all (applet->update_sections);
+		return G_SOURCE_REMOVE;
+	}
+
+	if (flags & APPLET_UPDATE_MENU) {
+		trace = nma_trace_begin (NMA_TRACE_UPDATE_MENU);
+		applet_update_menu (applet);
+		nma_trace_end (NMA_TRACE_UPDATE_MENU, trace);
+	} else if (g_hash_table_size (applet->update_sections)) {
+		trace = nma_trace_begin (NMA_TRACE_UPDATE_MENU);
+		applet_update_menu_sections (applet);
+		nma_trace_end (NMA_TRACE_UPDATE_MENU, trace);
+	}
+	g_hash_table_remove_all (applet->update_sections);
+
+	return G_SOURCE_REMOVE;
+}
+
+/*
+ * applet_schedule_update
+ *
+ * Marks parts of the icon and menu as out of date.  Updates are
+ * coalesced and run at most max_refresh_rate times per second.
+ */
+void
+applet_schedule_update (NMApplet *applet, AppletUpdateFlags flags)
+{
+	gint64 interval, elapsed;
+
+	applet->update_flags |= flags;
+	if (applet->update_id) {
+		nma_trace_count (NMA_TRACE_UPDATE_COALESCED);
+		return;
+	}
+	nma_trace_count (NMA_TRACE_UPDATE_SCHEDULED);
+
+	interval = max_refresh_rate ? G_USEC_PER_SEC / max_refresh_rate : 0;
+	elapsed = g_get_monotonic_time () - applet->update_last;
+	if (elapsed >= interval)
+		applet->update_id = g_idle_add (applet_update, applet);
+	else {
+		applet->update_id = g_timeout_add ((interval - elapsed + 999) / 1000,
+		                                   applet_update, applet);
+	}
+}
+
+/* Marks only the menu section of @device as out of date */
+void
+applet_schedule_update_device (NMApplet *applet, NMDevice *device)
+{
+	g_hash_table_add (applet->update_sections,
+	                  g_strdup (nm_object_get_path (NM_OBJECT (device))));
+	applet_schedule_update (applet, 0);
 }
 
 void
 applet_schedule_update_icon (NMApplet *applet)
 {
-	if (!applet->update_icon_id)
-		applet->update_icon_id = g_idle_add (applet_update_icon, applet);
+	applet_schedule_update (applet, APPLET_UPDATE_ICON);
 }
 
 /*****************************************************************************/
 
+/* NetworkManager tends to retry secrets requests, and several consumers
+ * (the connection editor, nmcli, activation itself) can ask for the same
+ * secrets at once.  Requests for the same connection, setting, flags and
+ * hints are therefore folded into the first one; the others wait for its
+ * result instead of popping up another dialog.  Only max_secrets_requests
+ * of them are worked on at a time, the rest queue up in arrival order.
+ */
+typedef struct {
+	gpointer reqid;
+	AppletAgentSecretsCallback callback;
+	gpointer callback_data;
+	SecretsRequest *req;
+	GList link;
+} SecretsWaiter;
+
+static void secrets_request_start (SecretsRequest *req);
+
+static char *
+secrets_request_key (NMConnection *connection,
+                     const char *setting_name,
+                     const char **hints,
+                     guint32 flags)
+{
+	gs_free char *joined = NULL;
+	const char *path;
+
+	path = nm_connection_get_path (connection);
+	if (!path)
+		return NULL;
+
+	joined = hints ? g_strjoinv (",", (char **) hints) : NULL;
+	return g_strdup_printf ("%s|%s|%u|%s", path, setting_name, flags, joined ? joined : "");
+}
+
+static void
+secrets_request_unregister_key (SecretsRequest *req)
+{
+	GHashTable *by_key = req->applet->secrets_by_key;
+
+	if (req->key && g_hash_table_lookup (by_key, req->key) == req)
+		g_hash_table_remove (by_key, req->key);
+}
+
+static void
+secrets_waiter_free (SecretsWaiter *waiter)
+{
+	g_hash_table_remove (waiter->req->applet->secrets_waiters, waiter->reqid);
+	g_slice_free (SecretsWaiter, waiter);
+}
+
+static void
+secrets_request_add_waiter (SecretsRequest *req,
+                            gpointer request_id,
+                            AppletAgentSecretsCallback callback,
+                            gpointer callback_data)
+{
+	SecretsWaiter *waiter;
+
+	waiter = g_slice_new0 (SecretsWaiter);
+	waiter->reqid = request_id;
+	waiter->callback = callback;
+	waiter->callback_data = callback_data;
+	waiter->req = req;
+	waiter->link.data = waiter;
+	g_queue_push_tail_link (&req->waiters, &waiter->link);
+	g_hash_table_insert (req->applet->secrets_waiters, request_id, waiter);
+	nma_trace_count (NMA_TRACE_SECRETS_SHARED);
+}
+
+static void
+secrets_request_notify_waiters (SecretsRequest *req,
+                                GVariant *settings,
+                                GError *error)
+{
+	GList *link;
+
+	/* Anything arriving from now on has to start over */
+	secrets_request_unregister_key (req);
+
+	while ((link = g_queue_pop_head_link (&req->waiters))) {
+		SecretsWaiter *waiter = link->data;
+
+		waiter->callback (req->applet->agent, settings, error, waiter->callback_data);
+		secrets_waiter_free (waiter);
+	}
+}
+
+static gboolean
+secrets_queue_run (gpointer user_data)
+{
+	NMApplet *applet = user_data;
+	GList *link;
+
+	applet->secrets_queue_id = 0;
+
+	while (   applet->secrets_running < max_secrets_requests
+	       && (link = g_queue_pop_head_link (&applet->secrets_queue)))
+		secrets_request_start (link->data);
+
+	return G_SOURCE_REMOVE;
+}
+
 static SecretsRequest *
 applet_secrets_request_new (size_t totsize,
                             NMConnection *connection,
@@ -2767,6 +3976,9 @@ applet_secrets_request_new (size_t totsize,
 	req->callback = callback;
 	req->callback_data = callback_data;
 	req->applet = applet;
+	req->trace_start = nma_trace_begin (NMA_TRACE_SECRETS_REQUEST);
+	g_queue_init (&req->waiters);
+	req->queue_link.data = req;
 	return req;
 }
 
@@ -2777,12 +3989,30 @@ applet_secrets_request_set_free_func (SecretsRequest *req,
 	req->free_func = free_func;
 }
 
+static void
+secrets_request_complete (SecretsRequest *req,
+                          GVariant *settings,
+                          GError *error)
+{
+	/* Every waiter gets the same variant; keep it alive until the last
+	 * callback has taken its own reference.
+	 */
+	if (settings)
+		g_variant_ref_sink (settings);
+
+	req->callback (req->applet->agent, settings, error, req->callback_data);
+	secrets_request_notify_waiters (req, settings, error);
+
+	if (settings)
+		g_variant_unref (settings);
+}
+
 void
 applet_secrets_request_complete (SecretsRequest *req,
                                  GVariant *settings,
                                  GError *error)
 {
-	req->callback (req->applet->agent, error ? NULL : settings, error, req->callback_data);
+	secrets_request_complete (req, error ? NULL : settings, error);
 }
 
 void
@@ -2813,22 +4043,40 @@ applet_secrets_request_complete_setting (SecretsRequest *req,
 		}
 	}
 
-	req->callback (req->applet->agent, secrets_dict, error, req->callback_data);
+	secrets_request_complete (req, secrets_dict, error);
 }
 
 void
 applet_secrets_request_free (SecretsRequest *req)
 {
+	NMApplet *applet;
+	GList *link;
+
 	g_return_if_fail (req != NULL);
 
+	applet = req->applet;
+
 	if (req->free_func)
 		req->free_func (req);
 
-	req->applet->secrets_reqs = g_slist_remove (req->applet->secrets_reqs, req);
+	g_hash_table_remove (applet->secrets_by_id, req->reqid);
+	secrets_request_unregister_key (req);
+	while ((link = g_queue_pop_head_link (&req->waiters)))
+		secrets_waiter_free (link->data);
+
+	if (req->started) {
+		applet->secrets_running--;
+		if (!applet->secrets_queue_id && applet->secrets_queue.length)
+			applet->secrets_queue_id = g_idle_add (secrets_queue_run, applet);
+	} else
+		g_queue_unlink (&applet->secrets_queue, &req->queue_link);
+
+	nma_trace_end (NMA_TRACE_SECRETS_REQUEST, req->trace_start);
 
 	g_object_unref (req->connection);
 	g_free (req->setting_name);
 	g_strfreev (req->hints);
+	g_free (req->key);
 	memset (req, 0, req->totsize);
 	g_free (req);
 }
@@ -2862,6 +4110,44 @@ get_existing_secrets_cb (NMSecretAgentOld *agent,
 	/* Otherwise success; wait for the secrets callback */
 }
 
+static gboolean
+connection_is_vpn (NMConnection *connection)
+{
+	NMSettingConnection *s_con;
+
+	s_con = nm_connection_get_setting_connection (connection);
+	return !strcmp (nm_setting_connection_get_connection_type (s_con), NM_SETTING_VPN_SETTING_NAME);
+}
+
+static void
+secrets_request_start (SecretsRequest *req)
+{
+	GError *error = NULL;
+
+	req->started = TRUE;
+	req->applet->secrets_running++;
+
+	/* VPN secrets get handled a bit differently */
+	if (connection_is_vpn (req->connection)) {
+		if (!applet_vpn_request_get_secrets (req, &error)) {
+			g_warning ("%s", error->message);
+			applet_secrets_request_complete (req, NULL, error);
+			applet_secrets_request_free (req);
+			g_error_free (error);
+		}
+		return;
+	}
+
+	/* Get existing secrets, if any */
+	nm_secret_agent_old_get_secrets (NM_SECRET_AGENT_OLD (req->applet->agent),
+	                                 req->connection,
+	                                 req->setting_name,
+	                                 (const char **) req->hints,
+	                                 NM_SECRET_AGENT_GET_SECRETS_FLAG_NONE,
+	                                 get_existing_secrets_cb,
+	                                 req);
+}
+
 static void
 applet_agent_get_secrets_cb (AppletAgent *agent,
                              gpointer request_id,
@@ -2874,51 +4160,48 @@ applet_agent_get_secrets_cb (AppletAgent *agent,
                              gpointer user_data)
 {
 	NMApplet *applet = NM_APPLET (user_data);
-	NMSettingConnection *s_con;
 	NMADeviceClass *dclass;
 	GError *error = NULL;
-	SecretsRequest *req = NULL;
+	SecretsRequest *req;
+	gs_free char *key = NULL;
+	size_t size;
 
-	s_con = nm_connection_get_setting_connection (connection);
-	g_return_if_fail (s_con != NULL);
+	g_return_if_fail (nm_connection_get_setting_connection (connection) != NULL);
 
-	/* VPN secrets get handled a bit differently */
-	if (!strcmp (nm_setting_connection_get_connection_type (s_con), NM_SETTING_VPN_SETTING_NAME)) {
-		req = applet_secrets_request_new (applet_vpn_request_get_secrets_size (),
-		                                  connection,
-		                                  request_id,
-		                                  setting_name,
-		                                  hints,
-		                                  flags,
-		                                  callback,
-		                                  callback_data,
-		                                  applet);
-		if (!applet_vpn_request_get_secrets (req, &error))
+	if (connection_is_vpn (connection))
+		size = applet_vpn_request_get_secrets_size ();
+	else {
+		dclass = get_device_class_from_connection (connection, applet);
+		if (!dclass) {
+			error = g_error_new (NM_SECRET_AGENT_ERROR,
+			                     NM_SECRET_AGENT_ERROR_FAILED,
+			                     "%s.%d (%s): device type unknown",
+			                     __FILE__, __LINE__, __func__);
 			goto error;
+		}
 
-		applet->secrets_reqs = g_slist_prepend (applet->secrets_reqs, req);
-		return;
-	}
+		if (!dclass->get_secrets) {
+			error = g_error_new (NM_SECRET_AGENT_ERROR,
+			                     NM_SECRET_AGENT_ERROR_NO_SECRETS,
+			                     "%s.%d (%s): no secrets found",
+			                     __FILE__, __LINE__, __func__);
+			goto error;
+		}
 
-	dclass = get_device_class_from_connection (connection, applet);
-	if (!dclass) {
-		error = g_error_new (NM_SECRET_AGENT_ERROR,
-		                     NM_SECRET_AGENT_ERROR_FAILED,
-		                     "%s.%d (%s): device type unknown",
-		                     __FILE__, __LINE__, __func__);
-		goto error;
+		g_assert (dclass->secrets_request_size);
+		size = dclass->secrets_request_size;
 	}
 
-	if (!dclass->get_secrets) {
-		error = g_error_new (NM_SECRET_AGENT_ERROR,
-		                     NM_SECRET_AGENT_ERROR_NO_SECRETS,
-		                     "%s.%d (%s): no secrets found",
-		                     __FILE__, __LINE__, __func__);
-		goto error;
+	key = secrets_request_key (connection, setting_name, hints, flags);
+	if (key) {
+		req = g_hash_table_lookup (applet->secrets_by_key, key);
+		if (req) {
+			secrets_request_add_waiter (req, request_id, callback, callback_data);
+			return;
+		}
 	}
 
-	g_assert (dclass->secrets_request_size);
-	req = applet_secrets_request_new (dclass->secrets_request_size,
+	req = applet_secrets_request_new (size,
 	                                  connection,
 	                                  request_id,
 	                                  setting_name,
@@ -2927,25 +4210,23 @@ applet_agent_get_secrets_cb (AppletAgent *agent,
 	                                  callback,
 	                                  callback_data,
 	                                  applet);
-	applet->secrets_reqs = g_slist_prepend (applet->secrets_reqs, req);
+	req->key = g_steal_pointer (&key);
+	g_hash_table_insert (applet->secrets_by_id, request_id, req);
+	if (req->key)
+		g_hash_table_insert (applet->secrets_by_key, req->key, req);
 
-	/* Get existing secrets, if any */
-	nm_secret_agent_old_get_secrets (NM_SECRET_AGENT_OLD (applet->agent),
-	                                 connection,
-	                                 setting_name,
-	                                 hints,
-	                                 NM_SECRET_AGENT_GET_SECRETS_FLAG_NONE,
-	                                 get_existing_secrets_cb,
-	                                 req);
+	if (applet->secrets_running < max_secrets_requests)
+		secrets_request_start (req);
+	else {
+		g_queue_push_tail_link (&applet->secrets_queue, &req->queue_link);
+		nma_trace_count (NMA_TRACE_SECRETS_QUEUED);
+	}
 	return;
 
 error:
 	g_warning ("%s", error->message);
 	callback (agent, NULL, error, callback_data);
 	g_error_free (error);
-
-	if (req)
-		applet_secrets_request_free (req);
 }
 
 static void
@@ -2954,19 +4235,39 @@ applet_agent_cancel_secrets_cb (AppletAgent *agent,
                                 gpointer user_data)
 {
 	NMApplet *applet = NM_APPLET (user_data);
-	GSList *iter, *next;
+	SecretsRequest *req;
+	SecretsWaiter *waiter;
+	GList *link;
 
-	for (iter = applet->secrets_reqs; iter; iter = next) {
-		SecretsRequest *req = iter->data;
+	waiter = g_hash_table_lookup (applet->secrets_waiters, request_id);
+	if (waiter) {
+		g_queue_unlink (&waiter->req->waiters, &waiter->link);
+		secrets_waiter_free (waiter);
+		return;
+	}
 
-		next = g_slist_next (iter);
+	req = g_hash_table_lookup (applet->secrets_by_id, request_id);
+	if (!req)
+		return;
 
-		if (req->reqid == request_id) {
-			/* cancel and free this password request */
-			applet_secrets_request_free (req);
-			break;
-		}
+	link = g_queue_pop_head_link (&req->waiters);
+	if (!link) {
+		/* cancel and free this password request */
+		applet_secrets_request_free (req);
+		return;
 	}
+
+	/* Someone else is still waiting for these secrets; keep the dialog
+	 * up and answer them instead.
+	 */
+	waiter = link->data;
+	g_hash_table_remove (applet->secrets_by_id, req->reqid);
+	g_hash_table_remove (applet->secrets_waiters, waiter->reqid);
+	req->reqid = waiter->reqid;
+	req->callback = waiter->callback;
+	req->callback_data = waiter->callback_data;
+	g_hash_table_insert (applet->secrets_by_id, req->reqid, req);
+	g_slice_free (SecretsWaiter, waiter);
 }
 
 /*****************************************************************************/
@@ -2977,8 +4278,23 @@ static void nma_icons_free (NMApplet *applet)
 
 	g_return_if_fail (NM_IS_APPLET (applet));
 
-	for (i = 0; i <= ICON_LAYER_MAX; i++)
+	for (i = 0; i <= ICON_LAYER_MAX; i++) {
 		g_clear_object (&applet->icon_layers[i]);
+		g_clear_pointer (&applet->icon_layer_names[i], g_free);
+	}
+}
+
+/* The icon cache is keyed by name, size and scale factor, so that icons
+ * loaded for one panel size stay valid when it flips back and forth; only
+ * a theme change empties it.
+ */
+#define ICON_CACHE_KEY_MAX 128
+
+static const char *
+icon_cache_key (char *buf, const char *name, int size, int scale)
+{
+	g_snprintf (buf, ICON_CACHE_KEY_MAX, "%s|%d|%d", name, size, scale);
+	return buf;
 }
 
 GdkPixbuf *
@@ -2986,16 +4302,21 @@ nma_icon_check_and_load (const char *name, NMApplet *applet)
 {
 	GError *error = NULL;
 	GdkPixbuf *icon;
+	char key[ICON_CACHE_KEY_MAX];
 	int scale;
+	gint64 trace;
 
 	g_assert (name != NULL);
 	g_assert (applet != NULL);
 
+	scale = gdk_window_get_scale_factor (gdk_get_default_root_window ());
+	icon_cache_key (key, name, applet->icon_size, scale);
+
 	/* icon already loaded successfully */
-	if (g_hash_table_lookup_extended (applet->icon_cache, name, NULL, (gpointer) &icon))
+	if (g_hash_table_lookup_extended (applet->icon_cache, key, NULL, (gpointer) &icon))
 		return icon;
 
-	scale = gdk_window_get_scale_factor (gdk_get_default_root_window ());
+	trace = nma_trace_begin (NMA_TRACE_ICON_LOAD);
 
 	/* Try to load the icon; if the load fails, log the problem, and set
 	 * the icon to the fallback icon if requested.
@@ -3006,8 +4327,9 @@ nma_icon_check_and_load (const char *name, NMApplet *applet)
 		icon = nm_g_object_ref (applet->fallback_icon);
 	}
 
-	g_hash_table_insert (applet->icon_cache, g_strdup (name), icon);
+	g_hash_table_insert (applet->icon_cache, g_strdup (key), icon);
 
+	nma_trace_end (NMA_TRACE_ICON_LOAD, trace);
 	return icon;
 }
 
@@ -3022,6 +4344,10 @@ nma_icons_reload (NMApplet *applet)
 	g_return_if_fail (applet->icon_size > 0);
 
 	g_hash_table_remove_all (applet->icon_cache);
+	g_hash_table_remove_all (applet->composite_cache);
+	g_hash_table_remove_all (applet->ap_icon_cache);
+	g_hash_table_remove_all (applet->ap_surface_cache);
+	animation_frames_clear (applet);
 	nma_icons_free (applet);
 
 	if (applet->fallback_icon)
@@ -3049,9 +4375,12 @@ error:
 	g_clear_error (&error);
 }
 
+static void applet_warm_up_icons (NMApplet *applet);
+
 static void nma_icon_theme_changed (GtkIconTheme *icon_theme, NMApplet *applet)
 {
 	nma_icons_reload (applet);
+	applet_warm_up_icons (applet);
 	applet_schedule_update_icon (applet);
 }
 
@@ -3111,7 +4440,10 @@ status_icon_size_changed_cb (GtkStatusIcon *icon,
 		g_warn_if_fail (size == 0);
 	}
 
-	nma_icons_reload (applet);
+	/* The caches are keyed by size, so only what's shown has to go */
+	animation_frames_clear (applet);
+	nma_icons_free (applet);
+	applet_warm_up_icons (applet);
 
 	applet_schedule_update_icon (applet);
 
@@ -3126,6 +4458,9 @@ status_icon_activate_cb (GtkStatusIcon *icon, NMApplet *applet)
 	 */
 	applet_clear_notify (applet);
 
+	if (!applet->nm_client)
+		return;
+
 	applet_start_wifi_scan (applet, NULL);
 
 	/* Kill any old menu */
@@ -3158,6 +4493,9 @@ status_icon_popup_menu_cb (GtkStatusIcon *icon,
 	 */
 	applet_clear_notify (applet);
 
+	if (!applet->nm_client)
+		return;
+
 	nma_context_menu_update (applet);
 	gtk_menu_popup (GTK_MENU (applet->context_menu), NULL, NULL,
 			gtk_status_icon_position_menu, icon,
@@ -3210,10 +4548,21 @@ setup_widgets (NMApplet *applet)
 static void
 applet_embedded_cb (GObject *object, GParamSpec *pspec, gpointer user_data)
 {
-	gboolean embedded = gtk_status_icon_is_embedded (GTK_STATUS_ICON (object));
+	NMApplet *applet = NM_APPLET (user_data);
+	GtkStatusIcon *status_icon = GTK_STATUS_ICON (object);
 
-	g_debug ("applet now %s the notification area",
-	         embedded ? "embedded in" : "removed from");
+	if (!strcmp (pspec->name, "visible")) {
+		g_debug ("applet icon now %s",
+		         gtk_status_icon_get_visible (status_icon) ? "shown" : "hidden");
+	} else {
+		g_debug ("applet now %s the notification area",
+		         gtk_status_icon_is_embedded (status_icon) ? "embedded in" : "removed from");
+	}
+
+	if (applet->animation_paused && status_icon_shown (applet)) {
+		start_animation_timeout (applet);
+		applet_schedule_update_icon (applet);
+	}
 }
 
 static void
@@ -3238,6 +4587,8 @@ register_agent (NMApplet *applet)
 	                  G_CALLBACK (applet_agent_get_secrets_cb), applet);
 	g_signal_connect (applet->agent, APPLET_AGENT_CANCEL_SECRETS,
 	                  G_CALLBACK (applet_agent_cancel_secrets_cb), applet);
+	if (secrets_cache_ttl)
+		applet_agent_set_cache_ttl (applet->agent, secrets_cache_ttl);
 
 	if (INDICATOR_ENABLED (applet)) {
 		/* Watch for new connections */
@@ -3271,12 +4622,190 @@ applet_activate (GApplication *app, gpointer user_data)
 	/* Nothing to do, but glib requires this handler */
 }
 
+static const char *warm_up_icons[] = {
+	"nm-no-connection",
+	"nm-device-wired",
+	"nm-device-wireless",
+	"nm-device-wwan",
+	"nm-signal-00",
+	"nm-signal-25",
+	"nm-signal-50",
+	"nm-signal-75",
+	"nm-signal-100",
+	"nm-secure-lock",
+	"nm-adhoc",
+	"nm-vpn-active-lock",
+	"nm-wwan-tower",
+	"nm-mb-roam",
+	"nm-tech-cdma-1x",
+	"nm-tech-evdo",
+	"nm-tech-gprs",
+	"nm-tech-edge",
+	"nm-tech-umts",
+	"nm-tech-hspa",
+	"nm-tech-lte",
+	NULL
+};
+
+#define NUM_CONNECTING_STAGES 3
+
+typedef struct {
+	char *key;
+	char *filename;
+	int pixels;
+	GdkPixbuf *pixbuf;
+} WarmUpIcon;
+
+static void
+warm_up_icon_free (gpointer data)
+{
+	WarmUpIcon *icon = data;
+
+	g_free (icon->key);
+	g_free (icon->filename);
+	g_clear_object (&icon->pixbuf);
+	g_slice_free (WarmUpIcon, icon);
+}
+
+static void
+warm_up_icons_add (NMApplet *applet, GPtrArray *icons, const char *name, int scale)
+{
+	char key[ICON_CACHE_KEY_MAX];
+	GtkIconInfo *info;
+	WarmUpIcon *icon;
+
+	icon_cache_key (key, name, applet->icon_size, scale);
+	if (g_hash_table_contains (applet->icon_cache, key))
+		return;
+
+	/* Finding the file is cheap, decoding it is what takes time */
+	info = gtk_icon_theme_lookup_icon_for_scale (applet->icon_theme, name, applet->icon_size,
+	                                             scale, GTK_ICON_LOOKUP_FORCE_SIZE);
+	if (!info)
+		return;
+
+	if (gtk_icon_info_get_filename (info)) {
+		icon = g_slice_new0 (WarmUpIcon);
+		icon->key = g_strdup (key);
+		icon->filename = g_strdup (gtk_icon_info_get_filename (info));
+		icon->pixels = applet->icon_size * scale;
+		g_ptr_array_add (icons, icon);
+	}
+	g_object_unref (info);
+}
+
+static void
+warm_up_icons_thread (GTask *task,
+                      gpointer source_object,
+                      gpointer task_data,
+                      GCancellable *cancellable)
+{
+	GPtrArray *icons = task_data;
+	guint i;
+
+	for (i = 0; i < icons->len; i++) {
+		WarmUpIcon *icon = icons->pdata[i];
+
+		if (g_task_return_error_if_cancelled (task))
+			return;
+
+		/* Failures are left for nma_icon_check_and_load() to report */
+		icon->pixbuf = gdk_pixbuf_new_from_file_at_scale (icon->filename,
+		                                                  icon->pixels, icon->pixels,
+		                                                  TRUE, NULL);
+	}
+	g_task_return_boolean (task, TRUE);
+}
+
+static void
+warm_up_icons_done (GObject *source_object, GAsyncResult *result, gpointer user_data)
+{
+	GTask *task = G_TASK (result);
+	NMApplet *applet;
+	GPtrArray *icons;
+	guint i, n = 0;
+
+	if (!g_task_propagate_boolean (task, NULL))
+		return;
+
+	applet = NM_APPLET (user_data);
+	g_clear_object (&applet->warm_up_cancellable);
+
+	icons = g_task_get_task_data (task);
+	for (i = 0; i < icons->len; i++) {
+		WarmUpIcon *icon = icons->pdata[i];
+
+		if (!icon->pixbuf || g_hash_table_contains (applet->icon_cache, icon->key))
+			continue;
+		g_hash_table_insert (applet->icon_cache,
+		                     g_steal_pointer (&icon->key),
+		                     g_steal_pointer (&icon->pixbuf));
+		n++;
+	}
+
+	g_debug ("icons: %u of %u warmed up", n, icons->len);
+	applet_startup_phase (applet, "icons loaded");
+}
+
+/*
+ * applet_warm_up_icons
+ *
+ * Decodes the icons the applet is going to need at the current size and
+ * scale (strength, animation frames, mobile broadband...) in a worker
+ * thread and adds them to the icon cache, so that neither the first icon
+ * update nor the first menu has to wait for the disk.  Only the lookup
+ * in the icon theme, which isn't thread-safe, is done here.
+ */
+static void
+applet_warm_up_icons (NMApplet *applet)
+{
+	GPtrArray *icons;
+	GTask *task;
+	int scale;
+	guint i, j;
+
+	nm_clear_g_cancellable (&applet->warm_up_cancellable);
+
+	scale = gdk_window_get_scale_factor (gdk_get_default_root_window ());
+	icons = g_ptr_array_new_with_free_func (warm_up_icon_free);
+
+	for (i = 0; warm_up_icons[i]; i++)
+		warm_up_icons_add (applet, icons, warm_up_icons[i], scale);
+
+	for (i = 0; i < NUM_CONNECTING_STAGES; i++) {
+		for (j = 0; j < NUM_CONNECTING_FRAMES; j++) {
+			gs_free char *name = g_strdup_printf ("nm-stage%02d-connecting%02d", i + 1, j + 1);
+
+			warm_up_icons_add (applet, icons, name, scale);
+		}
+	}
+
+	for (j = 0; j < NUM_VPN_CONNECTING_FRAMES; j++) {
+		gs_free char *name = g_strdup_printf ("nm-vpn-connecting%02d", j + 1);
+
+		warm_up_icons_add (applet, icons, name, scale);
+	}
+
+	if (!icons->len) {
+		g_ptr_array_unref (icons);
+		return;
+	}
+
+	applet->warm_up_cancellable = g_cancellable_new ();
+	task = g_task_new (NULL, applet->warm_up_cancellable, warm_up_icons_done, applet);
+	g_task_set_task_data (task, icons, (GDestroyNotify) g_ptr_array_unref);
+	g_task_run_in_thread (task, warm_up_icons_thread);
+	g_object_unref (task);
+}
+
 static void
 applet_startup (GApplication *app, gpointer user_data)
 {
 	NMApplet *applet = NM_APPLET (app);
 	gs_free_error GError *error = NULL;
 
+	applet->startup_time = g_get_monotonic_time ();
+
 	g_set_application_name (_("NetworkManager Applet"));
 	gtk_window_set_default_icon_name ("network-workgroup");
 
@@ -3293,7 +4822,10 @@ applet_startup (GApplication *app, gpointer user_data)
 	g_signal_connect (applet->gsettings, "changed::show-applet",
 	                  G_CALLBACK (applet_gsettings_show_changed), applet);
 
-	foo_client_setup (applet);
+	/* Connect to NetworkManager in the background; the tray shows a
+	 * placeholder until foo_client_ready_cb() has the real state.
+	 */
+	nm_client_new_async (NULL, foo_client_ready_cb, applet);
 
 	/* Load pixmaps and create applet widgets */
 	if (!setup_widgets (applet)) {
@@ -3307,10 +4839,39 @@ applet_startup (GApplication *app, gpointer user_data)
 	                                            g_str_equal,
 	                                            g_free,
 	                                            nm_g_object_unref);
+	applet->composite_cache = g_hash_table_new_full (g_str_hash,
+	                                                 g_str_equal,
+	                                                 g_free,
+	                                                 g_object_unref);
+	applet->ap_icon_cache = g_hash_table_new_full (g_str_hash,
+	                                               g_str_equal,
+	                                               g_free,
+	                                               g_object_unref);
+	applet->ap_surface_cache = g_hash_table_new_full (g_str_hash,
+	                                                  g_str_equal,
+	                                                  g_free,
+	                                                  (GDestroyNotify) cairo_surface_destroy);
 	nma_icons_init (applet);
 
+	applet->dev_tip = g_strdup (_("Connecting to NetworkManager…"));
+	foo_set_icon (applet, ICON_LAYER_LINK, NULL, "nm-no-connection");
+	applet_schedule_update (applet, APPLET_UPDATE_TOOLTIP);
+	applet_startup_phase (applet, "placeholder icon");
+
+	/* The icon theme lookups happen right here on the main thread; only
+	 * decoding the files overlaps with connecting to NetworkManager.
+	 */
+	applet_warm_up_icons (applet);
+
 	if (!notify_is_initted ())
 		notify_init ("NetworkManager");
+	applet->notify_watch_id = g_bus_watch_name (G_BUS_TYPE_SESSION,
+	                                            NOTIFY_DBUS_NAME,
+	                                            G_BUS_NAME_WATCHER_FLAGS_AUTO_START,
+	                                            notify_server_appeared_cb,
+	                                            notify_server_vanished_cb,
+	                                            applet,
+	                                            NULL);
 
 	/* Initialize device classes */
 	applet->ethernet_class = applet_device_ethernet_get_class (applet);
@@ -3336,13 +4897,12 @@ applet_startup (GApplication *app, gpointer user_data)
 		 * notification area applet from the panel, and thus nm-applet too.
 		 */
 		g_signal_connect (applet->status_icon, "notify::embedded",
-			              G_CALLBACK (applet_embedded_cb), NULL);
-		applet_embedded_cb (G_OBJECT (applet->status_icon), NULL, NULL);
+			              G_CALLBACK (applet_embedded_cb), applet);
+		g_signal_connect (applet->status_icon, "notify::visible",
+			              G_CALLBACK (applet_embedded_cb), applet);
+		applet_embedded_cb (G_OBJECT (applet->status_icon), NULL, applet);
 	}
 
-	if (with_agent)
-		register_agent (applet);
-
 	g_application_hold (G_APPLICATION (applet));
 }
 
@@ -3357,31 +4917,57 @@ static void finalize (GObject *object)
 #endif
 	g_slice_free (NMADeviceClass, applet->bt_class);
 
-	nm_clear_g_source (&applet->update_icon_id);
+	nm_clear_g_source (&applet->update_id);
 	nm_clear_g_source (&applet->wifi_scan_id);
+	nm_clear_g_cancellable (&applet->warm_up_cancellable);
+	clear_animation_timeout (applet);
+	nm_clear_g_source (&applet->old_menus_id);
+	g_slist_free_full (applet->old_menus, g_object_unref);
+	applet->old_menus = NULL;
 
 #ifdef WITH_APPINDICATOR
 	g_clear_object (&applet->app_indicator);
 #endif /* WITH_APPINDICATOR */
-	nm_clear_g_source (&applet->update_menu_id);
 
 	g_clear_object (&applet->status_icon);
 	g_clear_object (&applet->menu);
+	g_clear_pointer (&applet->menu_item_pool, g_ptr_array_unref);
 	g_clear_pointer (&applet->icon_cache, g_hash_table_destroy);
+	g_clear_pointer (&applet->composite_cache, g_hash_table_destroy);
+	g_clear_pointer (&applet->ap_icon_cache, g_hash_table_destroy);
+	g_clear_pointer (&applet->ap_surface_cache, g_hash_table_destroy);
 	g_clear_object (&applet->fallback_icon);
 	g_free (applet->tip);
+	g_free (applet->dev_tip);
+	g_free (applet->vpn_tip);
+	g_clear_pointer (&applet->update_sections, g_hash_table_destroy);
 	nma_icons_free (applet);
 
-	while (g_slist_length (applet->secrets_reqs))
-		applet_secrets_request_free ((SecretsRequest *) applet->secrets_reqs->data);
+	if (applet->secrets_by_id) {
+		g_list_free_full (g_hash_table_get_values (applet->secrets_by_id),
+		                  (GDestroyNotify) applet_secrets_request_free);
+	}
+	nm_clear_g_source (&applet->secrets_queue_id);
+	g_clear_pointer (&applet->secrets_by_id, g_hash_table_destroy);
+	g_clear_pointer (&applet->secrets_by_key, g_hash_table_destroy);
+	g_clear_pointer (&applet->secrets_waiters, g_hash_table_destroy);
+	applet_vpn_request_clear_pool ();
 
 	if (applet->notification) {
 		notify_notification_close (applet->notification, NULL);
 		g_object_unref (applet->notification);
 	}
+	if (applet->notify_watch_id) {
+		g_bus_unwatch_name (applet->notify_watch_id);
+		applet->notify_watch_id = 0;
+	}
+	nm_clear_g_cancellable (&applet->notify_caps_cancellable);
 
 	g_clear_object (&applet->info_dialog_ui);
 	g_clear_object (&applet->gsettings);
+	g_clear_pointer (&applet->active_by_path, g_hash_table_destroy);
+	g_clear_pointer (&applet->active_by_device, g_hash_table_destroy);
+	g_clear_pointer (&applet->any_active_by_device, g_hash_table_destroy);
 	g_clear_object (&applet->nm_client);
 
 #if WITH_WWAN
@@ -3396,15 +4982,133 @@ static void finalize (GObject *object)
 static void nma_init (NMApplet *applet)
 {
 	applet->icon_size = 16;
+	applet->update_sections = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+	applet->secrets_by_id = g_hash_table_new (g_direct_hash, g_direct_equal);
+	applet->secrets_by_key = g_hash_table_new (g_str_hash, g_str_equal);
+	applet->secrets_waiters = g_hash_table_new (g_direct_hash, g_direct_equal);
+	applet->menu_item_pool = g_ptr_array_new_with_free_func (g_object_unref);
+
+	applet->active_index_dirty = TRUE;
+	applet->active_by_path = g_hash_table_new_full (g_str_hash, g_str_equal,
+	                                                g_free, g_object_unref);
+	applet->active_by_device = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+	                                                  g_object_unref, g_object_unref);
+	applet->any_active_by_device = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+	                                                      g_object_unref, g_object_unref);
+
+	nma_trace_init ();
 
 	g_signal_connect (applet, "startup", G_CALLBACK (applet_startup), NULL);
 	g_signal_connect (applet, "activate", G_CALLBACK (applet_activate), NULL);
 }
 
+/*****************************************************************************/
+
+/* Private interface for inspecting a running applet; see applet-trace.c */
+static const char debug_introspection_xml[] =
+	"<node>"
+	"  <interface name='org.freedesktop.NetworkManagerApplet.Debug'>"
+	"    <method name='GetStats'>"
+	"      <arg type='a{sv}' name='stats' direction='out'/>"
+	"    </method>"
+	"  </interface>"
+	"</node>";
+
+static void
+debug_method_call (GDBusConnection *connection,
+                   const char *sender,
+                   const char *object_path,
+                   const char *interface_name,
+                   const char *method_name,
+                   GVariant *parameters,
+                   GDBusMethodInvocation *invocation,
+                   gpointer user_data)
+{
+	NMApplet *applet = NM_APPLET (user_data);
+	NMAWifiScanStats *scan_stats = &applet->wifi_scan_stats;
+	GVariantBuilder builder;
+
+	if (strcmp (method_name, "GetStats")) {
+		g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR,
+		                                       G_DBUS_ERROR_UNKNOWN_METHOD,
+		                                       "Unknown method %s", method_name);
+		return;
+	}
+
+	g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
+	nma_trace_add_stats (&builder);
+	g_variant_builder_add (&builder, "{sv}", "wifi-scans-requested",
+	                       g_variant_new_uint64 (scan_stats->requested));
+	g_variant_builder_add (&builder, "{sv}", "wifi-scans-skipped-recent",
+	                       g_variant_new_uint64 (scan_stats->skipped_recent));
+	g_variant_builder_add (&builder, "{sv}", "wifi-scans-skipped-backoff",
+	                       g_variant_new_uint64 (scan_stats->skipped_backoff));
+	g_variant_builder_add (&builder, "{sv}", "wifi-scans-skipped-in-flight",
+	                       g_variant_new_uint64 (scan_stats->skipped_in_flight));
+	g_variant_builder_add (&builder, "{sv}", "wifi-scans-roaming",
+	                       g_variant_new_uint64 (scan_stats->roaming));
+	g_variant_builder_add (&builder, "{sv}", "secrets-requests-pending",
+	                       g_variant_new_uint32 (  g_hash_table_size (applet->secrets_by_id)
+	                                             + g_hash_table_size (applet->secrets_waiters)));
+	g_variant_builder_add (&builder, "{sv}", "secrets-requests-running",
+	                       g_variant_new_uint32 (applet->secrets_running));
+
+	g_dbus_method_invocation_return_value (invocation,
+	                                       g_variant_new ("(a{sv})", &builder));
+}
+
+static const GDBusInterfaceVTable debug_vtable = {
+	debug_method_call,
+};
+
+static gboolean
+nma_dbus_register (GApplication *app,
+                   GDBusConnection *connection,
+                   const char *object_path,
+                   GError **error)
+{
+	NMApplet *applet = NM_APPLET (app);
+	GDBusNodeInfo *info;
+
+	if (!G_APPLICATION_CLASS (nma_parent_class)->dbus_register (app, connection, object_path, error))
+		return FALSE;
+
+	info = g_dbus_node_info_new_for_xml (debug_introspection_xml, NULL);
+	g_assert (info);
+	applet->debug_registration_id = g_dbus_connection_register_object (connection,
+	                                                                   object_path,
+	                                                                   info->interfaces[0],
+	                                                                   &debug_vtable,
+	                                                                   applet,
+	                                                                   NULL,
+	                                                                   error);
+	g_dbus_node_info_unref (info);
+
+	return applet->debug_registration_id != 0;
+}
+
+static void
+nma_dbus_unregister (GApplication *app,
+                     GDBusConnection *connection,
+                     const char *object_path)
+{
+	NMApplet *applet = NM_APPLET (app);
+
+	if (applet->debug_registration_id) {
+		g_dbus_connection_unregister_object (connection, applet->debug_registration_id);
+		applet->debug_registration_id = 0;
+	}
+
+	G_APPLICATION_CLASS (nma_parent_class)->dbus_unregister (app, connection, object_path);
+}
+
 static void nma_class_init (NMAppletClass *klass)
 {
 	GObjectClass *oclass = G_OBJECT_CLASS (klass);
+	GApplicationClass *app_class = G_APPLICATION_CLASS (klass);
 
 	oclass->finalize = finalize;
+	app_class->dbus_register = nma_dbus_register;
+	app_class->dbus_unregister = nma_dbus_unregister;
 }
 
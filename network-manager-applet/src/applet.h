@@ -64,6 +64,25 @@ typedef struct {
 
 typedef struct NMADeviceClass NMADeviceClass;
 
+/* Parts of the UI that applet_schedule_update() can refresh */
+typedef enum {
+	APPLET_UPDATE_TOOLTIP = (1 << 0),
+	APPLET_UPDATE_LINK    = (1 << 1),
+	APPLET_UPDATE_VPN     = (1 << 2),
+	APPLET_UPDATE_MENU    = (1 << 3),
+
+	APPLET_UPDATE_ICON    = APPLET_UPDATE_TOOLTIP | APPLET_UPDATE_LINK | APPLET_UPDATE_VPN,
+} AppletUpdateFlags;
+
+/* Decisions of the Wi-Fi scan scheduler, for debugging */
+typedef struct {
+	guint requested;
+	guint skipped_recent;
+	guint skipped_backoff;
+	guint skipped_in_flight;
+	guint roaming;
+} NMAWifiScanStats;
+
 /*
  * Applet instance data
  *
@@ -83,6 +102,10 @@ typedef struct {
 
 	gboolean visible;
 
+	/* Startup */
+	gint64          startup_time;
+	GCancellable *  warm_up_cancellable;
+
 	/* Permissions */
 	NMClientPermissionResult permissions[NM_CLIENT_PERMISSION_LAST + 1];
 
@@ -95,12 +118,38 @@ typedef struct {
 	NMADeviceClass *bt_class;
 
 	/* Data model elements */
-	guint           update_icon_id;
+	guint           update_id;
+	AppletUpdateFlags update_flags;
+	gint64          update_last;
+	GHashTable *    update_sections;
+	GHashTable *    menu_sections_filter;
 	char *          tip;
+	char *          dev_tip;
+	char *          vpn_tip;
+
+	/* Bumped whenever a connection is added, removed or changed */
+	guint           connections_serial;
+	/* Bumped only when an existing connection changed */
+	guint           connections_modified_serial;
+
+	/* Active connections by connection path and by device; the latter
+	 * without and with VPNs.
+	 */
+	gboolean        active_index_dirty;
+	const GPtrArray *active_index_list;
+	guint           active_index_len;
+	GHashTable *    active_by_path;
+	GHashTable *    active_by_device;
+	GHashTable *    any_active_by_device;
 
 	/* Animation stuff */
 	int             animation_step;
 	guint           animation_id;
+	int             animation_link_stage;
+	gboolean        animation_vpn;
+	gboolean        animation_paused;
+	char *          animation_key;
+	GPtrArray *     animation_frames;
 #define NUM_CONNECTING_FRAMES 11
 #define NUM_VPN_CONNECTING_FRAMES 14
 
@@ -111,12 +160,15 @@ typedef struct {
 
 	/* Active status icon pixbufs */
 	GdkPixbuf *     icon_layers[ICON_LAYER_MAX + 1];
+	char *          icon_layer_names[ICON_LAYER_MAX + 1];
+	GHashTable *    composite_cache;
+	GHashTable *    ap_icon_cache;
+	GHashTable *    ap_surface_cache;
 
 	/* Direct UI elements */
 #ifdef WITH_APPINDICATOR
 	AppIndicator *  app_indicator;
 #endif
-	guint           update_menu_id;
 
 	GtkStatusIcon * status_icon;
 
@@ -133,16 +185,32 @@ typedef struct {
 	GtkWidget *     wwan_enabled_item;
 	guint           wwan_enabled_toggled_id;
 
+	/* Menu items kept for reuse; see applet_menu_item_pool_take() */
+	GPtrArray *     menu_item_pool;
+	GSList *        old_menus;
+	guint           old_menus_id;
+
 	GtkWidget *     info_menu_item;
 	GtkWidget *     connections_menu_item;
 
 	GtkBuilder *    info_dialog_ui;
 	NotifyNotification* notification;
+	guint           notify_watch_id;
+	GCancellable *  notify_caps_cancellable;
+	gboolean        notify_has_actions;
 
 	/* Tracker objects for secrets requests */
-	GSList *        secrets_reqs;
+	GHashTable *    secrets_by_id;
+	GHashTable *    secrets_by_key;
+	GHashTable *    secrets_waiters;
+	GQueue          secrets_queue;
+	guint           secrets_running;
+	guint           secrets_queue_id;
 
 	guint           wifi_scan_id;
+	NMAWifiScanStats wifi_scan_stats;
+
+	guint           debug_registration_id;
 } NMApplet;
 
 typedef void (*AppletNewAutoConnectionCallback) (NMConnection *connection,
@@ -164,6 +232,13 @@ struct _SecretsRequest {
 	gpointer callback_data;
 
 	NMConnection *connection;
+	gint64 trace_start;
+
+	/* Identical requests share this one; see applet_agent_get_secrets_cb() */
+	char *key;
+	GQueue waiters;
+	gboolean started;
+	GList queue_link;
 
 	/* Class-specific stuff */
 	SecretsRequestFreeFunc free_func;
@@ -224,6 +299,8 @@ GType nma_get_type (void);
 
 NMApplet *nm_applet_new (void);
 
+void applet_schedule_update (NMApplet *applet, AppletUpdateFlags flags);
+void applet_schedule_update_device (NMApplet *applet, NMDevice *device);
 void applet_schedule_update_icon (NMApplet *applet);
 void applet_schedule_update_menu (NMApplet *applet);
 
@@ -250,6 +327,31 @@ void applet_menu_item_add_complex_separator_helper (GtkWidget *menu,
                                                     NMApplet *applet,
                                                     const gchar* label);
 
+void applet_menu_item_set_key (GtkWidget *item,
+                               const char *kind,
+                               const char *id);
+
+typedef void (*AppletMenuPopulateFunc) (GtkWidget *submenu, gpointer user_data);
+
+void applet_menu_set_lazy (GtkWidget *submenu,
+                           AppletMenuPopulateFunc populate,
+                           gpointer user_data,
+                           GDestroyNotify destroy);
+
+void applet_menu_ensure_populated (GtkWidget *submenu);
+
+GtkWidget *applet_menu_item_pool_take (NMApplet *applet, GType type);
+
+void applet_menu_recycle (NMApplet *applet, GtkWidget *menu);
+
+void applet_menu_reconcile (GtkMenu *menu, GtkMenu *fresh);
+
+void nma_menu_show_cb (GtkWidget *menu, NMApplet *applet);
+
+void nma_menu_add_devices (GtkWidget *menu, NMApplet *applet);
+
+void nma_menu_add_vpn_submenu (GtkWidget *menu, NMApplet *applet);
+
 GtkWidget*
 applet_menu_item_create_device_item_helper (NMDevice *device,
                                             NMApplet *applet,
@@ -18,6 +18,11 @@
 gboolean shell_debug = FALSE;
 gboolean with_agent = TRUE;
 gboolean with_appindicator = FALSE;
+guint max_refresh_rate = 20;
+guint strength_hysteresis = 3;
+gboolean vpn_auth_pool = FALSE;
+guint max_secrets_requests = 4;
+guint secrets_cache_ttl = 0;
 
 static void
 usage (const char *progname)
@@ -47,6 +52,16 @@ int main (int argc, char *argv[])
 			shell_debug = TRUE;
 		else if (!strcmp (argv[i], "--no-agent"))
 			with_agent = FALSE;
+		else if (g_str_has_prefix (argv[i], "--max-refresh-rate="))
+			max_refresh_rate = strtoul (argv[i] + strlen ("--max-refresh-rate="), NULL, 10);
+		else if (g_str_has_prefix (argv[i], "--strength-hysteresis="))
+			strength_hysteresis = MIN (strtoul (argv[i] + strlen ("--strength-hysteresis="), NULL, 10), 25);
+		else if (g_str_has_prefix (argv[i], "--max-secrets-requests="))
+			max_secrets_requests = MAX (strtoul (argv[i] + strlen ("--max-secrets-requests="), NULL, 10), 1);
+		else if (g_str_has_prefix (argv[i], "--secrets-cache-ttl="))
+			secrets_cache_ttl = MIN (strtoul (argv[i] + strlen ("--secrets-cache-ttl="), NULL, 10), 600);
+		else if (!strcmp (argv[i], "--vpn-auth-pool"))
+			vpn_auth_pool = TRUE;
 		else if (!strcmp (argv[i], "--indicator")) {
 #ifdef WITH_APPINDICATOR
 			with_appindicator = TRUE;
@@ -88,7 +88,14 @@ nm_mb_menu_item_new (const char *connection_name,
 	NMMbMenuItemPrivate *priv;
 	const char *tech_name;
 
-	item = g_object_new (NM_TYPE_MB_MENU_ITEM, NULL);
+	item = (NMMbMenuItem *) applet_menu_item_pool_take (applet, NM_TYPE_MB_MENU_ITEM);
+	if (item) {
+		/* A pooled item; forget what it showed before */
+		priv = NM_MB_MENU_ITEM_GET_PRIVATE (item);
+		g_clear_pointer (&priv->desc_string, g_free);
+		gtk_image_clear (GTK_IMAGE (priv->strength));
+	} else
+		item = g_object_new (NM_TYPE_MB_MENU_ITEM, NULL);
 	g_assert (item);
 
 	priv = NM_MB_MENU_ITEM_GET_PRIVATE (item);
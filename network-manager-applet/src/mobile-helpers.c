@@ -89,19 +89,26 @@ mobile_helper_get_status_pixbuf (guint32 quality,
 	return pixbuf;
 }
 
+const char *
+mobile_helper_get_quality_bucket_icon_name (int bucket)
+{
+	static const char *icon_names[] = {
+		"nm-signal-00",
+		"nm-signal-25",
+		"nm-signal-50",
+		"nm-signal-75",
+		"nm-signal-100",
+	};
+
+	g_return_val_if_fail (bucket >= 0 && bucket < (int) G_N_ELEMENTS (icon_names), icon_names[0]);
+
+	return icon_names[bucket];
+}
+
 const char *
 mobile_helper_get_quality_icon_name (guint32 quality)
 {
-	if (quality > 80)
-		return "nm-signal-100";
-	else if (quality > 55)
-		return "nm-signal-75";
-	else if (quality > 30)
-		return "nm-signal-50";
-	else if (quality > 5)
-		return "nm-signal-25";
-	else
-		return "nm-signal-00";
+	return mobile_helper_get_quality_bucket_icon_name (utils_strength_bucket (quality, -1, 0));
 }
 
 const char *
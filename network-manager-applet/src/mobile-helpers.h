@@ -47,6 +47,7 @@ GdkPixbuf *mobile_helper_get_status_pixbuf (guint32 quality,
                                             NMApplet *applet);
 
 const char *mobile_helper_get_quality_icon_name (guint32 quality);
+const char *mobile_helper_get_quality_bucket_icon_name (int bucket);
 const char *mobile_helper_get_tech_icon_name (guint32 tech);
 
 /********************************************************************/
@@ -0,0 +1,317 @@
+// SPDX-License-Identifier: GPL-2.0+
+/* NetworkManager Applet -- allow user control over networking */
+
+#include "nm-default.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <glib/gstdio.h>
+
+#include "applet-agent.h"
+#include "bench-utils.h"
+
+/* Keyring write benchmark
+ *
+ * Starts a private session bus with a throwaway gnome-keyring-daemon on
+ * it, whose login keyring lives in a temporary directory, and saves the
+ * secrets of a made-up VPN connection through the applet's secret agent a
+ * number of times.  Prints how long each SaveSecrets took, then deletes
+ * the secrets again.  It needs dbus-daemon and gnome-keyring-daemon and
+ * exits with 77 without them.
+ */
+
+#define BENCH_KEYRING_SECRETS 16
+
+typedef struct {
+	GMainLoop *loop;
+	AppletAgent *agent;
+	NMConnection *connection;
+	BenchStat *stat;
+	guint iterations;
+	guint timeout_id;
+	gboolean keyring_up;
+	int status;
+} Bench;
+
+static NMConnection *
+bench_connection (void)
+{
+	gs_free char *uuid = nm_utils_uuid_generate ();
+	NMConnection *connection;
+	NMSetting *setting;
+	guint i;
+
+	connection = nm_simple_connection_new ();
+	/* Agents are only asked to save secrets of exported connections */
+	nm_connection_set_path (connection, NM_DBUS_PATH_SETTINGS "/1");
+
+	setting = nm_setting_connection_new ();
+	g_object_set (setting,
+	              NM_SETTING_CONNECTION_ID, "nm-applet keyring benchmark",
+	              NM_SETTING_CONNECTION_UUID, uuid,
+	              NM_SETTING_CONNECTION_TYPE, NM_SETTING_VPN_SETTING_NAME,
+	              NULL);
+	nm_connection_add_setting (connection, setting);
+
+	setting = nm_setting_vpn_new ();
+	g_object_set (setting,
+	              NM_SETTING_VPN_SERVICE_TYPE, "org.freedesktop.NetworkManager.bench",
+	              NULL);
+	for (i = 0; i < BENCH_KEYRING_SECRETS; i++) {
+		char key[32], value[32];
+
+		g_snprintf (key, sizeof (key), "secret%u", i);
+		g_snprintf (value, sizeof (value), "value%u", i);
+		nm_setting_vpn_add_secret (NM_SETTING_VPN (setting), key, value);
+		nm_setting_set_secret_flags (setting, key, NM_SETTING_SECRET_FLAG_AGENT_OWNED, NULL);
+	}
+	nm_connection_add_setting (connection, setting);
+
+	return connection;
+}
+
+static void bench_save (Bench *bench);
+
+static void
+bench_deleted_cb (NMSecretAgentOld *agent,
+                  NMConnection *connection,
+                  GError *error,
+                  gpointer user_data)
+{
+	Bench *bench = user_data;
+
+	if (error) {
+		g_printerr ("keyring benchmark: deleting the secrets failed: %s\n", error->message);
+		bench->status = EXIT_FAILURE;
+	}
+
+	bench_stat_print (bench->stat, 0);
+	g_main_loop_quit (bench->loop);
+}
+
+static void
+bench_saved_cb (NMSecretAgentOld *agent,
+                NMConnection *connection,
+                GError *error,
+                gpointer user_data)
+{
+	Bench *bench = user_data;
+
+	bench_stat_end (bench->stat);
+
+	if (error) {
+		g_printerr ("keyring benchmark: saving the secrets failed: %s\n", error->message);
+		bench->status = EXIT_FAILURE;
+		g_main_loop_quit (bench->loop);
+		return;
+	}
+
+	if (--bench->iterations)
+		bench_save (bench);
+	else
+		nm_secret_agent_old_delete_secrets (agent, bench->connection, bench_deleted_cb, bench);
+}
+
+static void
+bench_save (Bench *bench)
+{
+	bench_stat_begin (bench->stat);
+	nm_secret_agent_old_save_secrets (NM_SECRET_AGENT_OLD (bench->agent),
+	                                  bench->connection,
+	                                  bench_saved_cb,
+	                                  bench);
+}
+
+/*****************************************************************************/
+
+static void
+keyring_appeared_cb (GDBusConnection *connection,
+                     const char *name,
+                     const char *name_owner,
+                     gpointer user_data)
+{
+	Bench *bench = user_data;
+
+	bench->keyring_up = TRUE;
+	g_main_loop_quit (bench->loop);
+}
+
+static gboolean
+keyring_timeout_cb (gpointer user_data)
+{
+	Bench *bench = user_data;
+
+	bench->timeout_id = 0;
+	g_main_loop_quit (bench->loop);
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean
+keyring_start (GPid *pid, GError **error)
+{
+	const char *argv[] = { "gnome-keyring-daemon", "--foreground", "--components=secrets", "--unlock", NULL };
+	/* The password of the login keyring it creates */
+	const char *password = "bench";
+	gboolean written;
+	int stdin_fd;
+
+	if (!g_spawn_async_with_pipes (NULL, (char **) argv, NULL,
+	                               G_SPAWN_SEARCH_PATH | G_SPAWN_DO_NOT_REAP_CHILD | G_SPAWN_STDOUT_TO_DEV_NULL,
+	                               NULL, NULL, pid, &stdin_fd, NULL, NULL, error))
+		return FALSE;
+
+	written = write (stdin_fd, password, strlen (password)) == (gssize) strlen (password);
+	close (stdin_fd);
+	if (!written) {
+		g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+		             "could not pass the password to gnome-keyring-daemon");
+		kill (*pid, SIGTERM);
+		waitpid (*pid, NULL, 0);
+		g_spawn_close_pid (*pid);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void
+keyring_stop (GPid pid)
+{
+	kill (pid, SIGTERM);
+	waitpid (pid, NULL, 0);
+	g_spawn_close_pid (pid);
+}
+
+static void
+remove_tree (const char *path)
+{
+	GDir *dir;
+
+	if (!g_file_test (path, G_FILE_TEST_IS_SYMLINK)) {
+		dir = g_dir_open (path, 0, NULL);
+		if (dir) {
+			const char *name;
+
+			while ((name = g_dir_read_name (dir))) {
+				gs_free char *child = g_build_filename (path, name, NULL);
+
+				remove_tree (child);
+			}
+			g_dir_close (dir);
+		}
+	}
+	g_remove (path);
+}
+
+/*****************************************************************************/
+
+static int
+run (guint iterations)
+{
+	gs_free_error GError *error = NULL;
+	gs_free char *dbus_daemon = NULL;
+	gs_free char *keyring_daemon = NULL;
+	gs_free char *tmpdir = NULL;
+	GTestDBus *bus;
+	GPid keyring_pid;
+	guint watch_id;
+	Bench bench = {
+		.iterations = iterations,
+		.status = EXIT_SUCCESS,
+	};
+
+	dbus_daemon = g_find_program_in_path ("dbus-daemon");
+	keyring_daemon = g_find_program_in_path ("gnome-keyring-daemon");
+	if (!dbus_daemon || !keyring_daemon) {
+		g_print ("keyring benchmark: skipped, needs dbus-daemon and gnome-keyring-daemon\n");
+		return 77;
+	}
+
+	tmpdir = g_dir_make_tmp ("nma-bench-keyring-XXXXXX", &error);
+	if (!tmpdir) {
+		g_printerr ("keyring benchmark: %s\n", error->message);
+		return EXIT_FAILURE;
+	}
+
+	/* The keyring files go to $XDG_DATA_HOME/keyrings, the control socket
+	 * to $XDG_RUNTIME_DIR, which g_test_dbus_up() unsets.  The agent
+	 * must not find the system's NetworkManager.
+	 */
+	g_setenv ("XDG_DATA_HOME", tmpdir, TRUE);
+	g_setenv ("LIBNM_USE_SESSION_BUS", "1", TRUE);
+	bus = g_test_dbus_new (G_TEST_DBUS_NONE);
+	g_test_dbus_up (bus);
+	g_setenv ("XDG_RUNTIME_DIR", tmpdir, TRUE);
+
+	if (!keyring_start (&keyring_pid, &error)) {
+		g_printerr ("keyring benchmark: could not start gnome-keyring-daemon: %s\n", error->message);
+		g_test_dbus_stop (bus);
+		g_object_unref (bus);
+		remove_tree (tmpdir);
+		return EXIT_FAILURE;
+	}
+
+	bench.loop = g_main_loop_new (NULL, FALSE);
+
+	watch_id = g_bus_watch_name (G_BUS_TYPE_SESSION, "org.freedesktop.secrets",
+	                             G_BUS_NAME_WATCHER_FLAGS_NONE,
+	                             keyring_appeared_cb, NULL, &bench, NULL);
+	bench.timeout_id = g_timeout_add_seconds (10, keyring_timeout_cb, &bench);
+	g_main_loop_run (bench.loop);
+	g_bus_unwatch_name (watch_id);
+	nm_clear_g_source (&bench.timeout_id);
+
+	if (!bench.keyring_up) {
+		g_printerr ("keyring benchmark: gnome-keyring-daemon did not show up on the bus\n");
+		bench.status = EXIT_FAILURE;
+		goto out;
+	}
+
+	bench.agent = applet_agent_new (&error);
+	if (!bench.agent) {
+		g_printerr ("keyring benchmark: could not create the secret agent: %s\n", error->message);
+		bench.status = EXIT_FAILURE;
+		goto out;
+	}
+
+	g_print ("keyring benchmark: %u secrets per save, %u iterations\n",
+	         BENCH_KEYRING_SECRETS, iterations);
+
+	bench.connection = bench_connection ();
+	bench.stat = bench_stat_new ("save");
+	bench_save (&bench);
+	g_main_loop_run (bench.loop);
+
+out:
+	g_clear_pointer (&bench.stat, bench_stat_free);
+	g_clear_object (&bench.connection);
+	g_clear_object (&bench.agent);
+	g_main_loop_unref (bench.loop);
+	keyring_stop (keyring_pid);
+	g_test_dbus_stop (bus);
+	g_object_unref (bus);
+	remove_tree (tmpdir);
+
+	return bench.status;
+}
+
+int
+main (int argc, char *argv[])
+{
+	guint iterations = 20;
+	guint i;
+
+	for (i = 1; i < argc; i++) {
+		if (g_str_has_prefix (argv[i], "--iterations="))
+			iterations = MAX (strtoul (argv[i] + strlen ("--iterations="), NULL, 10), 1);
+		else {
+			g_printerr ("Usage: %s [--iterations=N]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	return run (iterations);
+}
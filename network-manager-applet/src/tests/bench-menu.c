@@ -0,0 +1,333 @@
+// SPDX-License-Identifier: GPL-2.0+
+/* NetworkManager Applet -- allow user control over networking */
+
+#include "nm-default.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "applet.h"
+#include "bench-utils.h"
+#include "fake-nm.h"
+
+/* Menu building benchmark
+ *
+ * Starts a private session bus with a fake NetworkManager on it, runs the
+ * applet against it and times building the tray menu a number of times:
+ * the full menu, only the device sections, only the VPN submenu, and
+ * refreshing an already shown menu.  Without --scenario every scenario is
+ * run in a child process of its own.  It needs dbus-daemon and an X
+ * display and exits with 77 without them.
+ */
+
+/* What src/main.c sets from the command line */
+gboolean shell_debug = FALSE;
+gboolean with_agent = FALSE;
+gboolean with_appindicator = FALSE;
+guint max_refresh_rate = 20;
+guint strength_hysteresis = 3;
+gboolean vpn_auth_pool = FALSE;
+guint max_secrets_requests = 4;
+guint secrets_cache_ttl = 0;
+
+static const FakeNMScenario scenarios[] = {
+	{ "home",   1, 1,  15,  12,   5,  1 },
+	{ "office", 1, 1, 120,  40,  30,  8 },
+	{ "dense",  2, 2, 400, 150, 150, 40 },
+};
+
+typedef struct {
+	NMApplet *applet;
+	const FakeNMScenario *scenario;
+	guint iterations;
+	guint polls;
+	int status;
+} Bench;
+
+static guint
+bench_count_widgets (GtkWidget *menu)
+{
+	GList *children, *iter;
+	guint n = 0;
+
+	children = gtk_container_get_children (GTK_CONTAINER (menu));
+	for (iter = children; iter; iter = g_list_next (iter)) {
+		GtkWidget *submenu = gtk_menu_item_get_submenu (GTK_MENU_ITEM (iter->data));
+
+		n++;
+		if (submenu)
+			n += bench_count_widgets (submenu);
+	}
+	g_list_free (children);
+	return n;
+}
+
+static GtkWidget *
+bench_new_menu (void)
+{
+	GtkWidget *menu = gtk_menu_new ();
+
+	g_object_ref_sink (menu);
+	return menu;
+}
+
+static void
+bench_free_menu (NMApplet *applet, GtkWidget *menu)
+{
+	applet_menu_recycle (applet, menu);
+	gtk_widget_destroy (menu);
+	g_object_unref (menu);
+}
+
+/* Checks that the client sees what the fake service exports */
+static gboolean
+bench_check_client (Bench *bench)
+{
+	const FakeNMScenario *scenario = bench->scenario;
+	const GPtrArray *devices;
+	gs_unref_ptrarray GPtrArray *connections = NULL;
+	guint i, n_wifi = 0, n_aps = 0;
+
+	devices = nm_client_get_devices (bench->applet->nm_client);
+	for (i = 0; devices && i < devices->len; i++) {
+		if (NM_IS_DEVICE_WIFI (devices->pdata[i])) {
+			const GPtrArray *aps = nm_device_wifi_get_access_points (devices->pdata[i]);
+
+			n_wifi++;
+			n_aps += aps ? aps->len : 0;
+		}
+	}
+	connections = applet_get_all_connections (bench->applet);
+
+	g_print ("menu benchmark (%s): %u devices (%u Wi-Fi, %u APs), %u connections, %u VPNs, %u iterations\n",
+	         scenario->name, devices ? devices->len : 0, n_wifi, n_aps,
+	         connections->len, scenario->n_vpns, bench->iterations);
+
+	return    devices
+	       && devices->len == scenario->n_ethernet + scenario->n_wifi
+	       && n_wifi == scenario->n_wifi
+	       && n_aps == scenario->n_wifi * scenario->n_aps
+	       && connections->len == scenario->n_ethernet + scenario->n_connections + scenario->n_vpns;
+}
+
+static void
+bench_run (Bench *bench)
+{
+	NMApplet *applet = bench->applet;
+	BenchStat *s_full, *s_devices, *s_vpn, *s_refresh;
+	guint n_full = 0, n_devices = 0, n_vpn = 0;
+	GtkWidget *menu, *shown;
+	guint i;
+
+	s_full = bench_stat_new ("full");
+	s_devices = bench_stat_new ("devices");
+	s_vpn = bench_stat_new ("vpn");
+	s_refresh = bench_stat_new ("refresh");
+
+	shown = bench_new_menu ();
+	nma_menu_show_cb (shown, applet);
+
+	for (i = 0; i < bench->iterations; i++) {
+		menu = bench_new_menu ();
+		bench_stat_begin (s_full);
+		nma_menu_show_cb (menu, applet);
+		bench_stat_end (s_full);
+		n_full = bench_count_widgets (menu);
+		bench_free_menu (applet, menu);
+
+		menu = bench_new_menu ();
+		bench_stat_begin (s_devices);
+		nma_menu_add_devices (menu, applet);
+		bench_stat_end (s_devices);
+		n_devices = bench_count_widgets (menu);
+		bench_free_menu (applet, menu);
+
+		menu = bench_new_menu ();
+		bench_stat_begin (s_vpn);
+		nma_menu_add_vpn_submenu (menu, applet);
+		bench_stat_end (s_vpn);
+		n_vpn = bench_count_widgets (menu);
+		bench_free_menu (applet, menu);
+
+		/* Refreshing an open menu when nothing changed */
+		menu = bench_new_menu ();
+		bench_stat_begin (s_refresh);
+		nma_menu_show_cb (menu, applet);
+		applet_menu_reconcile (GTK_MENU (shown), GTK_MENU (menu));
+		bench_stat_end (s_refresh);
+		bench_free_menu (applet, menu);
+	}
+
+	bench_stat_print (s_full, n_full);
+	bench_stat_print (s_devices, n_devices);
+	bench_stat_print (s_vpn, n_vpn);
+	bench_stat_print (s_refresh, bench_count_widgets (shown));
+
+	bench_free_menu (applet, shown);
+	bench_stat_free (s_full);
+	bench_stat_free (s_devices);
+	bench_stat_free (s_vpn);
+	bench_stat_free (s_refresh);
+}
+
+static gboolean
+bench_wait_for_client (gpointer user_data)
+{
+	Bench *bench = user_data;
+
+	if (!bench->applet->nm_client) {
+		/* Give up after 10 seconds */
+		if (++bench->polls < 1000)
+			return G_SOURCE_CONTINUE;
+		g_printerr ("menu benchmark: the applet did not connect to the fake NetworkManager\n");
+		bench->status = EXIT_FAILURE;
+	} else if (!bench_check_client (bench)) {
+		g_printerr ("menu benchmark: the client doesn't match the scenario\n");
+		bench->status = EXIT_FAILURE;
+	} else
+		bench_run (bench);
+
+	g_application_quit (G_APPLICATION (bench->applet));
+	return G_SOURCE_REMOVE;
+}
+
+static int
+run_scenario (const FakeNMScenario *scenario, guint iterations)
+{
+	gs_free_error GError *error = NULL;
+	gs_free char *dbus_daemon = NULL;
+	gs_free char *display = NULL;
+	GTestDBus *bus;
+	FakeNM *fake;
+	Bench bench = {
+		.scenario = scenario,
+		.iterations = iterations,
+		.status = EXIT_SUCCESS,
+	};
+
+	dbus_daemon = g_find_program_in_path ("dbus-daemon");
+	if (!dbus_daemon) {
+		g_print ("menu benchmark: skipped, dbus-daemon is not available\n");
+		return 77;
+	}
+
+	/* Keep the applet away from the user's settings and NetworkManager */
+	g_setenv ("GSETTINGS_BACKEND", "memory", TRUE);
+	g_setenv ("LIBNM_USE_SESSION_BUS", "1", TRUE);
+	g_setenv ("NO_AT_BRIDGE", "1", TRUE);
+
+	/* g_test_dbus_up() unsets DISPLAY */
+	display = g_strdup (g_getenv ("DISPLAY"));
+	bus = g_test_dbus_new (G_TEST_DBUS_NONE);
+	g_test_dbus_up (bus);
+	if (display)
+		g_setenv ("DISPLAY", display, TRUE);
+
+	gdk_set_allowed_backends ("x11,*");
+	if (!gtk_init_check (NULL, NULL)) {
+		g_print ("menu benchmark: skipped, no display\n");
+		g_test_dbus_stop (bus);
+		g_object_unref (bus);
+		return 77;
+	}
+
+	fake = fake_nm_new (scenario, &error);
+	if (!fake) {
+		g_printerr ("menu benchmark: could not start the fake NetworkManager: %s\n", error->message);
+		g_test_dbus_stop (bus);
+		g_object_unref (bus);
+		return EXIT_FAILURE;
+	}
+
+	/* The bus is private anyway; don't let an applet elsewhere matter */
+	bench.applet = g_object_new (NM_TYPE_APPLET,
+	                             "application-id", "org.freedesktop.network-manager-applet",
+	                             "flags", G_APPLICATION_NON_UNIQUE,
+	                             NULL);
+	g_timeout_add (10, bench_wait_for_client, &bench);
+	if (g_application_run (G_APPLICATION (bench.applet), 0, NULL) != 0)
+		bench.status = EXIT_FAILURE;
+	g_object_unref (bench.applet);
+
+	fake_nm_free (fake);
+	g_test_dbus_stop (bus);
+	g_object_unref (bus);
+
+	return bench.status;
+}
+
+static int
+run_all (const char *progname, guint iterations)
+{
+	gs_free char *iterations_arg = g_strdup_printf ("--iterations=%u", iterations);
+	int status = EXIT_SUCCESS;
+	guint i;
+
+	/* Let the allocation counters see GSlice allocations too */
+	g_setenv ("G_SLICE", "always-malloc", TRUE);
+
+	for (i = 0; i < G_N_ELEMENTS (scenarios); i++) {
+		gs_free_error GError *error = NULL;
+		gs_free char *scenario_arg = g_strdup_printf ("--scenario=%s", scenarios[i].name);
+		char *argv[] = { (char *) progname, scenario_arg, iterations_arg, NULL };
+		int child_status;
+
+		if (!g_spawn_sync (NULL, argv, NULL, G_SPAWN_SEARCH_PATH, NULL, NULL,
+		                   NULL, NULL, &child_status, &error)) {
+			g_printerr ("menu benchmark: could not run %s: %s\n", progname, error->message);
+			return EXIT_FAILURE;
+		}
+
+		if (!g_spawn_check_exit_status (child_status, &error)) {
+			/* A skip applies to every scenario */
+			if (error->domain == G_SPAWN_EXIT_ERROR && error->code == 77)
+				return 77;
+			status = EXIT_FAILURE;
+		}
+	}
+
+	return status;
+}
+
+static void
+usage (const char *progname)
+{
+	guint i;
+
+	g_printerr ("Usage: %s [--scenario=NAME] [--iterations=N]\n\nScenarios:", progname);
+	for (i = 0; i < G_N_ELEMENTS (scenarios); i++)
+		g_printerr (" %s", scenarios[i].name);
+	g_printerr ("\n");
+}
+
+int
+main (int argc, char *argv[])
+{
+	const FakeNMScenario *scenario = NULL;
+	guint iterations = 20;
+	guint i, j;
+
+	for (i = 1; i < argc; i++) {
+		if (g_str_has_prefix (argv[i], "--scenario=")) {
+			const char *name = argv[i] + strlen ("--scenario=");
+
+			for (j = 0; j < G_N_ELEMENTS (scenarios); j++) {
+				if (!strcmp (scenarios[j].name, name))
+					scenario = &scenarios[j];
+			}
+			if (!scenario) {
+				usage (argv[0]);
+				return EXIT_FAILURE;
+			}
+		} else if (g_str_has_prefix (argv[i], "--iterations="))
+			iterations = MAX (strtoul (argv[i] + strlen ("--iterations="), NULL, 10), 1);
+		else {
+			usage (argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (!scenario)
+		return run_all (argv[0], iterations);
+	return run_scenario (scenario, iterations);
+}
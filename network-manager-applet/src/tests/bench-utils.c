@@ -0,0 +1,166 @@
+// SPDX-License-Identifier: GPL-2.0+
+/* NetworkManager Applet -- allow user control over networking */
+
+#include "nm-default.h"
+
+#include "bench-utils.h"
+
+/* Allocations are counted by wrapping glibc's malloc(), calloc() and
+ * realloc() in the benchmark binary itself.  Only allocations made by the
+ * thread that called bench_stat_begin() are counted, so work handed to the
+ * GDBus worker or to GTask threads doesn't show up.  GSlice keeps its own
+ * magazines unless G_SLICE=always-malloc is set in the environment.
+ */
+#ifdef __GLIBC__
+#define BENCH_COUNT_ALLOCS 1
+
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t nmemb, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+
+static __thread gboolean alloc_counting;
+static __thread guint64 alloc_count;
+static __thread guint64 alloc_bytes;
+
+void *
+malloc (size_t size)
+{
+	if (alloc_counting) {
+		alloc_count++;
+		alloc_bytes += size;
+	}
+	return __libc_malloc (size);
+}
+
+void *
+calloc (size_t nmemb, size_t size)
+{
+	if (alloc_counting) {
+		alloc_count++;
+		alloc_bytes += nmemb * size;
+	}
+	return __libc_calloc (nmemb, size);
+}
+
+void *
+realloc (void *ptr, size_t size)
+{
+	if (alloc_counting) {
+		alloc_count++;
+		alloc_bytes += size;
+	}
+	return __libc_realloc (ptr, size);
+}
+#else
+#define BENCH_COUNT_ALLOCS 0
+#endif
+
+struct _BenchStat {
+	char *what;
+	GArray *times;
+	GArray *allocs;
+	GArray *bytes;
+
+	gint64 start;
+	guint64 start_allocs;
+	guint64 start_bytes;
+};
+
+BenchStat *
+bench_stat_new (const char *what)
+{
+	BenchStat *stat;
+
+	stat = g_slice_new0 (BenchStat);
+	stat->what = g_strdup (what);
+	stat->times = g_array_new (FALSE, FALSE, sizeof (guint64));
+	stat->allocs = g_array_new (FALSE, FALSE, sizeof (guint64));
+	stat->bytes = g_array_new (FALSE, FALSE, sizeof (guint64));
+	return stat;
+}
+
+void
+bench_stat_free (BenchStat *stat)
+{
+	g_free (stat->what);
+	g_array_unref (stat->times);
+	g_array_unref (stat->allocs);
+	g_array_unref (stat->bytes);
+	g_slice_free (BenchStat, stat);
+}
+
+void
+bench_stat_begin (BenchStat *stat)
+{
+#if BENCH_COUNT_ALLOCS
+	alloc_counting = TRUE;
+	stat->start_allocs = alloc_count;
+	stat->start_bytes = alloc_bytes;
+#endif
+	stat->start = g_get_monotonic_time ();
+}
+
+void
+bench_stat_end (BenchStat *stat)
+{
+	guint64 t = g_get_monotonic_time () - stat->start;
+
+	g_array_append_val (stat->times, t);
+#if BENCH_COUNT_ALLOCS
+	{
+		guint64 allocs = alloc_count - stat->start_allocs;
+		guint64 bytes = alloc_bytes - stat->start_bytes;
+
+		alloc_counting = FALSE;
+		g_array_append_val (stat->allocs, allocs);
+		g_array_append_val (stat->bytes, bytes);
+	}
+#endif
+}
+
+static int
+compare_samples (gconstpointer a, gconstpointer b)
+{
+	guint64 sa = *(const guint64 *) a;
+	guint64 sb = *(const guint64 *) b;
+
+	return sa < sb ? -1 : (sa > sb);
+}
+
+static guint64
+median (GArray *samples)
+{
+	g_array_sort (samples, compare_samples);
+	return g_array_index (samples, guint64, samples->len / 2);
+}
+
+/* Prints the min/median/max time and the median number of allocations
+ * and allocated bytes of the runs so far; @n_items goes into a trailing
+ * column unless it's 0.
+ */
+void
+bench_stat_print (BenchStat *stat, guint n_items)
+{
+	GString *line;
+	guint64 t;
+
+	g_return_if_fail (stat->times->len > 0);
+
+	line = g_string_new (NULL);
+	t = median (stat->times);
+	g_string_append_printf (line, "  %-10s min %8.3f ms  median %8.3f ms  max %8.3f ms",
+	                        stat->what,
+	                        g_array_index (stat->times, guint64, 0) / 1000.0,
+	                        t / 1000.0,
+	                        g_array_index (stat->times, guint64, stat->times->len - 1) / 1000.0);
+	if (stat->allocs->len) {
+		g_string_append_printf (line, "  %7" G_GUINT64_FORMAT " allocs  %9" G_GUINT64_FORMAT " bytes",
+		                        median (stat->allocs),
+		                        median (stat->bytes));
+	}
+	if (n_items)
+		g_string_append_printf (line, "  %5u items", n_items);
+
+	g_print ("%s\n", line->str);
+	g_string_free (line, TRUE);
+}
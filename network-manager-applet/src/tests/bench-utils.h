@@ -0,0 +1,19 @@
+// SPDX-License-Identifier: GPL-2.0+
+/* NetworkManager Applet -- allow user control over networking */
+
+#ifndef BENCH_UTILS_H
+#define BENCH_UTILS_H
+
+typedef struct _BenchStat BenchStat;
+
+BenchStat *bench_stat_new (const char *what);
+
+void bench_stat_free (BenchStat *stat);
+
+void bench_stat_begin (BenchStat *stat);
+
+void bench_stat_end (BenchStat *stat);
+
+void bench_stat_print (BenchStat *stat, guint n_items);
+
+#endif  /* BENCH_UTILS_H */
@@ -0,0 +1,863 @@
+// SPDX-License-Identifier: GPL-2.0+
+/* NetworkManager Applet -- allow user control over networking */
+
+#include "nm-default.h"
+
+#include <string.h>
+
+#include "fake-nm.h"
+
+/* A stand-in for NetworkManager on the session bus, good enough for
+ * NMClient (with LIBNM_USE_SESSION_BUS=1) to come up with a generated set
+ * of devices, access points, connections and an active Wi-Fi connection.
+ * Everything is exported once through the ObjectManager and never
+ * changes; methods the applet may call in passing succeed without doing
+ * anything.  The service runs its own main context in a thread so that
+ * the client side can block on it.
+ */
+
+static const char introspection_xml[] =
+	"<node>"
+	"  <interface name='org.freedesktop.DBus.ObjectManager'>"
+	"    <method name='GetManagedObjects'>"
+	"      <arg type='a{oa{sa{sv}}}' name='objects' direction='out'/>"
+	"    </method>"
+	"  </interface>"
+	"  <interface name='" NM_DBUS_INTERFACE "'>"
+	"    <method name='GetPermissions'>"
+	"      <arg type='a{ss}' name='permissions' direction='out'/>"
+	"    </method>"
+	"    <method name='GetDevices'>"
+	"      <arg type='ao' name='devices' direction='out'/>"
+	"    </method>"
+	"    <method name='GetAllDevices'>"
+	"      <arg type='ao' name='devices' direction='out'/>"
+	"    </method>"
+	"    <property name='Devices' type='ao' access='read'/>"
+	"    <property name='AllDevices' type='ao' access='read'/>"
+	"    <property name='Checkpoints' type='ao' access='read'/>"
+	"    <property name='NetworkingEnabled' type='b' access='read'/>"
+	"    <property name='WirelessEnabled' type='b' access='read'/>"
+	"    <property name='WirelessHardwareEnabled' type='b' access='read'/>"
+	"    <property name='WwanEnabled' type='b' access='read'/>"
+	"    <property name='WwanHardwareEnabled' type='b' access='read'/>"
+	"    <property name='ActiveConnections' type='ao' access='read'/>"
+	"    <property name='PrimaryConnection' type='o' access='read'/>"
+	"    <property name='PrimaryConnectionType' type='s' access='read'/>"
+	"    <property name='ActivatingConnection' type='o' access='read'/>"
+	"    <property name='Startup' type='b' access='read'/>"
+	"    <property name='Version' type='s' access='read'/>"
+	"    <property name='State' type='u' access='read'/>"
+	"    <property name='Connectivity' type='u' access='read'/>"
+	"  </interface>"
+	"  <interface name='" NM_DBUS_INTERFACE_SETTINGS "'>"
+	"    <method name='ListConnections'>"
+	"      <arg type='ao' name='connections' direction='out'/>"
+	"    </method>"
+	"    <property name='Connections' type='ao' access='read'/>"
+	"    <property name='Hostname' type='s' access='read'/>"
+	"    <property name='CanModify' type='b' access='read'/>"
+	"  </interface>"
+	"  <interface name='" NM_DBUS_INTERFACE_SETTINGS_CONNECTION "'>"
+	"    <method name='GetSettings'>"
+	"      <arg type='a{sa{sv}}' name='settings' direction='out'/>"
+	"    </method>"
+	"    <method name='GetSecrets'>"
+	"      <arg type='s' name='setting_name' direction='in'/>"
+	"      <arg type='a{sa{sv}}' name='secrets' direction='out'/>"
+	"    </method>"
+	"    <property name='Unsaved' type='b' access='read'/>"
+	"    <property name='Flags' type='u' access='read'/>"
+	"    <property name='Filename' type='s' access='read'/>"
+	"  </interface>"
+	"  <interface name='" NM_DBUS_INTERFACE_DNS_MANAGER "'>"
+	"    <property name='Mode' type='s' access='read'/>"
+	"    <property name='RcManager' type='s' access='read'/>"
+	"    <property name='Configuration' type='aa{sv}' access='read'/>"
+	"  </interface>"
+	"  <interface name='" NM_DBUS_INTERFACE_DEVICE "'>"
+	"    <property name='Udi' type='s' access='read'/>"
+	"    <property name='Interface' type='s' access='read'/>"
+	"    <property name='IpInterface' type='s' access='read'/>"
+	"    <property name='Driver' type='s' access='read'/>"
+	"    <property name='Capabilities' type='u' access='read'/>"
+	"    <property name='State' type='u' access='read'/>"
+	"    <property name='StateReason' type='(uu)' access='read'/>"
+	"    <property name='ActiveConnection' type='o' access='read'/>"
+	"    <property name='Ip4Config' type='o' access='read'/>"
+	"    <property name='Dhcp4Config' type='o' access='read'/>"
+	"    <property name='Ip6Config' type='o' access='read'/>"
+	"    <property name='Dhcp6Config' type='o' access='read'/>"
+	"    <property name='Managed' type='b' access='read'/>"
+	"    <property name='Autoconnect' type='b' access='read'/>"
+	"    <property name='DeviceType' type='u' access='read'/>"
+	"    <property name='AvailableConnections' type='ao' access='read'/>"
+	"    <property name='Mtu' type='u' access='read'/>"
+	"    <property name='Real' type='b' access='read'/>"
+	"  </interface>"
+	"  <interface name='" NM_DBUS_INTERFACE_DEVICE_WIRED "'>"
+	"    <property name='HwAddress' type='s' access='read'/>"
+	"    <property name='PermHwAddress' type='s' access='read'/>"
+	"    <property name='Speed' type='u' access='read'/>"
+	"    <property name='Carrier' type='b' access='read'/>"
+	"  </interface>"
+	"  <interface name='" NM_DBUS_INTERFACE_DEVICE_WIRELESS "'>"
+	"    <method name='GetAccessPoints'>"
+	"      <arg type='ao' name='access_points' direction='out'/>"
+	"    </method>"
+	"    <method name='GetAllAccessPoints'>"
+	"      <arg type='ao' name='access_points' direction='out'/>"
+	"    </method>"
+	"    <method name='RequestScan'>"
+	"      <arg type='a{sv}' name='options' direction='in'/>"
+	"    </method>"
+	"    <property name='HwAddress' type='s' access='read'/>"
+	"    <property name='PermHwAddress' type='s' access='read'/>"
+	"    <property name='Mode' type='u' access='read'/>"
+	"    <property name='Bitrate' type='u' access='read'/>"
+	"    <property name='AccessPoints' type='ao' access='read'/>"
+	"    <property name='ActiveAccessPoint' type='o' access='read'/>"
+	"    <property name='WirelessCapabilities' type='u' access='read'/>"
+	"    <property name='LastScan' type='x' access='read'/>"
+	"  </interface>"
+	"  <interface name='" NM_DBUS_INTERFACE_ACCESS_POINT "'>"
+	"    <property name='Flags' type='u' access='read'/>"
+	"    <property name='WpaFlags' type='u' access='read'/>"
+	"    <property name='RsnFlags' type='u' access='read'/>"
+	"    <property name='Ssid' type='ay' access='read'/>"
+	"    <property name='Frequency' type='u' access='read'/>"
+	"    <property name='HwAddress' type='s' access='read'/>"
+	"    <property name='Mode' type='u' access='read'/>"
+	"    <property name='MaxBitrate' type='u' access='read'/>"
+	"    <property name='Strength' type='y' access='read'/>"
+	"    <property name='LastSeen' type='i' access='read'/>"
+	"  </interface>"
+	"  <interface name='" NM_DBUS_INTERFACE_ACTIVE_CONNECTION "'>"
+	"    <property name='Connection' type='o' access='read'/>"
+	"    <property name='SpecificObject' type='o' access='read'/>"
+	"    <property name='Id' type='s' access='read'/>"
+	"    <property name='Uuid' type='s' access='read'/>"
+	"    <property name='Type' type='s' access='read'/>"
+	"    <property name='Devices' type='ao' access='read'/>"
+	"    <property name='State' type='u' access='read'/>"
+	"    <property name='Default' type='b' access='read'/>"
+	"    <property name='Default6' type='b' access='read'/>"
+	"    <property name='Vpn' type='b' access='read'/>"
+	"    <property name='Master' type='o' access='read'/>"
+	"  </interface>"
+	"</node>";
+
+typedef struct _FakeObject FakeObject;
+
+typedef struct {
+	FakeNM *fake;
+	GDBusInterfaceInfo *info;
+	GVariant *props;
+	GVariant *settings;
+	guint registration_id;
+} FakeInterface;
+
+struct _FakeObject {
+	char *path;
+	GPtrArray *interfaces;
+};
+
+struct _FakeNM {
+	GDBusNodeInfo *node_info;
+	GPtrArray *objects;
+	FakeInterface *object_manager;
+	guint n_ssids;
+
+	GMainContext *context;
+	GMainLoop *loop;
+	GThread *thread;
+	GDBusConnection *connection;
+};
+
+/*****************************************************************************/
+
+static FakeInterface *
+fake_interface_new (FakeNM *fake, const char *name, GVariantBuilder *props)
+{
+	FakeInterface *iface;
+
+	iface = g_slice_new0 (FakeInterface);
+	iface->fake = fake;
+	iface->info = g_dbus_node_info_lookup_interface (fake->node_info, name);
+	g_assert (iface->info);
+	iface->props = g_variant_ref_sink (g_variant_builder_end (props));
+	return iface;
+}
+
+static void
+fake_interface_free (FakeInterface *iface)
+{
+	if (iface->registration_id)
+		g_dbus_connection_unregister_object (iface->fake->connection, iface->registration_id);
+	g_variant_unref (iface->props);
+	if (iface->settings)
+		g_variant_unref (iface->settings);
+	g_slice_free (FakeInterface, iface);
+}
+
+static FakeObject *
+fake_object_new (FakeNM *fake, const char *path)
+{
+	FakeObject *object;
+
+	object = g_slice_new0 (FakeObject);
+	object->path = g_strdup (path);
+	object->interfaces = g_ptr_array_new_with_free_func ((GDestroyNotify) fake_interface_free);
+	g_ptr_array_add (fake->objects, object);
+	return object;
+}
+
+static void
+fake_object_free (FakeObject *object)
+{
+	g_ptr_array_unref (object->interfaces);
+	g_free (object->path);
+	g_slice_free (FakeObject, object);
+}
+
+static FakeInterface *
+fake_object_add (FakeObject *object, FakeNM *fake, const char *name, GVariantBuilder *props)
+{
+	FakeInterface *iface = fake_interface_new (fake, name, props);
+
+	g_ptr_array_add (object->interfaces, iface);
+	return iface;
+}
+
+static GVariant *
+object_paths (GPtrArray *paths)
+{
+	return g_variant_new_objv ((const char *const *) paths->pdata, paths->len);
+}
+
+/*****************************************************************************/
+
+static GVariant *
+managed_objects (FakeNM *fake)
+{
+	GVariantBuilder objects, interfaces;
+	guint i, j;
+
+	g_variant_builder_init (&objects, G_VARIANT_TYPE ("a{oa{sa{sv}}}"));
+	for (i = 0; i < fake->objects->len; i++) {
+		FakeObject *object = fake->objects->pdata[i];
+
+		g_variant_builder_init (&interfaces, G_VARIANT_TYPE ("a{sa{sv}}"));
+		for (j = 0; j < object->interfaces->len; j++) {
+			FakeInterface *iface = object->interfaces->pdata[j];
+
+			g_variant_builder_add (&interfaces, "{s@a{sv}}", iface->info->name, iface->props);
+		}
+		g_variant_builder_add (&objects, "{oa{sa{sv}}}", object->path, &interfaces);
+	}
+
+	return g_variant_new ("(a{oa{sa{sv}}})", &objects);
+}
+
+/* Methods that just return one of the object's properties */
+static const struct {
+	const char *method;
+	const char *property;
+} list_methods[] = {
+	{ "GetDevices",         "Devices" },
+	{ "GetAllDevices",      "AllDevices" },
+	{ "ListConnections",    "Connections" },
+	{ "GetAccessPoints",    "AccessPoints" },
+	{ "GetAllAccessPoints", "AccessPoints" },
+};
+
+static void
+fake_method_call (GDBusConnection *connection,
+                  const char *sender,
+                  const char *object_path,
+                  const char *interface_name,
+                  const char *method_name,
+                  GVariant *parameters,
+                  GDBusMethodInvocation *invocation,
+                  gpointer user_data)
+{
+	FakeInterface *iface = user_data;
+	const GDBusMethodInfo *info;
+	guint i;
+
+	if (!strcmp (method_name, "GetManagedObjects")) {
+		g_dbus_method_invocation_return_value (invocation, managed_objects (iface->fake));
+		return;
+	}
+
+	if (!strcmp (method_name, "GetSettings")) {
+		g_dbus_method_invocation_return_value (invocation,
+		                                       g_variant_new ("(@a{sa{sv}})", iface->settings));
+		return;
+	}
+
+	if (!strcmp (method_name, "GetSecrets")) {
+		g_dbus_method_invocation_return_value (invocation, g_variant_new ("(a{sa{sv}})", NULL));
+		return;
+	}
+
+	if (!strcmp (method_name, "GetPermissions")) {
+		g_dbus_method_invocation_return_value (invocation, g_variant_new ("(a{ss})", NULL));
+		return;
+	}
+
+	for (i = 0; i < G_N_ELEMENTS (list_methods); i++) {
+		if (!strcmp (method_name, list_methods[i].method)) {
+			gs_unref_variant GVariant *value = NULL;
+
+			value = g_variant_lookup_value (iface->props, list_methods[i].property, NULL);
+			g_dbus_method_invocation_return_value (invocation, g_variant_new_tuple (&value, 1));
+			return;
+		}
+	}
+
+	/* Requests like RequestScan succeed and do nothing */
+	info = g_dbus_method_invocation_get_method_info (invocation);
+	if (!info->out_args || !info->out_args[0]) {
+		g_dbus_method_invocation_return_value (invocation, NULL);
+		return;
+	}
+
+	g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR,
+	                                       G_DBUS_ERROR_NOT_SUPPORTED,
+	                                       "%s is not implemented", method_name);
+}
+
+static GVariant *
+fake_get_property (GDBusConnection *connection,
+                   const char *sender,
+                   const char *object_path,
+                   const char *interface_name,
+                   const char *property_name,
+                   GError **error,
+                   gpointer user_data)
+{
+	FakeInterface *iface = user_data;
+	GVariant *value;
+
+	value = g_variant_lookup_value (iface->props, property_name, NULL);
+	if (!value) {
+		g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+		             "No such property '%s'", property_name);
+	}
+	return value;
+}
+
+static const GDBusInterfaceVTable fake_vtable = {
+	fake_method_call,
+	fake_get_property,
+	NULL,
+};
+
+/*****************************************************************************/
+
+static char *
+add_connection (FakeNM *fake, NMConnection *connection, guint index)
+{
+	gs_free char *path = g_strdup_printf (NM_DBUS_PATH_SETTINGS "/%u", index);
+	FakeObject *object;
+	FakeInterface *iface;
+	GVariantBuilder props;
+
+	object = fake_object_new (fake, path);
+
+	g_variant_builder_init (&props, G_VARIANT_TYPE_VARDICT);
+	g_variant_builder_add (&props, "{sv}", "Unsaved", g_variant_new_boolean (FALSE));
+	g_variant_builder_add (&props, "{sv}", "Flags", g_variant_new_uint32 (0));
+	g_variant_builder_add (&props, "{sv}", "Filename", g_variant_new_string (""));
+	iface = fake_object_add (object, fake, NM_DBUS_INTERFACE_SETTINGS_CONNECTION, &props);
+	iface->settings = g_variant_ref_sink (nm_connection_to_dbus (connection, NM_CONNECTION_SERIALIZE_ALL));
+
+	return g_steal_pointer (&path);
+}
+
+static NMConnection *
+new_connection (const char *id, const char *type)
+{
+	gs_free char *uuid = nm_utils_uuid_generate ();
+	NMConnection *connection;
+	NMSetting *setting;
+
+	connection = nm_simple_connection_new ();
+	setting = nm_setting_connection_new ();
+	g_object_set (setting,
+	              NM_SETTING_CONNECTION_ID, id,
+	              NM_SETTING_CONNECTION_UUID, uuid,
+	              NM_SETTING_CONNECTION_TYPE, type,
+	              NULL);
+	nm_connection_add_setting (connection, setting);
+	return connection;
+}
+
+/* Every fifth network is open, the others use WPA2-PSK */
+static gboolean
+ssid_is_open (guint ssid)
+{
+	return ssid % 5 == 4;
+}
+
+static char *
+ssid_name (guint ssid)
+{
+	return g_strdup_printf ("bench-%03u", ssid);
+}
+
+static NMConnection *
+new_wifi_connection (guint ssid)
+{
+	gs_free char *name = ssid_name (ssid);
+	gs_unref_bytes GBytes *bytes = g_bytes_new (name, strlen (name));
+	NMConnection *connection;
+	NMSetting *setting;
+
+	connection = new_connection (name, NM_SETTING_WIRELESS_SETTING_NAME);
+
+	setting = nm_setting_wireless_new ();
+	g_object_set (setting,
+	              NM_SETTING_WIRELESS_SSID, bytes,
+	              NM_SETTING_WIRELESS_MODE, NM_SETTING_WIRELESS_MODE_INFRA,
+	              NULL);
+	nm_connection_add_setting (connection, setting);
+
+	if (!ssid_is_open (ssid)) {
+		setting = nm_setting_wireless_security_new ();
+		g_object_set (setting,
+		              NM_SETTING_WIRELESS_SECURITY_KEY_MGMT, "wpa-psk",
+		              NULL);
+		nm_connection_add_setting (connection, setting);
+	}
+
+	return connection;
+}
+
+static NMConnection *
+new_vpn_connection (guint index)
+{
+	gs_free char *id = g_strdup_printf ("VPN %u", index);
+	gs_free char *remote = g_strdup_printf ("vpn%u.example.com", index);
+	NMConnection *connection;
+	NMSetting *setting;
+
+	connection = new_connection (id, NM_SETTING_VPN_SETTING_NAME);
+
+	setting = nm_setting_vpn_new ();
+	g_object_set (setting,
+	              NM_SETTING_VPN_SERVICE_TYPE, "org.freedesktop.NetworkManager.openvpn",
+	              NULL);
+	nm_setting_vpn_add_data_item (NM_SETTING_VPN (setting), "remote", remote);
+	nm_connection_add_setting (connection, setting);
+
+	return connection;
+}
+
+static char *
+add_access_point (FakeNM *fake, guint device, guint index, guint ap)
+{
+	gs_free char *path = g_strdup_printf (NM_DBUS_PATH "/AccessPoint/%u", index);
+	gs_free char *ssid = ssid_name (ap % MAX (fake->n_ssids, 1));
+	gs_free char *bssid = NULL;
+	gboolean open = ssid_is_open (ap % MAX (fake->n_ssids, 1));
+	gboolean five_ghz = ap % 3 == 2;
+	FakeObject *object;
+	GVariantBuilder props;
+
+	bssid = g_strdup_printf ("02:%02X:00:%02X:%02X:%02X",
+	                         device, (index >> 16) & 0xFF, (index >> 8) & 0xFF, index & 0xFF);
+
+	object = fake_object_new (fake, path);
+
+	g_variant_builder_init (&props, G_VARIANT_TYPE_VARDICT);
+	g_variant_builder_add (&props, "{sv}", "Flags",
+	                       g_variant_new_uint32 (open ? NM_802_11_AP_FLAGS_NONE : NM_802_11_AP_FLAGS_PRIVACY));
+	g_variant_builder_add (&props, "{sv}", "WpaFlags", g_variant_new_uint32 (NM_802_11_AP_SEC_NONE));
+	g_variant_builder_add (&props, "{sv}", "RsnFlags",
+	                       g_variant_new_uint32 (open
+	                                             ? NM_802_11_AP_SEC_NONE
+	                                             : (  NM_802_11_AP_SEC_PAIR_CCMP
+	                                                | NM_802_11_AP_SEC_GROUP_CCMP
+	                                                | NM_802_11_AP_SEC_KEY_MGMT_PSK)));
+	g_variant_builder_add (&props, "{sv}", "Ssid",
+	                       g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE, ssid, strlen (ssid), 1));
+	g_variant_builder_add (&props, "{sv}", "Frequency",
+	                       g_variant_new_uint32 (five_ghz ? 5180 + 20 * (ap % 8) : 2412 + 5 * (ap % 13)));
+	g_variant_builder_add (&props, "{sv}", "HwAddress", g_variant_new_string (bssid));
+	g_variant_builder_add (&props, "{sv}", "Mode", g_variant_new_uint32 (NM_802_11_MODE_INFRA));
+	g_variant_builder_add (&props, "{sv}", "MaxBitrate", g_variant_new_uint32 (five_ghz ? 300000 : 54000));
+	g_variant_builder_add (&props, "{sv}", "Strength", g_variant_new_byte (100 - (ap * 37) % 80));
+	g_variant_builder_add (&props, "{sv}", "LastSeen",
+	                       g_variant_new_int32 (g_get_monotonic_time () / G_USEC_PER_SEC));
+	fake_object_add (object, fake, NM_DBUS_INTERFACE_ACCESS_POINT, &props);
+
+	return g_steal_pointer (&path);
+}
+
+static FakeObject *
+add_device (FakeNM *fake,
+            guint index,
+            const char *ifname,
+            NMDeviceType type,
+            NMDeviceState state,
+            const char *active,
+            GPtrArray *available)
+{
+	gs_free char *path = g_strdup_printf (NM_DBUS_PATH "/Devices/%u", index);
+	FakeObject *object;
+	GVariantBuilder props;
+
+	object = fake_object_new (fake, path);
+
+	g_variant_builder_init (&props, G_VARIANT_TYPE_VARDICT);
+	g_variant_builder_add (&props, "{sv}", "Udi", g_variant_new_string (path));
+	g_variant_builder_add (&props, "{sv}", "Interface", g_variant_new_string (ifname));
+	g_variant_builder_add (&props, "{sv}", "IpInterface", g_variant_new_string (ifname));
+	g_variant_builder_add (&props, "{sv}", "Driver", g_variant_new_string ("bench"));
+	g_variant_builder_add (&props, "{sv}", "Capabilities", g_variant_new_uint32 (NM_DEVICE_CAP_NM_SUPPORTED));
+	g_variant_builder_add (&props, "{sv}", "State", g_variant_new_uint32 (state));
+	g_variant_builder_add (&props, "{sv}", "StateReason",
+	                       g_variant_new ("(uu)", state, NM_DEVICE_STATE_REASON_NONE));
+	g_variant_builder_add (&props, "{sv}", "ActiveConnection", g_variant_new_object_path (active));
+	g_variant_builder_add (&props, "{sv}", "Ip4Config", g_variant_new_object_path ("/"));
+	g_variant_builder_add (&props, "{sv}", "Dhcp4Config", g_variant_new_object_path ("/"));
+	g_variant_builder_add (&props, "{sv}", "Ip6Config", g_variant_new_object_path ("/"));
+	g_variant_builder_add (&props, "{sv}", "Dhcp6Config", g_variant_new_object_path ("/"));
+	g_variant_builder_add (&props, "{sv}", "Managed", g_variant_new_boolean (TRUE));
+	g_variant_builder_add (&props, "{sv}", "Autoconnect", g_variant_new_boolean (TRUE));
+	g_variant_builder_add (&props, "{sv}", "DeviceType", g_variant_new_uint32 (type));
+	g_variant_builder_add (&props, "{sv}", "AvailableConnections", object_paths (available));
+	g_variant_builder_add (&props, "{sv}", "Mtu", g_variant_new_uint32 (1500));
+	g_variant_builder_add (&props, "{sv}", "Real", g_variant_new_boolean (TRUE));
+	fake_object_add (object, fake, NM_DBUS_INTERFACE_DEVICE, &props);
+
+	return object;
+}
+
+static void
+build_scenario (FakeNM *fake, const FakeNMScenario *scenario)
+{
+	gs_unref_ptrarray GPtrArray *connections = g_ptr_array_new_with_free_func (g_free);
+	gs_unref_ptrarray GPtrArray *wifi_connections = g_ptr_array_new ();
+	gs_unref_ptrarray GPtrArray *devices = g_ptr_array_new_with_free_func (g_free);
+	gs_unref_ptrarray GPtrArray *active = g_ptr_array_new_with_free_func (g_free);
+	gs_unref_object NMConnection *active_connection = NULL;
+	FakeObject *object;
+	GVariantBuilder props;
+	guint n_aps = 0;
+	guint i, j;
+
+	fake->n_ssids = scenario->n_ssids;
+
+	for (i = 0; i < scenario->n_ethernet; i++) {
+		gs_free char *id = g_strdup_printf ("Wired connection %u", i + 1);
+		gs_unref_object NMConnection *connection = NULL;
+
+		connection = new_connection (id, NM_SETTING_WIRED_SETTING_NAME);
+		nm_connection_add_setting (connection, nm_setting_wired_new ());
+		g_ptr_array_add (connections, add_connection (fake, connection, connections->len));
+	}
+
+	for (i = 0; i < scenario->n_connections; i++) {
+		gs_unref_object NMConnection *connection = new_wifi_connection (i);
+		char *path = add_connection (fake, connection, connections->len);
+
+		g_ptr_array_add (connections, path);
+		g_ptr_array_add (wifi_connections, path);
+		if (i == 0)
+			active_connection = g_object_ref (connection);
+	}
+
+	for (i = 0; i < scenario->n_vpns; i++) {
+		gs_unref_object NMConnection *connection = new_vpn_connection (i + 1);
+
+		g_ptr_array_add (connections, add_connection (fake, connection, connections->len));
+	}
+
+	for (i = 0; i < scenario->n_ethernet; i++) {
+		gs_free char *ifname = g_strdup_printf ("eth%u", i);
+		gs_free char *hwaddr = g_strdup_printf ("02:00:00:00:00:%02X", i);
+		gs_unref_ptrarray GPtrArray *available = g_ptr_array_new ();
+
+		g_ptr_array_add (available, connections->pdata[i]);
+		object = add_device (fake, devices->len, ifname,
+		                     NM_DEVICE_TYPE_ETHERNET, NM_DEVICE_STATE_UNAVAILABLE,
+		                     "/", available);
+		g_ptr_array_add (devices, g_strdup (object->path));
+
+		g_variant_builder_init (&props, G_VARIANT_TYPE_VARDICT);
+		g_variant_builder_add (&props, "{sv}", "HwAddress", g_variant_new_string (hwaddr));
+		g_variant_builder_add (&props, "{sv}", "PermHwAddress", g_variant_new_string (hwaddr));
+		g_variant_builder_add (&props, "{sv}", "Speed", g_variant_new_uint32 (0));
+		g_variant_builder_add (&props, "{sv}", "Carrier", g_variant_new_boolean (FALSE));
+		fake_object_add (object, fake, NM_DBUS_INTERFACE_DEVICE_WIRED, &props);
+	}
+
+	for (i = 0; i < scenario->n_wifi; i++) {
+		gs_free char *ifname = g_strdup_printf ("wlan%u", i);
+		gs_free char *hwaddr = g_strdup_printf ("02:00:00:00:01:%02X", i);
+		gs_free char *device_path = g_strdup_printf (NM_DBUS_PATH "/Devices/%u", devices->len);
+		gs_unref_ptrarray GPtrArray *aps = g_ptr_array_new_with_free_func (g_free);
+		gboolean connected = i == 0 && active_connection && scenario->n_aps;
+		const char *active_path = "/";
+
+		for (j = 0; j < scenario->n_aps; j++)
+			g_ptr_array_add (aps, add_access_point (fake, i, n_aps++, j));
+
+		if (connected) {
+			gs_free char *path = g_strdup_printf (NM_DBUS_PATH "/ActiveConnection/%u", active->len);
+			gs_unref_ptrarray GPtrArray *active_devices = g_ptr_array_new ();
+
+			g_ptr_array_add (active_devices, device_path);
+
+			object = fake_object_new (fake, path);
+			g_variant_builder_init (&props, G_VARIANT_TYPE_VARDICT);
+			g_variant_builder_add (&props, "{sv}", "Connection",
+			                       g_variant_new_object_path (wifi_connections->pdata[0]));
+			g_variant_builder_add (&props, "{sv}", "SpecificObject",
+			                       g_variant_new_object_path (aps->pdata[0]));
+			g_variant_builder_add (&props, "{sv}", "Id",
+			                       g_variant_new_string (nm_connection_get_id (active_connection)));
+			g_variant_builder_add (&props, "{sv}", "Uuid",
+			                       g_variant_new_string (nm_connection_get_uuid (active_connection)));
+			g_variant_builder_add (&props, "{sv}", "Type",
+			                       g_variant_new_string (NM_SETTING_WIRELESS_SETTING_NAME));
+			g_variant_builder_add (&props, "{sv}", "Devices", object_paths (active_devices));
+			g_variant_builder_add (&props, "{sv}", "State",
+			                       g_variant_new_uint32 (NM_ACTIVE_CONNECTION_STATE_ACTIVATED));
+			g_variant_builder_add (&props, "{sv}", "Default", g_variant_new_boolean (TRUE));
+			g_variant_builder_add (&props, "{sv}", "Default6", g_variant_new_boolean (FALSE));
+			g_variant_builder_add (&props, "{sv}", "Vpn", g_variant_new_boolean (FALSE));
+			g_variant_builder_add (&props, "{sv}", "Master", g_variant_new_object_path ("/"));
+			fake_object_add (object, fake, NM_DBUS_INTERFACE_ACTIVE_CONNECTION, &props);
+
+			g_ptr_array_add (active, g_steal_pointer (&path));
+			active_path = active->pdata[active->len - 1];
+		}
+
+		object = add_device (fake, devices->len, ifname,
+		                     NM_DEVICE_TYPE_WIFI,
+		                     connected ? NM_DEVICE_STATE_ACTIVATED : NM_DEVICE_STATE_DISCONNECTED,
+		                     active_path, wifi_connections);
+		g_ptr_array_add (devices, g_strdup (object->path));
+
+		g_variant_builder_init (&props, G_VARIANT_TYPE_VARDICT);
+		g_variant_builder_add (&props, "{sv}", "HwAddress", g_variant_new_string (hwaddr));
+		g_variant_builder_add (&props, "{sv}", "PermHwAddress", g_variant_new_string (hwaddr));
+		g_variant_builder_add (&props, "{sv}", "Mode", g_variant_new_uint32 (NM_802_11_MODE_INFRA));
+		g_variant_builder_add (&props, "{sv}", "Bitrate", g_variant_new_uint32 (connected ? 54000 : 0));
+		g_variant_builder_add (&props, "{sv}", "AccessPoints", object_paths (aps));
+		g_variant_builder_add (&props, "{sv}", "ActiveAccessPoint",
+		                       g_variant_new_object_path (connected ? aps->pdata[0] : "/"));
+		g_variant_builder_add (&props, "{sv}", "WirelessCapabilities",
+		                       g_variant_new_uint32 (  NM_WIFI_DEVICE_CAP_CIPHER_WEP40
+		                                             | NM_WIFI_DEVICE_CAP_CIPHER_WEP104
+		                                             | NM_WIFI_DEVICE_CAP_CIPHER_TKIP
+		                                             | NM_WIFI_DEVICE_CAP_CIPHER_CCMP
+		                                             | NM_WIFI_DEVICE_CAP_WPA
+		                                             | NM_WIFI_DEVICE_CAP_RSN
+		                                             | NM_WIFI_DEVICE_CAP_FREQ_VALID
+		                                             | NM_WIFI_DEVICE_CAP_FREQ_2GHZ
+		                                             | NM_WIFI_DEVICE_CAP_FREQ_5GHZ));
+		g_variant_builder_add (&props, "{sv}", "LastScan", g_variant_new_int64 (-1));
+		fake_object_add (object, fake, NM_DBUS_INTERFACE_DEVICE_WIRELESS, &props);
+	}
+
+	object = fake_object_new (fake, NM_DBUS_PATH);
+	g_variant_builder_init (&props, G_VARIANT_TYPE_VARDICT);
+	g_variant_builder_add (&props, "{sv}", "Devices", object_paths (devices));
+	g_variant_builder_add (&props, "{sv}", "AllDevices", object_paths (devices));
+	g_variant_builder_add (&props, "{sv}", "Checkpoints", g_variant_new_objv (NULL, 0));
+	g_variant_builder_add (&props, "{sv}", "NetworkingEnabled", g_variant_new_boolean (TRUE));
+	g_variant_builder_add (&props, "{sv}", "WirelessEnabled", g_variant_new_boolean (TRUE));
+	g_variant_builder_add (&props, "{sv}", "WirelessHardwareEnabled", g_variant_new_boolean (TRUE));
+	g_variant_builder_add (&props, "{sv}", "WwanEnabled", g_variant_new_boolean (FALSE));
+	g_variant_builder_add (&props, "{sv}", "WwanHardwareEnabled", g_variant_new_boolean (FALSE));
+	g_variant_builder_add (&props, "{sv}", "ActiveConnections", object_paths (active));
+	g_variant_builder_add (&props, "{sv}", "PrimaryConnection",
+	                       g_variant_new_object_path (active->len ? active->pdata[0] : "/"));
+	g_variant_builder_add (&props, "{sv}", "PrimaryConnectionType",
+	                       g_variant_new_string (active->len ? NM_SETTING_WIRELESS_SETTING_NAME : ""));
+	g_variant_builder_add (&props, "{sv}", "ActivatingConnection", g_variant_new_object_path ("/"));
+	g_variant_builder_add (&props, "{sv}", "Startup", g_variant_new_boolean (FALSE));
+	g_variant_builder_add (&props, "{sv}", "Version", g_variant_new_string ("1.16.0"));
+	g_variant_builder_add (&props, "{sv}", "State",
+	                       g_variant_new_uint32 (active->len ? NM_STATE_CONNECTED_GLOBAL : NM_STATE_DISCONNECTED));
+	g_variant_builder_add (&props, "{sv}", "Connectivity",
+	                       g_variant_new_uint32 (active->len ? NM_CONNECTIVITY_FULL : NM_CONNECTIVITY_NONE));
+	fake_object_add (object, fake, NM_DBUS_INTERFACE, &props);
+
+	object = fake_object_new (fake, NM_DBUS_PATH_SETTINGS);
+	g_variant_builder_init (&props, G_VARIANT_TYPE_VARDICT);
+	g_variant_builder_add (&props, "{sv}", "Connections", object_paths (connections));
+	g_variant_builder_add (&props, "{sv}", "Hostname", g_variant_new_string ("bench"));
+	g_variant_builder_add (&props, "{sv}", "CanModify", g_variant_new_boolean (TRUE));
+	fake_object_add (object, fake, NM_DBUS_INTERFACE_SETTINGS, &props);
+
+	object = fake_object_new (fake, NM_DBUS_PATH_DNS_MANAGER);
+	g_variant_builder_init (&props, G_VARIANT_TYPE_VARDICT);
+	g_variant_builder_add (&props, "{sv}", "Mode", g_variant_new_string ("default"));
+	g_variant_builder_add (&props, "{sv}", "RcManager", g_variant_new_string ("file"));
+	g_variant_builder_add (&props, "{sv}", "Configuration", g_variant_new ("aa{sv}", NULL));
+	fake_object_add (object, fake, NM_DBUS_INTERFACE_DNS_MANAGER, &props);
+}
+
+/*****************************************************************************/
+
+static gpointer
+fake_nm_thread (gpointer user_data)
+{
+	FakeNM *fake = user_data;
+
+	g_main_context_push_thread_default (fake->context);
+	g_main_loop_run (fake->loop);
+	g_main_context_pop_thread_default (fake->context);
+
+	return NULL;
+}
+
+static gboolean
+fake_nm_quit (gpointer user_data)
+{
+	g_main_loop_quit (user_data);
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean
+fake_nm_register (FakeNM *fake, GError **error)
+{
+	guint i, j;
+
+	fake->object_manager->registration_id =
+		g_dbus_connection_register_object (fake->connection, "/org/freedesktop",
+		                                   fake->object_manager->info,
+		                                   &fake_vtable, fake->object_manager, NULL,
+		                                   error);
+	if (!fake->object_manager->registration_id)
+		return FALSE;
+
+	for (i = 0; i < fake->objects->len; i++) {
+		FakeObject *object = fake->objects->pdata[i];
+
+		for (j = 0; j < object->interfaces->len; j++) {
+			FakeInterface *iface = object->interfaces->pdata[j];
+
+			iface->registration_id =
+				g_dbus_connection_register_object (fake->connection, object->path,
+				                                   iface->info,
+				                                   &fake_vtable, iface, NULL,
+				                                   error);
+			if (!iface->registration_id)
+				return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/**
+ * fake_nm_new:
+ * @scenario: what to put on the bus
+ * @error: return location for a #GError
+ *
+ * Connects to the session bus, exports @scenario there and takes the
+ * NetworkManager name.  Meant for a private bus, e.g. from #GTestDBus.
+ *
+ * Returns: the running service, or %NULL with @error set.
+ */
+FakeNM *
+fake_nm_new (const FakeNMScenario *scenario, GError **error)
+{
+	gs_free char *address = NULL;
+	GVariantBuilder props;
+	GVariant *ret;
+	FakeNM *fake;
+	guint32 reply;
+	gboolean registered;
+
+	address = g_dbus_address_get_for_bus_sync (G_BUS_TYPE_SESSION, NULL, error);
+	if (!address)
+		return NULL;
+
+	fake = g_slice_new0 (FakeNM);
+	fake->node_info = g_dbus_node_info_new_for_xml (introspection_xml, NULL);
+	g_assert (fake->node_info);
+	fake->objects = g_ptr_array_new_with_free_func ((GDestroyNotify) fake_object_free);
+	fake->context = g_main_context_new ();
+	fake->loop = g_main_loop_new (fake->context, FALSE);
+
+	g_variant_builder_init (&props, G_VARIANT_TYPE_VARDICT);
+	fake->object_manager = fake_interface_new (fake, "org.freedesktop.DBus.ObjectManager", &props);
+	build_scenario (fake, scenario);
+
+	/* Calls are dispatched to the context that is the thread default
+	 * when the objects get registered: the one fake_nm_thread() runs.
+	 */
+	g_main_context_push_thread_default (fake->context);
+	fake->connection = g_dbus_connection_new_for_address_sync (address,
+	                                                           G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT
+	                                                           | G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+	                                                           NULL, NULL, error);
+	registered = fake->connection && fake_nm_register (fake, error);
+	g_main_context_pop_thread_default (fake->context);
+	if (!registered) {
+		fake_nm_free (fake);
+		return NULL;
+	}
+
+	/* DBUS_NAME_FLAG_DO_NOT_QUEUE */
+	ret = g_dbus_connection_call_sync (fake->connection,
+	                                   "org.freedesktop.DBus",
+	                                   "/org/freedesktop/DBus",
+	                                   "org.freedesktop.DBus",
+	                                   "RequestName",
+	                                   g_variant_new ("(su)", NM_DBUS_SERVICE, 4),
+	                                   G_VARIANT_TYPE ("(u)"),
+	                                   G_DBUS_CALL_FLAGS_NONE,
+	                                   -1, NULL, error);
+	if (!ret) {
+		fake_nm_free (fake);
+		return NULL;
+	}
+	g_variant_get (ret, "(u)", &reply);
+	g_variant_unref (ret);
+
+	/* DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER */
+	if (reply != 1) {
+		g_set_error (error, G_IO_ERROR, G_IO_ERROR_EXISTS,
+		             "%s is already owned on this bus", NM_DBUS_SERVICE);
+		fake_nm_free (fake);
+		return NULL;
+	}
+
+	fake->thread = g_thread_new ("fake-nm", fake_nm_thread, fake);
+	return fake;
+}
+
+void
+fake_nm_free (FakeNM *fake)
+{
+	if (fake->thread) {
+		GSource *source;
+
+		/* Not g_main_loop_quit(), which is lost if the loop isn't running yet */
+		source = g_idle_source_new ();
+		g_source_set_callback (source, fake_nm_quit, fake->loop, NULL);
+		g_source_attach (source, fake->context);
+		g_source_unref (source);
+		g_thread_join (fake->thread);
+	}
+
+	fake_interface_free (fake->object_manager);
+	g_ptr_array_unref (fake->objects);
+	if (fake->connection) {
+		g_dbus_connection_close_sync (fake->connection, NULL, NULL);
+		g_object_unref (fake->connection);
+	}
+	g_main_loop_unref (fake->loop);
+	g_main_context_unref (fake->context);
+	g_dbus_node_info_unref (fake->node_info);
+	g_slice_free (FakeNM, fake);
+}
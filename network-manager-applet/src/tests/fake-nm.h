@@ -0,0 +1,23 @@
+// SPDX-License-Identifier: GPL-2.0+
+/* NetworkManager Applet -- allow user control over networking */
+
+#ifndef FAKE_NM_H
+#define FAKE_NM_H
+
+typedef struct {
+	const char *name;
+	guint n_ethernet;
+	guint n_wifi;
+	guint n_aps;            /* per Wi-Fi device */
+	guint n_ssids;          /* networks the APs of each device belong to */
+	guint n_connections;    /* Wi-Fi connections, for the first networks */
+	guint n_vpns;
+} FakeNMScenario;
+
+typedef struct _FakeNM FakeNM;
+
+FakeNM *fake_nm_new (const FakeNMScenario *scenario, GError **error);
+
+void fake_nm_free (FakeNM *fake);
+
+#endif  /* FAKE_NM_H */
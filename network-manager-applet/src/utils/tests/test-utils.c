@@ -15,27 +15,27 @@
 #include "nm-utils/nm-test-utils.h"
 
 typedef struct {
-	char *foobar_infra_open;
-	char *foobar_infra_wep;
-	char *foobar_infra_wpa;
-	char *foobar_infra_rsn;
-	char *foobar_infra_wpa_rsn;
-	char *foobar_adhoc_open;
-	char *foobar_adhoc_wep;
-	char *foobar_adhoc_wpa;
-	char *foobar_adhoc_rsn;
-	char *foobar_adhoc_wpa_rsn;
-
-	char *asdf11_infra_open;
-	char *asdf11_infra_wep;
-	char *asdf11_infra_wpa;
-	char *asdf11_infra_rsn;
-	char *asdf11_infra_wpa_rsn;
-	char *asdf11_adhoc_open;
-	char *asdf11_adhoc_wep;
-	char *asdf11_adhoc_wpa;
-	char *asdf11_adhoc_rsn;
-	char *asdf11_adhoc_wpa_rsn;
+	guint64 foobar_infra_open;
+	guint64 foobar_infra_wep;
+	guint64 foobar_infra_wpa;
+	guint64 foobar_infra_rsn;
+	guint64 foobar_infra_wpa_rsn;
+	guint64 foobar_adhoc_open;
+	guint64 foobar_adhoc_wep;
+	guint64 foobar_adhoc_wpa;
+	guint64 foobar_adhoc_rsn;
+	guint64 foobar_adhoc_wpa_rsn;
+
+	guint64 asdf11_infra_open;
+	guint64 asdf11_infra_wep;
+	guint64 asdf11_infra_wpa;
+	guint64 asdf11_infra_rsn;
+	guint64 asdf11_infra_wpa_rsn;
+	guint64 asdf11_adhoc_open;
+	guint64 asdf11_adhoc_wep;
+	guint64 asdf11_adhoc_wpa;
+	guint64 asdf11_adhoc_rsn;
+	guint64 asdf11_adhoc_wpa_rsn;
 } TestData;
 
 static GBytes *
@@ -46,7 +46,7 @@ string_to_ssid (const char *str)
 	return g_bytes_new (str, strlen (str));
 }
 
-static char *
+static guint64
 make_hash (const char *str,
            NM80211Mode mode,
            guint32 flags,
@@ -54,18 +54,15 @@ make_hash (const char *str,
            guint32 rsn_flags)
 {
 	GBytes *ssid;
-	char *hash, *hash2;
+	guint64 hash, hash2;
 
 	ssid = string_to_ssid (str);
 
 	hash = utils_hash_ap (ssid, mode, flags, wpa_flags, rsn_flags);
-	g_assert (hash != NULL);
-
 	hash2 = utils_hash_ap (ssid, mode, flags, wpa_flags, rsn_flags);
-	g_assert (hash2 != NULL);
 
 	/* Make sure they are the same each time */
-	g_assert (!strcmp (hash, hash2));
+	g_assert_cmpuint (hash, ==, hash2);
 
 	g_bytes_unref (ssid);
 	return hash;
@@ -74,11 +71,11 @@ make_hash (const char *str,
 static void
 make_ssid_hashes (const char *ssid,
                   NM80211Mode mode,
-                  char **open,
-                  char **wep,
-                  char **wpa,
-                  char **rsn,
-                  char **wpa_rsn)
+                  guint64 *open,
+                  guint64 *wep,
+                  guint64 *wpa,
+                  guint64 *rsn,
+                  guint64 *wpa_rsn)
 {
 	*open = make_hash (ssid, mode,
 	                   NM_802_11_AP_FLAGS_NONE,
@@ -156,245 +153,534 @@ test_data_new (void)
 static void
 test_data_free (TestData *d)
 {
-	g_free (d->foobar_infra_open);
-	g_free (d->foobar_infra_wep);
-	g_free (d->foobar_infra_wpa);
-	g_free (d->foobar_infra_rsn);
-	g_free (d->foobar_infra_wpa_rsn);
-	g_free (d->foobar_adhoc_open);
-	g_free (d->foobar_adhoc_wep);
-	g_free (d->foobar_adhoc_wpa);
-	g_free (d->foobar_adhoc_rsn);
-	g_free (d->foobar_adhoc_wpa_rsn);
-
-	g_free (d->asdf11_infra_open);
-	g_free (d->asdf11_infra_wep);
-	g_free (d->asdf11_infra_wpa);
-	g_free (d->asdf11_infra_rsn);
-	g_free (d->asdf11_infra_wpa_rsn);
-	g_free (d->asdf11_adhoc_open);
-	g_free (d->asdf11_adhoc_wep);
-	g_free (d->asdf11_adhoc_wpa);
-	g_free (d->asdf11_adhoc_rsn);
-	g_free (d->asdf11_adhoc_wpa_rsn);
-
 	g_free (d);
 }
 
 static void
 test_ap_hash_infra_adhoc_open (TestData *d)
 {
-	g_assert (strcmp (d->foobar_infra_open, d->foobar_adhoc_open));
+	g_assert_cmpuint (d->foobar_infra_open, !=, d->foobar_adhoc_open);
 }
 
 static void
 test_ap_hash_infra_adhoc_wep (TestData *d)
 {
-	g_assert (strcmp (d->foobar_infra_wep, d->foobar_adhoc_wep));
+	g_assert_cmpuint (d->foobar_infra_wep, !=, d->foobar_adhoc_wep);
 }
 
 static void
 test_ap_hash_infra_adhoc_wpa (TestData *d)
 {
-	g_assert (strcmp (d->foobar_infra_wpa, d->foobar_adhoc_wpa));
+	g_assert_cmpuint (d->foobar_infra_wpa, !=, d->foobar_adhoc_wpa);
 }
 
 static void
 test_ap_hash_infra_adhoc_rsn (TestData *d)
 {
-	g_assert (strcmp (d->foobar_infra_rsn, d->foobar_adhoc_rsn));
+	g_assert_cmpuint (d->foobar_infra_rsn, !=, d->foobar_adhoc_rsn);
 }
 
 static void
 test_ap_hash_infra_adhoc_wpa_rsn (TestData *d)
 {
-	g_assert (strcmp (d->foobar_infra_wpa_rsn, d->foobar_adhoc_wpa_rsn));
+	g_assert_cmpuint (d->foobar_infra_wpa_rsn, !=, d->foobar_adhoc_wpa_rsn);
 }
 
 static void
 test_ap_hash_infra_open_wep (TestData *d)
 {
-	g_assert (strcmp (d->foobar_infra_open, d->foobar_infra_wep));
+	g_assert_cmpuint (d->foobar_infra_open, !=, d->foobar_infra_wep);
 }
 
 static void
 test_ap_hash_infra_open_wpa (TestData *d)
 {
-	g_assert (strcmp (d->foobar_infra_open, d->foobar_infra_wpa));
+	g_assert_cmpuint (d->foobar_infra_open, !=, d->foobar_infra_wpa);
 }
 
 static void
 test_ap_hash_infra_open_rsn (TestData *d)
 {
-	g_assert (strcmp (d->foobar_infra_open, d->foobar_infra_rsn));
+	g_assert_cmpuint (d->foobar_infra_open, !=, d->foobar_infra_rsn);
 }
 
 static void
 test_ap_hash_infra_open_wpa_rsn (TestData *d)
 {
-	g_assert (strcmp (d->foobar_infra_open, d->foobar_infra_wpa_rsn));
+	g_assert_cmpuint (d->foobar_infra_open, !=, d->foobar_infra_wpa_rsn);
 }
 
 static void
 test_ap_hash_infra_wep_wpa (TestData *d)
 {
-	g_assert (strcmp (d->foobar_infra_wep, d->foobar_infra_wpa));
+	g_assert_cmpuint (d->foobar_infra_wep, !=, d->foobar_infra_wpa);
 }
 
 static void
 test_ap_hash_infra_wep_rsn (TestData *d)
 {
-	g_assert (strcmp (d->foobar_infra_wep, d->foobar_infra_rsn));
+	g_assert_cmpuint (d->foobar_infra_wep, !=, d->foobar_infra_rsn);
 }
 
 static void
 test_ap_hash_infra_wep_wpa_rsn (TestData *d)
 {
-	g_assert (strcmp (d->foobar_infra_wep, d->foobar_infra_wpa_rsn));
+	g_assert_cmpuint (d->foobar_infra_wep, !=, d->foobar_infra_wpa_rsn);
 }
 
 static void
 test_ap_hash_infra_wpa_rsn (TestData *d)
 {
 	/* these should be the same as we group all WPA/RSN APs together */
-	g_assert (!strcmp (d->foobar_infra_wpa, d->foobar_infra_rsn));
+	g_assert_cmpuint (d->foobar_infra_wpa, ==, d->foobar_infra_rsn);
 }
 
 static void
 test_ap_hash_infra_wpa_wpa_rsn (TestData *d)
 {
 	/* these should be the same as we group all WPA/RSN APs together */
-	g_assert (!strcmp (d->foobar_infra_wpa, d->foobar_infra_wpa_rsn));
+	g_assert_cmpuint (d->foobar_infra_wpa, ==, d->foobar_infra_wpa_rsn);
 }
 
 static void
 test_ap_hash_infra_rsn_wpa_rsn (TestData *d)
 {
 	/* these should be the same as we group all WPA/RSN APs together */
-	g_assert (!strcmp (d->foobar_infra_rsn, d->foobar_infra_wpa_rsn));
+	g_assert_cmpuint (d->foobar_infra_rsn, ==, d->foobar_infra_wpa_rsn);
 }
 
 static void
 test_ap_hash_adhoc_open_wep (TestData *d)
 {
-	g_assert (strcmp (d->foobar_adhoc_open, d->foobar_adhoc_wep));
+	g_assert_cmpuint (d->foobar_adhoc_open, !=, d->foobar_adhoc_wep);
 }
 
 static void
 test_ap_hash_adhoc_open_wpa (TestData *d)
 {
-	g_assert (strcmp (d->foobar_adhoc_open, d->foobar_adhoc_wpa));
+	g_assert_cmpuint (d->foobar_adhoc_open, !=, d->foobar_adhoc_wpa);
 }
 
 static void
 test_ap_hash_adhoc_open_rsn (TestData *d)
 {
-	g_assert (strcmp (d->foobar_adhoc_open, d->foobar_adhoc_rsn));
+	g_assert_cmpuint (d->foobar_adhoc_open, !=, d->foobar_adhoc_rsn);
 }
 
 static void
 test_ap_hash_adhoc_open_wpa_rsn (TestData *d)
 {
-	g_assert (strcmp (d->foobar_adhoc_open, d->foobar_adhoc_wpa_rsn));
+	g_assert_cmpuint (d->foobar_adhoc_open, !=, d->foobar_adhoc_wpa_rsn);
 }
 
 static void
 test_ap_hash_adhoc_wep_wpa (TestData *d)
 {
-	g_assert (strcmp (d->foobar_adhoc_wep, d->foobar_adhoc_wpa));
+	g_assert_cmpuint (d->foobar_adhoc_wep, !=, d->foobar_adhoc_wpa);
 }
 
 static void
 test_ap_hash_adhoc_wep_rsn (TestData *d)
 {
-	g_assert (strcmp (d->foobar_adhoc_wep, d->foobar_adhoc_rsn));
+	g_assert_cmpuint (d->foobar_adhoc_wep, !=, d->foobar_adhoc_rsn);
 }
 
 static void
 test_ap_hash_adhoc_wep_wpa_rsn (TestData *d)
 {
-	g_assert (strcmp (d->foobar_adhoc_wep, d->foobar_adhoc_wpa_rsn));
+	g_assert_cmpuint (d->foobar_adhoc_wep, !=, d->foobar_adhoc_wpa_rsn);
 }
 
 static void
 test_ap_hash_adhoc_wpa_rsn (TestData *d)
 {
 	/* these should be the same as we group all WPA/RSN APs together */
-	g_assert (!strcmp (d->foobar_adhoc_wpa, d->foobar_adhoc_rsn));
+	g_assert_cmpuint (d->foobar_adhoc_wpa, ==, d->foobar_adhoc_rsn);
 }
 
 static void
 test_ap_hash_adhoc_wpa_wpa_rsn (TestData *d)
 {
 	/* these should be the same as we group all WPA/RSN APs together */
-	g_assert (!strcmp (d->foobar_adhoc_wpa, d->foobar_adhoc_wpa_rsn));
+	g_assert_cmpuint (d->foobar_adhoc_wpa, ==, d->foobar_adhoc_wpa_rsn);
 }
 
 static void
 test_ap_hash_adhoc_rsn_wpa_rsn (TestData *d)
 {
 	/* these should be the same as we group all WPA/RSN APs together */
-	g_assert (!strcmp (d->foobar_adhoc_rsn, d->foobar_adhoc_wpa_rsn));
+	g_assert_cmpuint (d->foobar_adhoc_rsn, ==, d->foobar_adhoc_wpa_rsn);
 }
 
 static void
 test_ap_hash_foobar_asdf11_infra_open (TestData *d)
 {
-	g_assert (strcmp (d->foobar_infra_open, d->asdf11_infra_open));
+	g_assert_cmpuint (d->foobar_infra_open, !=, d->asdf11_infra_open);
 }
 
 static void
 test_ap_hash_foobar_asdf11_infra_wep (TestData *d)
 {
-	g_assert (strcmp (d->foobar_infra_wep, d->asdf11_infra_wep));
+	g_assert_cmpuint (d->foobar_infra_wep, !=, d->asdf11_infra_wep);
 }
 
 static void
 test_ap_hash_foobar_asdf11_infra_wpa (TestData *d)
 {
-	g_assert (strcmp (d->foobar_infra_wpa, d->asdf11_infra_wpa));
+	g_assert_cmpuint (d->foobar_infra_wpa, !=, d->asdf11_infra_wpa);
 }
 
 static void
 test_ap_hash_foobar_asdf11_infra_rsn (TestData *d)
 {
-	g_assert (strcmp (d->foobar_infra_rsn, d->asdf11_infra_rsn));
+	g_assert_cmpuint (d->foobar_infra_rsn, !=, d->asdf11_infra_rsn);
 }
 
 static void
 test_ap_hash_foobar_asdf11_infra_wpa_rsn (TestData *d)
 {
-	g_assert (strcmp (d->foobar_infra_wpa_rsn, d->asdf11_infra_wpa_rsn));
+	g_assert_cmpuint (d->foobar_infra_wpa_rsn, !=, d->asdf11_infra_wpa_rsn);
 }
 
 static void
 test_ap_hash_foobar_asdf11_adhoc_open (TestData *d)
 {
-	g_assert (strcmp (d->foobar_adhoc_open, d->asdf11_adhoc_open));
+	g_assert_cmpuint (d->foobar_adhoc_open, !=, d->asdf11_adhoc_open);
 }
 
 static void
 test_ap_hash_foobar_asdf11_adhoc_wep (TestData *d)
 {
-	g_assert (strcmp (d->foobar_adhoc_wep, d->asdf11_adhoc_wep));
+	g_assert_cmpuint (d->foobar_adhoc_wep, !=, d->asdf11_adhoc_wep);
 }
 
 static void
 test_ap_hash_foobar_asdf11_adhoc_wpa (TestData *d)
 {
-	g_assert (strcmp (d->foobar_adhoc_wpa, d->asdf11_adhoc_wpa));
+	g_assert_cmpuint (d->foobar_adhoc_wpa, !=, d->asdf11_adhoc_wpa);
 }
 
 static void
 test_ap_hash_foobar_asdf11_adhoc_rsn (TestData *d)
 {
-	g_assert (strcmp (d->foobar_adhoc_rsn, d->asdf11_adhoc_rsn));
+	g_assert_cmpuint (d->foobar_adhoc_rsn, !=, d->asdf11_adhoc_rsn);
 }
 
 static void
 test_ap_hash_foobar_asdf11_adhoc_wpa_rsn (TestData *d)
 {
-	g_assert (strcmp (d->foobar_adhoc_wpa_rsn, d->asdf11_adhoc_wpa_rsn));
+	g_assert_cmpuint (d->foobar_adhoc_wpa_rsn, !=, d->asdf11_adhoc_wpa_rsn);
+}
+
+/*****************************************************************************/
+
+/* The MD5 based hash utils_hash_ap() used to return; the grouping of the
+ * current one is checked against it.
+ */
+static char *
+legacy_hash_ap (GBytes *ssid,
+                NM80211Mode mode,
+                guint32 flags,
+                guint32 wpa_flags,
+                guint32 rsn_flags)
+{
+	unsigned char input[66];
+
+	memset (&input[0], 0, sizeof (input));
+
+	if (ssid)
+		memcpy (input, g_bytes_get_data (ssid, NULL), g_bytes_get_size (ssid));
+
+	if (mode == NM_802_11_MODE_INFRA)
+		input[32] |= (1 << 0);
+	else if (mode == NM_802_11_MODE_ADHOC)
+		input[32] |= (1 << 1);
+	else
+		input[32] |= (1 << 2);
+
+	if (  !(flags & NM_802_11_AP_FLAGS_PRIVACY)
+	    && (wpa_flags == NM_802_11_AP_SEC_NONE)
+	    && (rsn_flags == NM_802_11_AP_SEC_NONE))
+		input[32] |= (1 << 3);
+	else if (   (flags & NM_802_11_AP_FLAGS_PRIVACY)
+	         && (wpa_flags == NM_802_11_AP_SEC_NONE)
+	         && (rsn_flags == NM_802_11_AP_SEC_NONE))
+		input[32] |= (1 << 4);
+	else if (   !(flags & NM_802_11_AP_FLAGS_PRIVACY)
+	         &&  (wpa_flags != NM_802_11_AP_SEC_NONE)
+	         &&  (rsn_flags != NM_802_11_AP_SEC_NONE))
+		input[32] |= (1 << 5);
+	else
+		input[32] |= (1 << 6);
+
+	memcpy (&input[33], &input[0], 32);
+	return g_compute_checksum_for_data (G_CHECKSUM_MD5, input, sizeof (input));
+}
+
+static void
+test_ap_hash_legacy_grouping (void)
+{
+	static const char *ssids[] = { "foobar", "asdf11" };
+	static const NM80211Mode modes[] = { NM_802_11_MODE_INFRA, NM_802_11_MODE_ADHOC };
+	static const struct {
+		guint32 flags;
+		guint32 wpa_flags;
+		guint32 rsn_flags;
+	} sec[] = {
+		/* open */
+		{ NM_802_11_AP_FLAGS_NONE, NM_802_11_AP_SEC_NONE, NM_802_11_AP_SEC_NONE },
+		/* wep */
+		{ NM_802_11_AP_FLAGS_PRIVACY, NM_802_11_AP_SEC_NONE, NM_802_11_AP_SEC_NONE },
+		/* wpa */
+		{ NM_802_11_AP_FLAGS_PRIVACY,
+		  NM_802_11_AP_SEC_PAIR_TKIP | NM_802_11_AP_SEC_GROUP_TKIP | NM_802_11_AP_SEC_KEY_MGMT_PSK,
+		  NM_802_11_AP_SEC_NONE },
+		/* rsn */
+		{ NM_802_11_AP_FLAGS_PRIVACY,
+		  NM_802_11_AP_SEC_NONE,
+		  NM_802_11_AP_SEC_PAIR_CCMP | NM_802_11_AP_SEC_GROUP_CCMP | NM_802_11_AP_SEC_KEY_MGMT_PSK },
+		/* wpa_rsn */
+		{ NM_802_11_AP_FLAGS_PRIVACY,
+		  NM_802_11_AP_SEC_PAIR_TKIP | NM_802_11_AP_SEC_GROUP_TKIP | NM_802_11_AP_SEC_KEY_MGMT_PSK,
+		  NM_802_11_AP_SEC_PAIR_CCMP | NM_802_11_AP_SEC_GROUP_CCMP | NM_802_11_AP_SEC_KEY_MGMT_PSK },
+		/* wpa without the privacy flag */
+		{ NM_802_11_AP_FLAGS_NONE,
+		  NM_802_11_AP_SEC_PAIR_TKIP | NM_802_11_AP_SEC_GROUP_TKIP | NM_802_11_AP_SEC_KEY_MGMT_PSK,
+		  NM_802_11_AP_SEC_PAIR_CCMP | NM_802_11_AP_SEC_GROUP_CCMP | NM_802_11_AP_SEC_KEY_MGMT_PSK },
+	};
+	guint64 hashes[G_N_ELEMENTS (ssids) * G_N_ELEMENTS (modes) * G_N_ELEMENTS (sec)];
+	char *legacy[G_N_ELEMENTS (hashes)];
+	guint i, j, k, n = 0;
+
+	for (i = 0; i < G_N_ELEMENTS (ssids); i++) {
+		GBytes *ssid = string_to_ssid (ssids[i]);
+
+		for (j = 0; j < G_N_ELEMENTS (modes); j++) {
+			for (k = 0; k < G_N_ELEMENTS (sec); k++) {
+				hashes[n] = utils_hash_ap (ssid, modes[j],
+				                           sec[k].flags, sec[k].wpa_flags, sec[k].rsn_flags);
+				legacy[n] = legacy_hash_ap (ssid, modes[j],
+				                            sec[k].flags, sec[k].wpa_flags, sec[k].rsn_flags);
+				n++;
+			}
+		}
+		g_bytes_unref (ssid);
+	}
+
+	/* Two APs share a key exactly when they shared the old hash */
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < n; j++) {
+			gboolean same_legacy = !strcmp (legacy[i], legacy[j]);
+
+			if (same_legacy != (hashes[i] == hashes[j]))
+				g_error ("case %u and %u: legacy hashes %s, new keys %s", i, j,
+				         same_legacy ? "equal" : "differ",
+				         same_legacy ? "differ" : "equal");
+		}
+	}
+
+	for (i = 0; i < n; i++)
+		g_free (legacy[i]);
+}
+
+/*****************************************************************************/
+
+typedef struct {
+	guint network;
+	gboolean hidden;
+} FakeBss;
+
+typedef struct {
+	GPtrArray *ssids;
+	guint n_calls;
+} GroupData;
+
+static gboolean
+fake_bss_key (gpointer item, guint64 *out_key, gpointer user_data)
+{
+	const FakeBss *bss = item;
+	GroupData *data = user_data;
+
+	data->n_calls++;
+	if (bss->hidden)
+		return FALSE;
+
+	*out_key = utils_hash_ap (data->ssids->pdata[bss->network],
+	                          NM_802_11_MODE_INFRA,
+	                          NM_802_11_AP_FLAGS_PRIVACY,
+	                          NM_802_11_AP_SEC_NONE,
+	                          NM_802_11_AP_SEC_KEY_MGMT_PSK);
+	return TRUE;
+}
+
+static void
+test_group_by_key (void)
+{
+	static const guint sizes[] = { 1, 7, 250, 2000 };
+	guint s;
+
+	for (s = 0; s < G_N_ELEMENTS (sizes); s++) {
+		guint n_bss = sizes[s];
+		guint n_networks = MAX (n_bss / 4, 1);
+		GroupData data = { 0, };
+		gs_free FakeBss *bsss = NULL;
+		gs_free gboolean *visible = NULL;
+		gs_free gboolean *seen = NULL;
+		gs_unref_ptrarray GPtrArray *items = NULL;
+		gs_unref_ptrarray GPtrArray *groups = NULL;
+		guint n_grouped = 0, n_hidden = 0;
+		guint i, j;
+
+		data.ssids = g_ptr_array_new_with_free_func ((GDestroyNotify) g_bytes_unref);
+		for (i = 0; i < n_networks; i++) {
+			gs_free char *name = g_strdup_printf ("network-%u", i);
+
+			g_ptr_array_add (data.ssids, string_to_ssid (name));
+		}
+
+		/* Interleave the BSSs of all networks, and hide every ninth one */
+		bsss = g_new0 (FakeBss, n_bss);
+		visible = g_new0 (gboolean, n_networks);
+		seen = g_new0 (gboolean, n_networks);
+		items = g_ptr_array_new ();
+		for (i = 0; i < n_bss; i++) {
+			bsss[i].network = i % n_networks;
+			bsss[i].hidden = i % 9 == 8;
+			if (bsss[i].hidden)
+				n_hidden++;
+			else
+				visible[bsss[i].network] = TRUE;
+			g_ptr_array_add (items, &bsss[i]);
+		}
+
+		groups = utils_group_by_key (items->pdata, items->len, fake_bss_key, &data);
+
+		/* Every BSS is keyed exactly once, however many networks there are */
+		g_assert_cmpuint (data.n_calls, ==, n_bss);
+
+		/* One group per network with a visible BSS, in order of appearance */
+		for (i = 0; i < groups->len; i++) {
+			GPtrArray *group = groups->pdata[i];
+			const FakeBss *first = group->pdata[0];
+
+			g_assert (!seen[first->network]);
+			seen[first->network] = TRUE;
+
+			if (i > 0) {
+				GPtrArray *prev = groups->pdata[i - 1];
+
+				g_assert ((const FakeBss *) prev->pdata[0] < first);
+			}
+
+			for (j = 0; j < group->len; j++) {
+				const FakeBss *bss = group->pdata[j];
+
+				g_assert (!bss->hidden);
+				g_assert_cmpuint (bss->network, ==, first->network);
+				if (j > 0)
+					g_assert ((const FakeBss *) group->pdata[j - 1] < bss);
+			}
+			n_grouped += group->len;
+		}
+		g_assert_cmpuint (n_grouped, ==, n_bss - n_hidden);
+		for (i = 0; i < n_networks; i++)
+			g_assert_cmpint (seen[i], ==, visible[i]);
+
+		g_ptr_array_unref (data.ssids);
+	}
+}
+
+/* Groups @n_bss BSSs, about four per network, and returns the best time
+ * per BSS in nanoseconds of a few runs.
+ */
+static double
+group_by_key_time (guint n_bss)
+{
+	guint n_networks = MAX (n_bss / 4, 1);
+	GroupData data = { 0, };
+	gs_free FakeBss *bsss = NULL;
+	gs_unref_ptrarray GPtrArray *items = NULL;
+	gint64 best = G_MAXINT64;
+	guint i;
+
+	data.ssids = g_ptr_array_new_with_free_func ((GDestroyNotify) g_bytes_unref);
+	for (i = 0; i < n_networks; i++) {
+		gs_free char *name = g_strdup_printf ("network-%u", i);
+
+		g_ptr_array_add (data.ssids, string_to_ssid (name));
+	}
+
+	bsss = g_new0 (FakeBss, n_bss);
+	items = g_ptr_array_new ();
+	for (i = 0; i < n_bss; i++) {
+		bsss[i].network = i % n_networks;
+		g_ptr_array_add (items, &bsss[i]);
+	}
+
+	for (i = 0; i < 5; i++) {
+		gs_unref_ptrarray GPtrArray *groups = NULL;
+		gint64 start = g_get_monotonic_time ();
+
+		groups = utils_group_by_key (items->pdata, items->len, fake_bss_key, &data);
+		best = MIN (best, g_get_monotonic_time () - start);
+		g_assert_cmpuint (groups->len, ==, n_networks);
+	}
+
+	g_ptr_array_unref (data.ssids);
+	return best * 1000.0 / n_bss;
+}
+
+static void
+test_group_by_key_perf (void)
+{
+	static const guint sizes[] = { 500, 1000, 2000, 4000, 8000 };
+	double first = 0;
+	guint s;
+
+	for (s = 0; s < G_N_ELEMENTS (sizes); s++) {
+		double per_bss = group_by_key_time (sizes[s]);
+
+		g_test_message ("%5u BSSs in %u networks: %.0f ns per BSS",
+		                sizes[s], MAX (sizes[s] / 4, 1), per_bss);
+
+		/* Grouping must stay linear: the cost of a BSS doesn't grow
+		 * with the number of networks.  Leave room for cache effects
+		 * and timer resolution on the small sizes.
+		 */
+		if (s == 0)
+			first = per_bss;
+		else
+			g_assert_cmpfloat (per_bss, <, MAX (first, 1000.0) * 4);
+	}
+}
+
+static void
+test_strength_bucket (void)
+{
+	/* Without history the plain thresholds apply */
+	g_assert_cmpint (utils_strength_bucket (0, -1, 5), ==, 0);
+	g_assert_cmpint (utils_strength_bucket (5, -1, 5), ==, 0);
+	g_assert_cmpint (utils_strength_bucket (6, -1, 5), ==, 1);
+	g_assert_cmpint (utils_strength_bucket (55, -1, 5), ==, 2);
+	g_assert_cmpint (utils_strength_bucket (56, -1, 5), ==, 3);
+	g_assert_cmpint (utils_strength_bucket (100, -1, 5), ==, 4);
+
+	/* Hovering around a threshold keeps the bucket */
+	g_assert_cmpint (utils_strength_bucket (56, 2, 3), ==, 2);
+	g_assert_cmpint (utils_strength_bucket (58, 2, 3), ==, 2);
+	g_assert_cmpint (utils_strength_bucket (59, 2, 3), ==, 3);
+	g_assert_cmpint (utils_strength_bucket (53, 3, 3), ==, 3);
+	g_assert_cmpint (utils_strength_bucket (52, 3, 3), ==, 2);
+
+	/* Big jumps skip buckets, but still only as far as the hysteresis allows */
+	g_assert_cmpint (utils_strength_bucket (100, 0, 3), ==, 4);
+	g_assert_cmpint (utils_strength_bucket (82, 0, 3), ==, 3);
+	g_assert_cmpint (utils_strength_bucket (0, 4, 3), ==, 0);
+	g_assert_cmpint (utils_strength_bucket (7, 4, 3), ==, 1);
+
+	/* No hysteresis is the same as no history */
+	g_assert_cmpint (utils_strength_bucket (56, 2, 0), ==, 3);
+	g_assert_cmpint (utils_strength_bucket (55, 3, 0), ==, 2);
 }
 
 NMTST_DEFINE ();
@@ -488,6 +774,16 @@ main (int argc, char **argv)
 	g_test_add_data_func ("/ap_hash/foobar_asdf11/adhoc_wpa_rsn", data,
 	                      (GTestDataFunc) test_ap_hash_foobar_asdf11_adhoc_wpa_rsn);
 
+	/* Test that APs are grouped the same as with the old MD5 hash */
+	g_test_add_func ("/ap_hash/legacy_grouping", test_ap_hash_legacy_grouping);
+
+	g_test_add_func ("/strength_bucket", test_strength_bucket);
+
+	g_test_add_func ("/group_by_key", test_group_by_key);
+	/* Run with -m perf */
+	if (g_test_perf ())
+		g_test_add_func ("/group_by_key/perf", test_group_by_key_perf);
+
 	result = g_test_run ();
 
 	test_data_free (data);
@@ -53,19 +53,29 @@ utils_ether_addr_valid (const struct ether_addr *test_addr)
 	return TRUE;
 }
 
-char *
+/*
+ * utils_hash_ap
+ *
+ * Returns a key identifying the network an AP belongs to: APs with the
+ * same SSID, mode and class of security (none, WEP-only or WPA-capable)
+ * get the same key.  The key is only meant for grouping APs in memory and
+ * must not be stored.
+ */
+guint64
 utils_hash_ap (GBytes *ssid,
                NM80211Mode mode,
                guint32 flags,
                guint32 wpa_flags,
                guint32 rsn_flags)
 {
-	unsigned char input[66];
+	unsigned char input[33];
+	guint64 hash = 14695981039346656037ull;  /* FNV-1a offset basis */
+	gsize i;
 
 	memset (&input[0], 0, sizeof (input));
 
 	if (ssid)
-		memcpy (input, g_bytes_get_data (ssid, NULL), g_bytes_get_size (ssid));
+		memcpy (input, g_bytes_get_data (ssid, NULL), MIN (g_bytes_get_size (ssid), 32));
 
 	if (mode == NM_802_11_MODE_INFRA)
 		input[32] |= (1 << 0);
@@ -90,9 +100,109 @@ utils_hash_ap (GBytes *ssid,
 	else
 		input[32] |= (1 << 6);
 
-	/* duplicate it */
-	memcpy (&input[33], &input[0], 32);
-	return g_compute_checksum_for_data (G_CHECKSUM_MD5, input, sizeof (input));
+	/* FNV-1a, with a final avalanche so that the low bits used by hash
+	 * tables depend on the whole input.
+	 */
+	for (i = 0; i < sizeof (input); i++) {
+		hash ^= input[i];
+		hash *= 1099511628211ull;
+	}
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdull;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ull;
+	hash ^= hash >> 33;
+
+	return hash;
+}
+
+/* Returns @hash in newly allocated memory, to be used as a g_int64_hash()
+ * key of a table that frees its keys with g_free().
+ */
+guint64 *
+utils_hash_key_new (guint64 hash)
+{
+	guint64 *key = g_new (guint64, 1);
+
+	*key = hash;
+	return key;
+}
+
+/*
+ * utils_group_by_key
+ *
+ * Groups @items by the 64-bit key @get_key returns for each of them, calling
+ * @get_key exactly once per item.  Items for which @get_key returns FALSE are
+ * left out.  Returns an array of groups, each an array of items in the order
+ * they appear in @items; the groups themselves are ordered by the position of
+ * their first item.
+ */
+GPtrArray *
+utils_group_by_key (gpointer const *items,
+                    guint n_items,
+                    UtilsGroupKeyFunc get_key,
+                    gpointer user_data)
+{
+	GHashTable *index;
+	GPtrArray *groups;
+	guint i;
+
+	groups = g_ptr_array_new_with_free_func ((GDestroyNotify) g_ptr_array_unref);
+	index = g_hash_table_new_full (g_int64_hash, g_int64_equal, g_free, NULL);
+
+	for (i = 0; i < n_items; i++) {
+		GPtrArray *group;
+		guint64 key;
+
+		if (!get_key (items[i], &key, user_data))
+			continue;
+
+		group = g_hash_table_lookup (index, &key);
+		if (!group) {
+			group = g_ptr_array_new ();
+			g_ptr_array_add (groups, group);
+			g_hash_table_insert (index, utils_hash_key_new (key), group);
+		}
+		g_ptr_array_add (group, items[i]);
+	}
+
+	g_hash_table_unref (index);
+	return groups;
+}
+
+/* Lower bounds (exclusive) of the signal strength icons above nm-signal-00 */
+static const guint32 strength_thresholds[] = { 5, 30, 55, 80 };
+
+/*
+ * utils_strength_bucket
+ *
+ * Returns which of the signal strength icons (0 for nm-signal-00 up to 4
+ * for nm-signal-100) to show for @strength.  If @previous is a bucket
+ * shown before, the strength has to cross a threshold by more than
+ * @hysteresis points to move to a different one, so that a signal
+ * hovering around a threshold doesn't make the icon flip back and forth.
+ */
+int
+utils_strength_bucket (guint32 strength, int previous, guint hysteresis)
+{
+	int bucket = 0;
+
+	while (   bucket < (int) G_N_ELEMENTS (strength_thresholds)
+	       && strength > strength_thresholds[bucket])
+		bucket++;
+
+	if (previous < 0 || previous > (int) G_N_ELEMENTS (strength_thresholds))
+		return bucket;
+
+	if (bucket > previous) {
+		while (bucket > previous && strength <= strength_thresholds[bucket - 1] + hysteresis)
+			bucket--;
+	} else {
+		while (bucket < previous && strength + hysteresis > strength_thresholds[bucket])
+			bucket++;
+	}
+
+	return bucket;
 }
 
 typedef struct {
@@ -13,11 +13,22 @@
 
 gboolean utils_ether_addr_valid (const struct ether_addr *test_addr);
 
-char *utils_hash_ap (GBytes *ssid,
-                     NM80211Mode mode,
-                     guint32 flags,
-                     guint32 wpa_flags,
-                     guint32 rsn_flags);
+guint64 utils_hash_ap (GBytes *ssid,
+                       NM80211Mode mode,
+                       guint32 flags,
+                       guint32 wpa_flags,
+                       guint32 rsn_flags);
+
+guint64 *utils_hash_key_new (guint64 hash);
+
+typedef gboolean (*UtilsGroupKeyFunc) (gpointer item, guint64 *out_key, gpointer user_data);
+
+GPtrArray *utils_group_by_key (gpointer const *items,
+                               guint n_items,
+                               UtilsGroupKeyFunc get_key,
+                               gpointer user_data);
+
+int utils_strength_bucket (guint32 strength, int previous, guint hysteresis);
 
 char *utils_escape_notify_message (const char *src);
 